@@ -0,0 +1,364 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 核心内核的微基准：后缀排序、搜索（二分/搜索表）、matchlen和bspatch的加法循环。
+ * 每个内核重复若干次取最短时间，与基线文件比较，任何一个超过基线的(1+阈值)倍时
+ * 以非0状态退出（make bench）。基线只在同一台机器上有意义，换机器后先用-w重新生成
+ * 直接包含bsdiff.c以便调用其中的静态函数，bspatch_ex通过公开接口调用
+ *
+ * 另外检查时间预算：对一对完整差分远超预算的文件，带预算的bsdiff_ex（含BZip2压缩）
+ * 的耗时超过预算的(1+阈值)倍时同样失败。这一项与机器无关，不写入基线
+ */
+
+#include "../bsdiff.c"
+
+#include <bzlib.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../bspatch.h"
+
+#define USAGE "usage: %s [-r reps] [-t percent] [-w] [baselinefile]\n"
+
+#define BENCH_OLD_SIZE (2 * 1024 * 1024)      // 排序和搜索使用的旧文件大小
+#define BENCH_SEARCHES 200000                 // 每次搜索基准的搜索次数
+#define BENCH_QUERY_LEN 4096                  // 每次搜索的new长度
+#define BENCH_MATCH_SIZE (32 * 1024 * 1024)   // matchlen比较的长度
+#define BENCH_PATCH_SIZE (32 * 1024 * 1024)   // 加法循环处理的diff长度
+#define BENCH_MAX_KERNELS 16
+#define BENCH_BUDGET_SIZE (8 * 1024 * 1024)   // 时间预算检查使用的新旧文件大小
+#define BENCH_BUDGET 2.0                      // 时间预算（秒），完整差分需要数倍的时间
+
+/**
+ * 功能：一个内核的测量结果
+ */
+struct result
+{
+	const char* name;
+	double ms;          // 最短耗时（毫秒）
+};
+
+/**
+ * 功能：内存中的补丁数据（bspatch_ex的输入流）
+ */
+struct membuf
+{
+	const uint8_t* data;
+	size_t size, pos;
+};
+
+static void* bench_malloc(size_t size) { return malloc(size); }
+static void bench_free(void* ptr) { free(ptr); }
+
+/**
+ * 功能：xorshift64伪随机数（固定种子，每次运行的数据相同）
+ */
+static uint64_t nextrand(uint64_t* s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/**
+ * 功能：当前时间（毫秒）
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * 功能：从内存读取补丁数据
+ */
+static int mem_read(const struct bspatch_stream* stream, void* buffer, int length)
+{
+	struct membuf* m = (struct membuf*)stream->opaque;
+
+	if (m->size - m->pos < (size_t)length)
+		return -1;
+	memcpy(buffer, m->data + m->pos, length);
+	m->pos += length;
+	return 0;
+}
+
+/**
+ * 功能：生成类似可执行文件的数据：随机片段与对前文的带少量改动的复制交替出现
+ */
+static void generate(uint8_t* buf, int64_t size, uint64_t seed)
+{
+	uint64_t s = seed;
+	int64_t n, i, src, len;
+
+	for (n = 0; n < size; ) {
+		if (n > 4096 && nextrand(&s) % 4 != 0) {
+			src = n - 1 - (int64_t)(nextrand(&s) % (n < (1 << 20) ? n : (1 << 20)));
+			len = 16 + (int64_t)(nextrand(&s) % 256);
+			for (i = 0; i < len && n < size; i++, n++)
+				buf[n] = (nextrand(&s) % 64 == 0) ? (uint8_t)nextrand(&s) : buf[src + i];
+		} else {
+			len = 1 + (int64_t)(nextrand(&s) % 32);
+			for (i = 0; i < len && n < size; i++, n++)
+				buf[n] = (uint8_t)nextrand(&s);
+		}
+	}
+}
+
+/**
+ * 功能：把补丁数据写入BZip2流（与bsdiff命令行工具相同，压缩时间计入预算）
+ */
+static int bz2_write(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+	int bz2err;
+
+	BZ2_bzWrite(&bz2err, (BZFILE*)stream->opaque, (void*)buffer, size);
+	return (bz2err == BZ_OK) ? 0 : -1;
+}
+
+/**
+ * 功能：读取基线文件中某个内核的耗时
+ * 返回：耗时（毫秒），没有该内核时返回-1
+ */
+static double baseline(const char* path, const char* name)
+{
+	char line[256], key[64];
+	double ms;
+	FILE* f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%63s %lf", key, &ms) == 2 && strcmp(key, name) == 0) {
+			fclose(f);
+			return ms;
+		}
+	}
+	fclose(f);
+	return -1;
+}
+
+int main(int argc, char* argv[])
+{
+	struct result results[BENCH_MAX_KERNELS];
+	struct bsdiff_stream stream;
+	struct bsdiff_options options;
+	struct bsdiff_index idx;
+	struct bspatch_stream pstream;
+	struct membuf m;
+	uint8_t *old, *new, *a, *b, *patch, *out;
+	int64_t pos, sum, i, q, *queries;
+	double t, best, base, threshold = 25;
+	int reps = 5, write = 0, nresults = 0, slow = 0, degraded, bz2err, r, k, ch;
+	BZFILE* bz2;
+	const char* path = NULL;
+	uint64_t s = 88172645463325252ULL;
+	FILE* f;
+
+	while ((ch = getopt(argc, argv, "r:t:w")) != -1) {
+		switch (ch) {
+		case 'r': reps = atoi(optarg); break;
+		case 't': threshold = atof(optarg); break;
+		case 'w': write = 1; break;
+		default: errx(1, USAGE, argv[0]);
+		}
+	}
+	if (argc - optind > 1 || reps < 1 || (write && argc - optind != 1))
+		errx(1, USAGE, argv[0]);
+	if (argc - optind == 1)
+		path = argv[optind];
+
+	/* 准备数据：旧文件、改动过的新文件、搜索位置 */
+	if ((old = malloc(BENCH_OLD_SIZE + 1)) == NULL ||
+		(new = malloc(BENCH_OLD_SIZE + 1)) == NULL ||
+		(queries = malloc(BENCH_SEARCHES * sizeof(int64_t))) == NULL)
+		err(1, NULL);
+	generate(old, BENCH_OLD_SIZE, 1);
+	memcpy(new, old, BENCH_OLD_SIZE);
+	for (i = 0; i < BENCH_OLD_SIZE; i += 1 + (int64_t)(nextrand(&s) % 2048))
+		new[i] ^= (uint8_t)(1 + nextrand(&s) % 255);
+	for (q = 0; q < BENCH_SEARCHES; q++)
+		queries[q] = (int64_t)(nextrand(&s) % (BENCH_OLD_SIZE - BENCH_QUERY_LEN));
+	stream.malloc = bench_malloc;
+	stream.free = bench_free;
+
+	/* 后缀排序 */
+	best = 0;
+	for (r = 0; r < reps; r++) {
+		t = now();
+		if (buildindex(&idx, old, BENCH_OLD_SIZE, 0, NULL, NULL, &stream))
+			errx(1, "buildindex");
+		t = now() - t;
+		if (r == 0 || t < best)
+			best = t;
+		if (r + 1 < reps)
+			freeindex(&idx, &stream);
+	}
+	results[nresults].name = "sort";
+	results[nresults++].ms = best;
+
+	/* 搜索：二分，以及使用搜索表（排序结果不变，只另建搜索表） */
+	if ((idx.T = malloc(((size_t)1 << SEARCH_TABLE_LEVELS) * sizeof(struct search_node))) == NULL)
+		err(1, NULL);
+	for (idx.levels = 0; idx.levels < SEARCH_TABLE_LEVELS && ((int64_t)1 << idx.levels) < BENCH_OLD_SIZE; idx.levels++);
+	buildtable(idx.T, 1, idx.levels, idx.I, old, BENCH_OLD_SIZE, 0, BENCH_OLD_SIZE);
+	for (k = 0; k < 2; k++) {
+		best = 0;
+		for (r = 0; r < reps; r++) {
+			t = now();
+			for (q = 0, sum = 0; q < BENCH_SEARCHES; q++)
+				sum += k ? searchtable(idx.T, idx.levels, idx.I, old, BENCH_OLD_SIZE,
+						new + queries[q], BENCH_QUERY_LEN, &pos) :
+					search(idx.I, old, BENCH_OLD_SIZE, new + queries[q], BENCH_QUERY_LEN,
+						0, BENCH_OLD_SIZE, &pos);
+			t = now() - t;
+			if (sum == 0)
+				errx(1, "search found nothing");
+			if (r == 0 || t < best)
+				best = t;
+		}
+		results[nresults].name = k ? "searchtable" : "search";
+		results[nresults++].ms = best;
+	}
+	freeindex(&idx, &stream);
+
+	/* matchlen：两段完全相同的数据，从头比较到尾 */
+	if ((a = malloc(BENCH_MATCH_SIZE)) == NULL || (b = malloc(BENCH_MATCH_SIZE)) == NULL)
+		err(1, NULL);
+	for (i = 0; i < BENCH_MATCH_SIZE; i++)
+		a[i] = b[i] = old[i % BENCH_OLD_SIZE];
+	best = 0;
+	for (r = 0; r < reps; r++) {
+		t = now();
+		if (matchlen(a, BENCH_MATCH_SIZE, b, BENCH_MATCH_SIZE) != BENCH_MATCH_SIZE)
+			errx(1, "matchlen");
+		t = now() - t;
+		if (r == 0 || t < best)
+			best = t;
+	}
+	results[nresults].name = "matchlen";
+	results[nresults++].ms = best;
+
+	/* bspatch的加法循环：一条BSDIFF43控制记录，整个新文件都是diff数据 */
+	if ((patch = calloc(24 + BENCH_PATCH_SIZE, 1)) == NULL || (out = malloc(BENCH_PATCH_SIZE + 1)) == NULL)
+		err(1, NULL);
+	bscodec_offtout(BENCH_PATCH_SIZE, patch);
+	for (i = 0; i < BENCH_PATCH_SIZE; i++)
+		patch[24 + i] = (uint8_t)(b[i] - a[(i + 1) % BENCH_MATCH_SIZE]);
+	pstream.opaque = &m;
+	pstream.read = mem_read;
+	best = 0;
+	for (r = 0; r < reps; r++) {
+		m.data = patch;
+		m.size = 24 + BENCH_PATCH_SIZE;
+		m.pos = 0;
+		t = now();
+		if (bspatch(a, BENCH_MATCH_SIZE, out, BENCH_PATCH_SIZE, &pstream))
+			errx(1, "bspatch");
+		t = now() - t;
+		if (r == 0 || t < best)
+			best = t;
+	}
+	results[nresults].name = "patch";
+	results[nresults++].ms = best;
+	free(patch);
+	free(out);
+	free(a);
+	free(b);
+	free(queries);
+	free(new);
+	free(old);
+
+	/* 时间预算：类似可执行文件的数据，新文件散布着少量改动，BZip2压缩后丢弃 */
+	if ((old = malloc(BENCH_BUDGET_SIZE + 1)) == NULL || (new = malloc(BENCH_BUDGET_SIZE + 1)) == NULL)
+		err(1, NULL);
+	generate(old, BENCH_BUDGET_SIZE, 2);
+	memcpy(new, old, BENCH_BUDGET_SIZE);
+	for (i = 0; i < BENCH_BUDGET_SIZE; i += 1 + (int64_t)(nextrand(&s) % 4096))
+		new[i] ^= (uint8_t)(1 + nextrand(&s) % 255);
+	if ((f = fopen("/dev/null", "w")) == NULL)
+		err(1, "/dev/null");
+	memset(&options, 0, sizeof(options));
+	options.format = BSDIFF_FORMAT_44;
+	options.budget = BENCH_BUDGET;
+	options.degraded = &degraded;
+	t = now();
+	if ((bz2 = BZ2_bzWriteOpen(&bz2err, f, 9, 0, 0)) == NULL)
+		errx(1, "BZ2_bzWriteOpen");
+	stream.opaque = bz2;
+	stream.write = bz2_write;
+	if (bsdiff_ex(old, BENCH_BUDGET_SIZE, new, BENCH_BUDGET_SIZE, &stream, &options))
+		errx(1, "bsdiff_ex");
+	BZ2_bzWriteClose(&bz2err, bz2, 0, NULL, NULL);
+	if (bz2err != BZ_OK)
+		errx(1, "BZ2_bzWriteClose");
+	t = now() - t;
+	fclose(f);
+	free(new);
+	free(old);
+
+	/* 写出基线 */
+	if (write) {
+		if ((f = fopen(path, "w")) == NULL)
+			err(1, "%s", path);
+		fprintf(f, "# kernel milliseconds (best of %d); regenerate with make bench-baseline\n", reps);
+		for (k = 0; k < nresults; k++)
+			fprintf(f, "%s %.2f\n", results[k].name, results[k].ms);
+		if (fclose(f))
+			err(1, "%s", path);
+	}
+
+	/* 报告，并与基线比较 */
+	for (k = 0; k < nresults; k++) {
+		base = (path != NULL && !write) ? baseline(path, results[k].name) : -1;
+		if (base > 0) {
+			printf("%-12s %10.2f ms  baseline %10.2f ms  %+6.1f%%%s\n", results[k].name, results[k].ms, base,
+					100 * (results[k].ms / base - 1), results[k].ms > base * (1 + threshold / 100) ? "  SLOWER" : "");
+			if (results[k].ms > base * (1 + threshold / 100))
+				slow++;
+		} else
+			printf("%-12s %10.2f ms\n", results[k].name, results[k].ms);
+	}
+	printf("%-12s %10.2f ms  budget   %10.2f ms  %+6.1f%%%s\n", "budget", t, BENCH_BUDGET * 1e3,
+			100 * (t / (BENCH_BUDGET * 1e3) - 1), t > BENCH_BUDGET * 1e3 * (1 + threshold / 100) ? "  OVER" : "");
+	if (!degraded)
+		warnx("the budget check finished without degrading; raise BENCH_BUDGET_SIZE");
+	if (slow)
+		errx(1, "%d kernel(s) more than %.0f%% slower than the baseline", slow, threshold);
+	if (t > BENCH_BUDGET * 1e3 * (1 + threshold / 100))
+		errx(1, "bsdiff_ex took more than %.0f%% over its time budget", threshold);
+	return 0;
+}
@@ -0,0 +1,235 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 大块内存分配器：大页与NUMA放置
+ *
+ * 后缀数组I和逆后缀数组V在排序和搜索时几乎是随机访问的，数组很大时TLB缺失和跨节点访问
+ * 占了相当一部分时间。不小于BSALLOC_MIN_SIZE的分配单独mmap，在首次访问之前设置大页和
+ * NUMA策略；任何一步不可用时依次退回，最终退回malloc。
+ * 每块内存前有一个HEADER_SIZE字节的头部，记录释放时需要的信息。
+ */
+
+#include "bsalloc.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__linux__)
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+// 头部大小（保持返回地址64字节对齐）
+#define HEADER_SIZE 64
+// 2MB和1GB大页的大小
+#define HUGE_2M ((size_t)1 << 21)
+#define HUGE_1G ((size_t)1 << 30)
+
+#if defined(__linux__)
+# ifndef MAP_HUGE_SHIFT
+#  define MAP_HUGE_SHIFT 26
+# endif
+// 内存策略（与<numaif.h>相同，这里直接使用系统调用，不依赖libnuma）
+# define MPOL_PREFERRED 1
+# define MPOL_INTERLEAVE 3
+# define MPOL_LOCAL 4
+# define MPOL_F_MEMS_ALLOWED (1 << 2)
+// 节点掩码的位数
+# define MAX_NODES 1024
+#endif
+
+/**
+ * 功能：每块内存前的头部
+ */
+struct header
+{
+	void* base;        // mmap返回的地址（malloc分配时为NULL）
+	size_t length;     // 映射长度
+};
+
+static int config;     // 当前策略（BSALLOC_*组合）
+static int applied;    // 实际生效过的策略
+
+void bsalloc_configure(int flags)
+{
+	config = flags;
+}
+
+int bsalloc_applied(void)
+{
+	return applied;
+}
+
+/**
+ * 功能：用malloc分配（小块内存或所有策略都不可用时）
+ */
+static void* plainalloc(size_t size)
+{
+	uint8_t* p;
+
+	if ((p = malloc(size + HEADER_SIZE)) == NULL)
+		return NULL;
+	((struct header*)p)->base = NULL;
+	((struct header*)p)->length = 0;
+	return p + HEADER_SIZE;
+}
+
+#if defined(__linux__)
+
+/**
+ * 功能：从hugetlbfs预留的大页中映射内存
+ * 参数：
+ *   - length: 映射长度（会向上取整到页大小）
+ *   - page: 大页大小（HUGE_2M或HUGE_1G）
+ * 返回：
+ *   - 映射地址，失败时返回NULL
+ */
+static void* maphugetlb(size_t* length, size_t page)
+{
+	void* p;
+	int shift = (page == HUGE_1G) ? 30 : 21;
+
+	*length = (*length + page - 1) & ~(page - 1);
+	p = mmap(NULL, *length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+/**
+ * 功能：映射按2MB对齐的普通内存，使透明大页可以覆盖整个区域
+ * 参数：
+ *   - length: 映射长度（会向上取整到2MB）
+ * 返回：
+ *   - 映射地址，失败时返回NULL
+ */
+static void* mapaligned(size_t* length)
+{
+	uint8_t *p, *aligned;
+	size_t slop;
+
+	*length = (*length + HUGE_2M - 1) & ~(HUGE_2M - 1);
+	// 多映射2MB，再把首尾不对齐的部分还给系统
+	p = mmap(NULL, *length + HUGE_2M, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	aligned = (uint8_t*)(((uintptr_t)p + HUGE_2M - 1) & ~(uintptr_t)(HUGE_2M - 1));
+	slop = aligned - p;
+	if (slop)
+		munmap(p, slop);
+	if (HUGE_2M - slop)
+		munmap(aligned + *length, HUGE_2M - slop);
+	return aligned;
+}
+
+/**
+ * 功能：为尚未访问过的映射设置NUMA策略
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败（系统不支持或没有权限）
+ */
+static int setpolicy(void* p, size_t length, int flags)
+{
+	unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+
+	if (flags & BSALLOC_NUMA_INTERLEAVE) {
+		// 在当前进程允许使用的所有节点之间交错
+		if (syscall(SYS_get_mempolicy, NULL, mask, MAX_NODES, NULL, MPOL_F_MEMS_ALLOWED))
+			return -1;
+		return syscall(SYS_mbind, p, length, MPOL_INTERLEAVE, mask, MAX_NODES, 0) ? -1 : 0;
+	}
+	if (flags & BSALLOC_NUMA_LOCAL) {
+		// 旧内核没有MPOL_LOCAL，空掩码的MPOL_PREFERRED与之等价
+		if (syscall(SYS_mbind, p, length, MPOL_LOCAL, NULL, 0, 0) == 0)
+			return 0;
+		return syscall(SYS_mbind, p, length, MPOL_PREFERRED, NULL, 0, 0) ? -1 : 0;
+	}
+	return 0;
+}
+
+#endif
+
+void* bsalloc_malloc(size_t size)
+{
+#if defined(__linux__)
+	uint8_t* p = NULL;
+	size_t length;
+	int used = 0;
+
+	if (size < BSALLOC_MIN_SIZE || config == 0)
+		return plainalloc(size);
+
+	// 按1GB大页、2MB大页、透明大页（或普通页）的顺序尝试
+	if (config & BSALLOC_HUGE_1G) {
+		length = size + HEADER_SIZE;
+		if ((p = maphugetlb(&length, HUGE_1G)) != NULL)
+			used = BSALLOC_HUGE_1G;
+	}
+	if (p == NULL && (config & (BSALLOC_HUGE_1G | BSALLOC_HUGE_2M))) {
+		length = size + HEADER_SIZE;
+		if ((p = maphugetlb(&length, HUGE_2M)) != NULL)
+			used = BSALLOC_HUGE_2M;
+	}
+	if (p == NULL) {
+		length = size + HEADER_SIZE;
+		if ((p = mapaligned(&length)) == NULL)
+			return plainalloc(size);
+		if ((config & (BSALLOC_HUGE_THP | BSALLOC_HUGE_2M | BSALLOC_HUGE_1G)) &&
+			madvise(p, length, MADV_HUGEPAGE) == 0)
+			used = BSALLOC_HUGE_THP;
+	}
+
+	// 策略必须在首次访问（写入头部）之前设置
+	if ((config & (BSALLOC_NUMA_INTERLEAVE | BSALLOC_NUMA_LOCAL)) &&
+		setpolicy(p, length, config) == 0)
+		used |= config & (BSALLOC_NUMA_INTERLEAVE | BSALLOC_NUMA_LOCAL);
+	applied |= used;
+
+	((struct header*)p)->base = p;
+	((struct header*)p)->length = length;
+	return p + HEADER_SIZE;
+#else
+	return plainalloc(size);
+#endif
+}
+
+void bsalloc_free(void* ptr)
+{
+	struct header* h;
+
+	if (ptr == NULL)
+		return;
+	h = (struct header*)((uint8_t*)ptr - HEADER_SIZE);
+#if defined(__linux__)
+	if (h->base != NULL) {
+		munmap(h->base, h->length);
+		return;
+	}
+#endif
+	free(h);
+}
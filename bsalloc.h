@@ -0,0 +1,75 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSALLOC_H
+# define BSALLOC_H
+
+# include <stddef.h>
+
+// 大页：对大块内存使用透明大页（madvise(MADV_HUGEPAGE)）
+# define BSALLOC_HUGE_THP 0x1
+// 大页：从hugetlbfs预留的2MB大页中分配，失败时退回透明大页
+# define BSALLOC_HUGE_2M 0x2
+// 大页：从hugetlbfs预留的1GB大页中分配，失败时依次退回2MB大页和透明大页
+# define BSALLOC_HUGE_1G 0x4
+// NUMA：大块内存在所有允许的节点之间交错分布
+# define BSALLOC_NUMA_INTERLEAVE 0x10
+// NUMA：大块内存分配在首次访问它的线程所在的节点（覆盖进程级的交错策略，例如numactl --interleave）
+# define BSALLOC_NUMA_LOCAL 0x20
+
+// 不小于此大小的分配才使用上述策略，较小的分配直接使用malloc
+# define BSALLOC_MIN_SIZE ((size_t)2 << 20)
+
+/**
+ * 功能：设置之后的大块分配使用的策略
+ * 参数：
+ *   - flags: BSALLOC_*组合
+ */
+void bsalloc_configure(int flags);
+
+/**
+ * 功能：返回到目前为止实际生效过的策略（BSALLOC_*组合），用于判断是否发生了退回
+ */
+int bsalloc_applied(void);
+
+/**
+ * 功能：分配内存，可以直接作为bsdiff_stream的malloc函数
+ * 参数：
+ *   - size: 字节数
+ * 返回：
+ *   - 内存地址，失败时返回NULL
+ */
+void* bsalloc_malloc(size_t size);
+
+/**
+ * 功能：释放bsalloc_malloc分配的内存，可以直接作为bsdiff_stream的free函数
+ * 参数：
+ *   - ptr: 内存地址（可以为NULL）
+ */
+void bsalloc_free(void* ptr);
+
+#endif
@@ -0,0 +1,307 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 按内容寻址的补丁缓存
+ *
+ * 缓存目录布局：<dir>/<键的前2个十六进制字符>/<键的64个十六进制字符>.patch
+ * 写入时先在<dir>下创建临时文件.tmp-XXXXXX，写完并fsync后rename到最终位置；
+ * 命中时更新补丁的修改时间，淘汰时按修改时间从旧到新删除。
+ */
+
+#include "bscache.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// 两个输入的总大小不小于此值时才使用线程并行计算哈希
+#define PARALLEL_MIN_SIZE (1<<20)
+// 缓存键的版本前缀，键的计算方式改变时需要修改
+#define KEY_MAGIC "BSCACHE1"
+
+/**
+ * 功能：哈希线程的参数
+ */
+struct hashjob
+{
+	const uint8_t* data;       // 数据
+	int64_t size;              // 数据大小
+	uint8_t out[BSHASH_LEN];   // 输出的摘要
+};
+
+/**
+ * 功能：哈希线程入口
+ */
+static void* hashthread(void* arg)
+{
+	struct hashjob* job=arg;
+
+	bshash_buffer(job->data,job->size,job->out);
+	return NULL;
+}
+
+/**
+ * 功能：将int64_t编码为8字节小端序
+ */
+static void put64(int64_t x,uint8_t buf[8])
+{
+	int i;
+
+	for(i=0;i<8;i++) buf[i]=(uint8_t)((uint64_t)x>>(8*i));
+}
+
+int bscache_key(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+		const char* settings, uint8_t key[BSCACHE_KEY_LEN])
+{
+	struct hashjob jobs[2];
+	pthread_t thread;
+	struct bshash h;
+	uint8_t buf[8];
+	int threaded=0;
+
+	jobs[0].data=old;
+	jobs[0].size=oldsize;
+	jobs[1].data=new;
+	jobs[1].size=newsize;
+
+	// 旧文件在另一个线程中计算，新文件在当前线程中计算；线程创建失败时退回顺序计算
+	if(oldsize+newsize>=PARALLEL_MIN_SIZE)
+		threaded=(pthread_create(&thread,NULL,hashthread,&jobs[0])==0);
+	if(!threaded) hashthread(&jobs[0]);
+	hashthread(&jobs[1]);
+	if(threaded&&pthread_join(thread,NULL)) return -1;
+
+	// 键 = H(版本前缀 || 设置 || 0 || 旧文件大小 || H(旧文件) || 新文件大小 || H(新文件))
+	bshash_init(&h);
+	bshash_update(&h,KEY_MAGIC,strlen(KEY_MAGIC));
+	bshash_update(&h,settings,strlen(settings)+1);
+	put64(oldsize,buf);
+	bshash_update(&h,buf,sizeof(buf));
+	bshash_update(&h,jobs[0].out,BSHASH_LEN);
+	put64(newsize,buf);
+	bshash_update(&h,buf,sizeof(buf));
+	bshash_update(&h,jobs[1].out,BSHASH_LEN);
+	bshash_final(&h,key);
+
+	return 0;
+}
+
+/**
+ * 功能：生成缓存键对应的子目录和文件路径
+ * 参数：
+ *   - dir: 缓存目录
+ *   - key: 缓存键
+ *   - subdir: 输出的子目录路径（可以为NULL）
+ *   - path: 输出的补丁文件路径
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 路径过长
+ */
+static int keypath(const char* dir,const uint8_t key[BSCACHE_KEY_LEN],char subdir[PATH_MAX],
+		char path[PATH_MAX])
+{
+	char hex[2*BSCACHE_KEY_LEN+1];
+	int i;
+
+	for(i=0;i<BSCACHE_KEY_LEN;i++)
+		sprintf(hex+2*i,"%02x",key[i]);
+	if(subdir&&(snprintf(subdir,PATH_MAX,"%s/%.2s",dir,hex)>=PATH_MAX))
+		return -1;
+	if(snprintf(path,PATH_MAX,"%s/%.2s/%s.patch",dir,hex,hex)>=PATH_MAX)
+		return -1;
+	return 0;
+}
+
+/**
+ * 功能：把一个已打开的文件的全部内容复制到另一个已打开的文件
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+static int copyfd(int in,int out)
+{
+	char buf[65536];
+	ssize_t n,w,done;
+
+	while((n=read(in,buf,sizeof(buf)))!=0) {
+		if(n<0) {
+			if(errno==EINTR) continue;
+			return -1;
+		};
+		for(done=0;done<n;done+=w)
+			if((w=write(out,buf+done,n-done))<0) return -1;
+	};
+	return 0;
+}
+
+int bscache_fetch(const char* dir, const uint8_t key[BSCACHE_KEY_LEN], const char* patchfile)
+{
+	char path[PATH_MAX];
+	int in,out,result;
+
+	if(keypath(dir,key,NULL,path)) return -1;
+	if((in=open(path,O_RDONLY))<0)
+		return (errno==ENOENT) ? 1 : -1;
+
+	// 更新修改时间，使最近命中的补丁最后被淘汰
+	futimens(in,NULL);
+
+	if((out=open(patchfile,O_WRONLY|O_CREAT|O_TRUNC,0666))<0) {
+		close(in);
+		return -1;
+	};
+	result=copyfd(in,out);
+	close(in);
+	if(close(out)) result=-1;
+
+	return result;
+}
+
+/**
+ * 功能：缓存中的一个补丁（淘汰时使用）
+ */
+struct cached
+{
+	char* path;        // 补丁文件路径
+	time_t mtime;      // 修改时间（最近一次写入或命中）
+	uint64_t size;     // 文件大小
+};
+
+/**
+ * 功能：按修改时间从旧到新排序
+ */
+static int bymtime(const void* a,const void* b)
+{
+	const struct cached* x=a;
+	const struct cached* y=b;
+
+	return (x->mtime>y->mtime)-(x->mtime<y->mtime);
+}
+
+/**
+ * 功能：淘汰最久未使用的补丁，直到缓存总大小不超过maxsize
+ * 参数：
+ *   - dir: 缓存目录
+ *   - maxsize: 缓存总大小上限（字节数）
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ *
+ * 多个进程同时淘汰时可能删除同一个文件，已不存在的文件被忽略
+ */
+static int evict(const char* dir,uint64_t maxsize)
+{
+	DIR *top,*sub;
+	struct dirent *d,*f;
+	struct stat sb;
+	struct cached* list=NULL;
+	struct cached* grown;
+	size_t n=0,cap=0,i;
+	uint64_t total=0;
+	char subdir[PATH_MAX],path[PATH_MAX];
+	int result=0;
+
+	if((top=opendir(dir))==NULL) return -1;
+	while((d=readdir(top))!=NULL) {
+		// 只进入由两个十六进制字符命名的子目录
+		if((strlen(d->d_name)!=2)||(strspn(d->d_name,"0123456789abcdef")!=2)) continue;
+		if(snprintf(subdir,sizeof(subdir),"%s/%s",dir,d->d_name)>=(int)sizeof(subdir)) continue;
+		if((sub=opendir(subdir))==NULL) continue;
+		while((f=readdir(sub))!=NULL) {
+			if((f->d_name[0]=='.')||(strstr(f->d_name,".patch")==NULL)) continue;
+			if(snprintf(path,sizeof(path),"%s/%s",subdir,f->d_name)>=(int)sizeof(path)) continue;
+			if(stat(path,&sb)||!S_ISREG(sb.st_mode)) continue;
+			if(n==cap) {
+				cap=cap ? 2*cap : 64;
+				if((grown=realloc(list,cap*sizeof(*list)))==NULL) { result=-1; break; };
+				list=grown;
+			};
+			if((list[n].path=strdup(path))==NULL) { result=-1; break; };
+			list[n].mtime=sb.st_mtime;
+			list[n].size=sb.st_size;
+			total+=sb.st_size;
+			n++;
+		};
+		closedir(sub);
+		if(result) break;
+	};
+	closedir(top);
+
+	if(result==0) {
+		qsort(list,n,sizeof(*list),bymtime);
+		for(i=0;(i<n)&&(total>maxsize);i++) {
+			if(unlink(list[i].path)&&(errno!=ENOENT)) result=-1;
+			total-=list[i].size;
+		};
+	};
+
+	for(i=0;i<n;i++) free(list[i].path);
+	free(list);
+	return result;
+}
+
+int bscache_store(const char* dir, const uint8_t key[BSCACHE_KEY_LEN], const char* patchfile,
+		uint64_t maxsize)
+{
+	char subdir[PATH_MAX],path[PATH_MAX],tmp[PATH_MAX];
+	int in,out,result;
+
+	if(keypath(dir,key,subdir,path)) return -1;
+	if(snprintf(tmp,sizeof(tmp),"%s/.tmp-XXXXXX",dir)>=(int)sizeof(tmp)) return -1;
+	if((mkdir(dir,0777)&&(errno!=EEXIST))||(mkdir(subdir,0777)&&(errno!=EEXIST)))
+		return -1;
+
+	// 先完整写入临时文件并落盘，再rename到最终位置
+	if((in=open(patchfile,O_RDONLY))<0) return -1;
+	if((out=mkstemp(tmp))<0) {
+		close(in);
+		return -1;
+	};
+	result=copyfd(in,out);
+	close(in);
+	if((result==0)&&(fchmod(out,0644)||fsync(out))) result=-1;
+	if(close(out)) result=-1;
+	if((result==0)&&rename(tmp,path)) result=-1;
+	if(result) {
+		unlink(tmp);
+		return -1;
+	};
+
+	if(maxsize)
+		return evict(dir,maxsize);
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSCACHE_H
+# define BSCACHE_H
+
+# include <stdint.h>
+
+# include "bshash.h"
+
+// 缓存键长度（字节数）
+# define BSCACHE_KEY_LEN BSHASH_LEN
+
+/**
+ * 功能：计算补丁缓存键
+ * 参数：
+ *   - old/oldsize: 旧文件数据及大小
+ *   - new/newsize: 新文件数据及大小
+ *   - settings: 影响补丁内容的全部设置（差分引擎、选项、补丁格式、压缩器及其参数）的文本描述
+ *   - key: 输出的缓存键（BSCACHE_KEY_LEN字节）
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ *
+ * 两个输入较大时分别在两个线程中计算哈希
+ */
+int bscache_key(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+		const char* settings, uint8_t key[BSCACHE_KEY_LEN]);
+
+/**
+ * 功能：在缓存目录中查找补丁，命中时复制到patchfile
+ * 参数：
+ *   - dir: 缓存目录
+ *   - key: 缓存键
+ *   - patchfile: 输出的补丁文件路径
+ * 返回：
+ *   - 0: 命中
+ *   - 1: 未命中
+ *   - -1: 失败
+ */
+int bscache_fetch(const char* dir, const uint8_t key[BSCACHE_KEY_LEN], const char* patchfile);
+
+/**
+ * 功能：把补丁文件加入缓存目录，然后淘汰最久未使用的补丁，直到缓存总大小不超过maxsize
+ * 参数：
+ *   - dir: 缓存目录（不存在时创建）
+ *   - key: 缓存键
+ *   - patchfile: 要加入缓存的补丁文件路径
+ *   - maxsize: 缓存总大小上限（字节数），0表示不限制
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ *
+ * 补丁先写入临时文件，再通过rename原子地发布，并发的读者和写者不会看到不完整的补丁
+ */
+int bscache_store(const char* dir, const uint8_t key[BSCACHE_KEY_LEN], const char* patchfile,
+		uint64_t maxsize);
+
+#endif
@@ -0,0 +1,153 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 补丁文件的整数编码，bsdiff、bspatch、bsdiffd和bstranscode共用
+ */
+
+#include "bscodec.h"
+
+/**
+ * 功能：将大端序的8字节数据转换为有符号64位整数（补丁文件使用此格式）
+ * 参数：
+ *   - buf: 指向8字节缓冲区的指针，使用大端序（网络字节序）存储
+ * 返回：转换后的有符号64位整数
+ * 
+ * 原理：大端序是最高字节在前，小端序是最低字节在前
+ *       这里将8个大端序字节组合成一个64位整数，并处理符号位
+ */
+int64_t bscodec_offtin(const uint8_t *buf)
+{
+	int64_t y;  // 用于存储最终结果的64位有符号整数
+    
+	// 从高位到低位逐字节组合
+	y=buf[7]&0x7F;           // 取第8个字节（最高字节）的低7位，清空符号位
+    y=y*256;y+=buf[6];       // 左移1字节（乘以256），加上第7个字节
+	y=y*256;y+=buf[5];       // 继续左移并加上第6个字节
+	y=y*256;y+=buf[4];       // 继续左移并加上第5个字节
+	y=y*256;y+=buf[3];       // 继续左移并加上第4个字节
+	y=y*256;y+=buf[2];       // 继续左移并加上第3个字节
+	y=y*256;y+=buf[1];       // 继续左移并加上第2个字节
+	y=y*256;y+=buf[0];       // 继续左移并加上第1个字节（最低字节）
+
+	// 判断符号位（第8个字节的最高位）
+	if(buf[7]&0x80) y=-y;    // 如果符号位为1，表示负数，需要取反
+
+	return y;
+}
+
+/**
+ * 功能：将有符号64位整数转换为8字节的大端序（big-endian）字节数组
+ * 参数：
+ *   - x: 要转换的64位整数
+ *   - buf: 输出缓冲区（8字节）
+ * 
+ * 注意：使用大端序存储，便于网络传输和跨平台兼容性
+ */
+void bscodec_offtout(int64_t x,uint8_t *buf)
+{
+	int64_t y;  // 用于存储x的绝对值
+
+	// 如果是负数，先取绝对值（后续会处理符号位）
+	if(x<0) y=-x; else y=x;
+
+	// 将y从低位到高位逐字节分解（大端序：高字节在前）
+	buf[0]=y%256;y-=buf[0];      // 最低字节
+	y=y/256;buf[1]=y%256;y-=buf[1];
+	y=y/256;buf[2]=y%256;y-=buf[2];
+	y=y/256;buf[3]=y%256;y-=buf[3];
+	y=y/256;buf[4]=y%256;y-=buf[4];
+	y=y/256;buf[5]=y%256;y-=buf[5];
+	y=y/256;buf[6]=y%256;y-=buf[6];
+	y=y/256;buf[7]=y%256;         // 最高字节
+
+	// 如果原数是负数，设置最高字节的最高位作为符号位
+	if(x<0) buf[7]|=0x80;
+}
+
+/**
+ * 功能：将无符号整数编码为LEB128变长整数（每字节7位，最高位表示后面还有字节）
+ * 参数：
+ *   - x: 要编码的整数
+ *   - buf: 输出缓冲区（至少10字节）
+ * 返回：编码后的字节数
+ */
+int bscodec_varintout(uint64_t x,uint8_t *buf)
+{
+	int n=0;
+
+	while(x>=0x80) {
+		buf[n++]=(uint8_t)(x|0x80);
+		x>>=7;
+	};
+	buf[n++]=(uint8_t)x;
+
+	return n;
+}
+
+/**
+ * 功能：批量解码BSDIFF44控制块中的全部控制记录
+ * 参数：
+ *   - buf: 控制数据（LEB128变长整数，每条记录fields个）
+ *   - len: 控制数据字节数
+ *   - ctrl: 输出的控制记录数组
+ *   - count: 记录数
+ *   - fields: 每条记录的控制值个数（普通补丁为3，多基准补丁为4），最后一个为有符号偏移
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 数据损坏（变长整数越界、超过64位（含第10字节的溢出位）或控制数据有多余字节）
+ */
+int bscodec_decodeblock(const uint8_t *buf,int len,int64_t (*ctrl)[4],int count,int fields)
+{
+	uint64_t v;     // 当前解码的值
+	int p=0;        // 当前读取位置
+	int i,j,shift;
+
+	for(i=0;i<count;i++) {
+		for(j=0;j<fields;j++) {
+			v=0;shift=0;
+			do {
+				if((p>=len)||(shift>63)) return -1;
+				// 第10个字节只能提供第63位，其余有效位会溢出64位
+				if((shift==63)&&(buf[p]&0x7E)) return -1;
+				v|=(uint64_t)(buf[p]&0x7F)<<shift;
+				shift+=7;
+			} while(buf[p++]&0x80);
+
+			if(j<fields-1) {
+				// 长度（及多基准补丁的旧文件序号），不能超出int64_t范围
+				if(v>INT64_MAX) return -1;
+				ctrl[i][j]=(int64_t)v;
+			} else {
+				// 最后一个为zigzag编码的有符号偏移
+				ctrl[i][j]=(int64_t)(v>>1)^-(int64_t)(v&1);
+			}
+		};
+	};
+
+	return (p==len) ? 0 : -1;
+}
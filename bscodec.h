@@ -0,0 +1,77 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSCODEC_H
+# define BSCODEC_H
+
+# include <stdint.h>
+
+// BSDIFF44格式中每个控制块最多包含的记录数及控制数据的最大字节数
+// （多基准补丁每条记录4个控制值，每个LEB128变长整数最多10字节）
+# define BSDIFF44_BLOCK_RECORDS 256
+# define BSDIFF44_BLOCK_BYTES(fields) (BSDIFF44_BLOCK_RECORDS * (fields) * 10)
+
+/**
+ * 功能：将补丁文件使用的8字节编码转换为有符号64位整数
+ * 参数：
+ *   - buf: 8字节缓冲区（低字节在前，最高字节的最高位为符号位）
+ * 返回：转换后的有符号64位整数
+ */
+int64_t bscodec_offtin(const uint8_t *buf);
+
+/**
+ * 功能：将有符号64位整数转换为补丁文件使用的8字节编码（与bscodec_offtin对应）
+ * 参数：
+ *   - x: 要转换的64位整数
+ *   - buf: 输出缓冲区（8字节）
+ */
+void bscodec_offtout(int64_t x, uint8_t *buf);
+
+/**
+ * 功能：将无符号整数编码为LEB128变长整数（每字节7位，最高位表示后面还有字节）
+ * 参数：
+ *   - x: 要编码的整数
+ *   - buf: 输出缓冲区（至少10字节）
+ * 返回：编码后的字节数
+ */
+int bscodec_varintout(uint64_t x, uint8_t *buf);
+
+/**
+ * 功能：批量解码BSDIFF44控制块中的全部控制记录
+ * 参数：
+ *   - buf: 控制数据（LEB128变长整数，每条记录fields个）
+ *   - len: 控制数据字节数
+ *   - ctrl: 输出的控制记录数组
+ *   - count: 记录数
+ *   - fields: 每条记录的控制值个数（普通补丁为3，多基准补丁为4），最后一个为zigzag编码的有符号偏移
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 数据损坏（变长整数越界、超过64位或控制数据有多余字节）
+ */
+int bscodec_decodeblock(const uint8_t *buf, int len, int64_t (*ctrl)[4], int count, int fields);
+
+#endif
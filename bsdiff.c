@@ -26,9 +26,11 @@
  */
 
 #include "bsdiff.h"
+#include "bscodec.h"
 
 #include <limits.h>
 #include <string.h>
+#include <time.h>
 
 // 定义宏：返回两个数中较小的那个
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
@@ -120,6 +122,9 @@ static void split(int64_t *I,int64_t *V,int64_t start,int64_t len,int64_t h)
 	if(start+len>kk) split(I,V,kk,start+len-kk,h);
 }
 
+// 后缀排序每轮中每处理这么多个后缀检查一次取消
+#define SORT_CANCEL_INTERVAL ((int64_t)1 << 20)
+
 /**
  * 功能：快速后缀排序算法，构建后缀数组I和辅助数组V
  * 参数：
@@ -127,14 +132,20 @@ static void split(int64_t *I,int64_t *V,int64_t start,int64_t len,int64_t h)
  *   - V: 辅助数组（临时工作空间）
  *   - old: 原始数据缓冲区（旧文件的内容）
  *   - oldsize: 原始数据的大小（字节数）
+ *   - cancel/opaque: 取消检查（cancel可以为NULL），每轮排序前及每轮中每处理SORT_CANCEL_INTERVAL个后缀调用一次
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 已取消（I和V停在部分排序的状态，只能交给approxsort整理为近似结果）
  * 
  * 算法原理：
  * 使用快速排序算法构建后缀数组，用于加速后续的匹配过程
  */
-static void qsufsort(int64_t *I,int64_t *V,const uint8_t *old,int64_t oldsize)
+static int qsufsort(int64_t *I,int64_t *V,const uint8_t *old,int64_t oldsize,
+		int (*cancel)(void*),void *opaque)
 {
 	int64_t buckets[256];  // 桶数组，用于统计每个字节值（0-255）的出现次数
 	int64_t i,h,len;        // i: 循环计数器; h: 当前比较的前缀长度; len: 当前处理段的长度
+	int64_t next;           // 本轮中下一次检查取消的位置
 
 	// 第一步：使用桶排序对第一个字节进行排序
 	// 初始化桶数组
@@ -161,6 +172,9 @@ static void qsufsort(int64_t *I,int64_t *V,const uint8_t *old,int64_t oldsize)
 	// 第三步：使用split函数递归地对较长前缀进行排序
 	// 从h=1开始，每次翻倍，直到所有后缀都被正确排序
 	for(h=1;I[0]!=-(oldsize+1);h+=h) {
+		// 每轮都要遍历整个数组，在轮与轮之间检查取消
+		if(cancel&&cancel(opaque)) return -1;
+		next=SORT_CANCEL_INTERVAL;
 		len=0;  // 初始化当前段的长度
 		// 遍历所有后缀
 		for(i=0;i<oldsize+1;) {
@@ -175,6 +189,11 @@ static void qsufsort(int64_t *I,int64_t *V,const uint8_t *old,int64_t oldsize)
 				split(I,V,i,len,h);      // 对当前段进行排序
 				i+=len;                  // 移动到下一个段
 				len=0;                   // 重置长度
+				// 文件较大时前几轮每轮都要几百毫秒，轮中也定期检查取消
+				if(cancel&&(i>=next)) {
+					if(cancel(opaque)) return -1;
+					next=i+SORT_CANCEL_INTERVAL;
+				};
 			};
 		};
 		// 如果最后还有未标记的段，标记它
@@ -183,6 +202,58 @@ static void qsufsort(int64_t *I,int64_t *V,const uint8_t *old,int64_t oldsize)
 
 	// 第四步：反转数组，得到最终的后缀数组
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
+
+	return 0;
+}
+
+/**
+ * 功能：把取消时部分排序的I和V整理为近似的后缀数组及其逆数组
+ * 参数：
+ *   - I/V: qsufsort取消时的状态
+ *   - oldsize: 旧文件大小
+ *
+ * 原理：排序中途，每个后缀都已按前h个字节（h为已完成的轮数对应的前缀长度，部分分组
+ *       已经更长）分入一个组，V[i]是后缀i所在组的末尾位置。已经单独成组的后缀，I中
+ *       它的位置被负数标记覆盖了，放回原处即可；还没排完的组，I中仍是组内的全部后缀，
+ *       只是组内顺序未定。整理后I是按前缀排序的一个排列，V[I[k]]==k，search()仍用
+ *       matchlen确认每个结果，所以匹配总是真实的，只是不一定最长
+ */
+static void approxsort(int64_t *I,int64_t *V,int64_t oldsize)
+{
+	int64_t i;
+
+	for(i=0;i<=oldsize;i++) if(I[V[i]]<0) I[V[i]]=i;
+	for(i=0;i<=oldsize;i++) V[I[i]]=i;
+}
+
+/**
+ * 功能：校验后缀数组（BSDIFF_FLAG_CHECKSORT）
+ * 参数：
+ *   - I: 后缀数组
+ *   - V: 逆后缀数组（V[I[i]]==i）
+ *   - old/oldsize: 旧文件数据及大小
+ * 返回：
+ *   - 0: I是old（以最小的空后缀结尾）唯一正确的后缀数组
+ *   - -1: 校验失败
+ *
+ * 原理：V[I[i]]==i对所有i成立说明I是一个排列；相邻的两个后缀a、b，首字节不同时比较首字节，
+ *       相同时比较去掉首字节后的两个后缀，也就是比较V[a+1]和V[b+1]，整个过程是线性的
+ */
+static int checksort(const int64_t *I,const int64_t *V,const uint8_t *old,int64_t oldsize)
+{
+	int64_t i,a,b;
+
+	for(i=0;i<=oldsize;i++)
+		if((I[i]<0)||(I[i]>oldsize)||(V[I[i]]!=i)) return -1;
+	if(I[0]!=oldsize) return -1;
+	for(i=1;i<oldsize;i++) {
+		a=I[i];
+		b=I[i+1];
+		if(old[a]>old[b]) return -1;
+		if((old[a]==old[b])&&(V[a+1]>=V[b+1])) return -1;
+	};
+
+	return 0;
 }
 
 /**
@@ -253,32 +324,215 @@ static int64_t search(const int64_t *I,const uint8_t *old,int64_t oldsize,
 }
 
 /**
- * 功能：将有符号64位整数转换为8字节的大端序（big-endian）字节数组
+ * 功能：判断后缀数组中第x个后缀是否小于new（与search()中的比较方式完全相同）
+ * 参数：
+ *   - I: 后缀数组
+ *   - old/oldsize: 旧文件数据及大小
+ *   - new/newsize: 要匹配的数据及长度
+ *   - x: 后缀的排名
+ * 返回：小于返回1，否则返回0
+ */
+static int suffixless(const int64_t *I,const uint8_t *old,int64_t oldsize,
+		const uint8_t *new,int64_t newsize,int64_t x)
+{
+	return memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0;
+}
+
+// prefixtail最多检查的候选长度个数，超过时按存在处理
+#define PREFIXTAIL_CHECKS 64
+
+/**
+ * 功能：判断旧文件是否有比newsize短、且整个是new前缀的非空后缀（即旧文件的结尾与new的开头相同）
+ * 参数：
+ *   - old/oldsize: 旧文件数据及大小
+ *   - new/newsize: 要匹配的数据及长度
+ *   - len: 就近搜索找到的匹配长度
+ * 返回：
+ *   - 1: 存在（或候选太多没有检查完）
+ *   - 0: 不存在
+ *
+ * 原理：这种后缀都小于new，且与new的公共前缀就是它本身，在后缀数组中它与new之间的
+ *       后缀都以它开头。就近搜索停在真正的分界上时，返回的长度不小于其中任何一个的长度；
+ *       停在它们造成的假分界上时，返回的长度不小于造成该分界的那个的长度。所以只需检查
+ *       不超过len的长度k，而旧文件的结尾与new[0, k)相同时new[k-1]必然等于旧文件的最后一个
+ *       字节，用memchr找出这些候选即可
+ */
+static int prefixtail(const uint8_t *old,int64_t oldsize,const uint8_t *new,int64_t newsize,int64_t len)
+{
+	const uint8_t *p;
+	int64_t k,max;
+	int checks;
+
+	max=MIN(MIN(len,newsize-1),oldsize);
+	for(k=1,checks=0;k<=max;k++,checks++) {
+		if((p=memchr(new+k-1,old[oldsize-1],max-k+1))==NULL) return 0;
+		k=p-new+1;
+		if((checks==PREFIXTAIL_CHECKS)||(memcmp(old+oldsize-k,new,k)==0)) return 1;
+	};
+
+	return 0;
+}
+
+/**
+ * 功能：从预测的排名出发在后缀数组中就近搜索（finger search）
  * 参数：
- *   - x: 要转换的64位整数
- *   - buf: 输出缓冲区（8字节）
+ *   - I: 后缀数组
+ *   - old/oldsize: 旧文件数据及大小
+ *   - new/newsize: 要匹配的数据及长度
+ *   - guess: 预测的排名（上一次匹配位置顺延后的后缀的排名）
+ *   - pos: 输出参数，存储找到的最佳匹配位置
+ * 返回：匹配的字节数
  * 
- * 注意：使用大端序存储，便于网络传输和跨平台兼容性
+ * 原理：search()最终停在满足“第st个后缀小于new、第st+1个后缀不小于new”的相邻两项上。
+ *       上一次匹配顺延后的后缀与new仍有公共前缀，分界通常就在它的排名附近，因此从该排名
+ *       出发按1、2、4...的步长向分界所在方向倍增，再在最后一步内二分，只需很少几次比较
+ *       就能找到分界
+ *
+ * 注意：比较只取两者中较短的长度，旧文件中比newsize短、且整个是new前缀的后缀会被判为
+ *       “不小于”，此时比较结果不再单调，可能存在多个分界，search()的二分和这里的倍增
+ *       可能停在不同的分界上。不存在这种后缀时分界唯一，两者停在同一处；存在时
+ *       （见prefixtail）改用search()从头搜索。因此返回的位置和长度总是与search()相同
+ */
+static int64_t searchnear(const int64_t *I,const uint8_t *old,int64_t oldsize,
+		const uint8_t *new,int64_t newsize,int64_t guess,int64_t *pos)
+{
+	int64_t lo,hi,mid,step;  // 分界位于(lo, hi]中：第lo个后缀小于new，第hi个不小于new
+	int64_t len;
+
+	// 排名0是空后缀，search()对它的比较恒为“不小于”，分界只在[1, oldsize+1]中寻找；
+	// 为了统一处理，约定第0个后缀“小于”、第oldsize+1个后缀“不小于”new
+	if(guess<1) guess=1;
+	if(suffixless(I,old,oldsize,new,newsize,guess)) {
+		lo=guess;
+		for(step=1;;step*=2) {
+			hi=guess+step;
+			if(hi>oldsize) { hi=oldsize+1; break; };
+			if(!suffixless(I,old,oldsize,new,newsize,hi)) break;
+			lo=hi;
+		};
+	} else {
+		hi=guess;
+		for(step=1;;step*=2) {
+			lo=guess-step;
+			if(lo<1) { lo=0; break; };
+			if(suffixless(I,old,oldsize,new,newsize,lo)) break;
+			hi=lo;
+		};
+	}
+
+	while(hi-lo>1) {
+		mid=lo+(hi-lo)/2;
+		if(suffixless(I,old,oldsize,new,newsize,mid)) lo=mid; else hi=mid;
+	};
+
+	// 分界为hi，search()最终比较的是第hi-1和第hi个后缀（hi不超过oldsize）
+	if(hi>oldsize) hi=oldsize;
+	len=search(I,old,oldsize,new,newsize,hi-1,hi,pos);
+
+	// 比较结果不单调时分界不唯一，按search()的方式从头搜索
+	if(prefixtail(old,oldsize,new,newsize,len))
+		len=search(I,old,oldsize,new,newsize,0,oldsize,pos);
+	return len;
+}
+
+// 搜索表的最大层数：最多2^16个节点，每个节点16字节，共1MB
+#define SEARCH_TABLE_LEVELS 16
+
+/**
+ * 功能：搜索表节点，对应search()二分过程中某一层的一个中间位置
+ */
+struct search_node
+{
+	uint64_t key;  // 该后缀的前8个字节（大端序拼接，不足8字节时低位补0）
+	int64_t pos;   // 该后缀在旧文件中的起始位置，即I[x]
+};
+
+/**
+ * 功能：将最多8个字节按大端序拼成64位整数，使整数大小关系与memcmp一致
+ * 参数：
+ *   - buf: 数据缓冲区
+ *   - len: 数据长度（超过8时只取前8字节）
+ * 返回：拼接结果（不足8字节时低位补0）
+ */
+static uint64_t loadkey(const uint8_t *buf,int64_t len)
+{
+	uint64_t key=0;
+	int i;
+
+	for(i=0;i<8;i++)
+		key=(key<<8)|((i<len) ? buf[i] : 0);
+
+	return key;
+}
+
+/**
+ * 功能：构建搜索表，按Eytzinger布局（节点k的子节点为2k和2k+1）
+ *       存放search()前若干层二分时依次访问的中间位置
+ * 参数：
+ *   - T: 搜索表（下标从1开始）
+ *   - node: 当前节点下标
+ *   - levels: 剩余层数
+ *   - I: 后缀数组
+ *   - old/oldsize: 旧文件数据及大小
+ *   - st/en: 当前节点对应的搜索范围
  */
-static void offtout(int64_t x,uint8_t *buf)
+static void buildtable(struct search_node *T,int64_t node,int levels,const int64_t *I,
+		const uint8_t *old,int64_t oldsize,int64_t st,int64_t en)
 {
-	int64_t y;  // 用于存储x的绝对值
+	int64_t x;
+
+	// 与search()相同：范围只剩1个或2个元素时不再二分
+	if((levels==0)||(en-st<2)) return;
+
+	x=st+(en-st)/2;
+	T[node].key=loadkey(old+I[x],oldsize-I[x]);
+	T[node].pos=I[x];
+	buildtable(T,2*node,levels-1,I,old,oldsize,st,x);
+	buildtable(T,2*node+1,levels-1,I,old,oldsize,x,en);
+}
 
-	// 如果是负数，先取绝对值（后续会处理符号位）
-	if(x<0) y=-x; else y=x;
+/**
+ * 功能：先用搜索表完成二分搜索的前若干层，再交给search()完成剩余部分
+ * 参数：
+ *   - T: 搜索表
+ *   - levels: 搜索表层数
+ *   - 其余参数同search()，搜索范围固定为[0, oldsize]
+ * 返回：匹配的字节数
+ * 
+ * 原理：search()每一层的中间位置是确定的，搜索表按访问顺序存放了这些位置和对应后缀的
+ *       前8个字节。前8个字节能分出大小时无需访问I和old，因此二分的前几层都落在
+ *       紧凑且常驻缓存的搜索表中。每一步的比较结果与search()完全相同，
+ *       所以最终的匹配位置和长度也完全相同
+ */
+static int64_t searchtable(const struct search_node *T,int levels,const int64_t *I,
+		const uint8_t *old,int64_t oldsize,const uint8_t *new,int64_t newsize,int64_t *pos)
+{
+	uint64_t newkey,mask;  // new的前8个字节；比较不足8字节时使用的掩码
+	int64_t st,en,x,n,node;
+	int less;              // 中间位置的后缀是否小于new
+
+	newkey=loadkey(new,newsize);
+	st=0;en=oldsize;node=1;
+	for(;(levels>0)&&(en-st>=2);levels--) {
+		x=st+(en-st)/2;
+		// 与search()相同，只比较两者中较短的长度
+		n=MIN(oldsize-T[node].pos,newsize);
+		if(n>=8) {
+			less=(T[node].key<newkey) ||
+				((T[node].key==newkey)&&(memcmp(old+T[node].pos+8,new+8,n-8)<0));
+		} else {
+			mask=n ? ~0ULL<<(64-8*n) : 0;
+			less=(T[node].key&mask)<(newkey&mask);
+		}
 
-	// 将y从低位到高位逐字节分解（大端序：高字节在前）
-	buf[0]=y%256;y-=buf[0];      // 最低字节
-	y=y/256;buf[1]=y%256;y-=buf[1];
-	y=y/256;buf[2]=y%256;y-=buf[2];
-	y=y/256;buf[3]=y%256;y-=buf[3];
-	y=y/256;buf[4]=y%256;y-=buf[4];
-	y=y/256;buf[5]=y%256;y-=buf[5];
-	y=y/256;buf[6]=y%256;y-=buf[6];
-	y=y/256;buf[7]=y%256;         // 最高字节
+		if(less) {
+			st=x;node=2*node+1;
+		} else {
+			en=x;node=2*node;
+		}
+	};
 
-	// 如果原数是负数，设置最高字节的最高位作为符号位
-	if(x<0) buf[7]|=0x80;
+	return search(I,old,oldsize,new,newsize,st,en,pos);
 }
 
 /**
@@ -318,9 +572,95 @@ static int64_t writedata(struct bsdiff_stream* stream, const void* buffer, int64
 	return result;  // 返回总写入字节数
 }
 
+// 写出diff数据时使用的临时缓冲区大小
+#define BSDIFF_SCRATCH_SIZE 65536
+// 流式输入：新文件窗口的容量，以及每次搜索最多向后看的字节数（匹配在此处截断）。
+// 模糊测试用-D改成很小的值，使短输入也会强制截断
+#ifndef BSDIFF_STREAM_WINDOW
+#define BSDIFF_STREAM_WINDOW ((int64_t)8 << 20)
+#endif
+#ifndef BSDIFF_STREAM_LOOKAHEAD
+#define BSDIFF_STREAM_LOOKAHEAD ((int64_t)1 << 20)
+#endif
+// 扫描时每搜索这么多次检查一次取消
+#define BSDIFF_CANCEL_INTERVAL 4096
+// 时间预算：扫描时每搜索这么多次检查一次剩余时间
+#define BSDIFF_BUDGET_INTERVAL 256
+// 时间预算降级（BSDIFF_DEGRADE_SEARCH）后每次搜索最多比较的字节数
+#define BSDIFF_BUDGET_SEARCH_LIMIT 256
+// 时间预算降级（BSDIFF_DEGRADE_STRIDE）后的扫描步长
+#define BSDIFF_BUDGET_STRIDE 16
+// 时间预算：排序时为之后的扫描预留的每字节时间（秒）
+#define BSDIFF_BUDGET_SCAN_RATE 1e-7
+// 时间预算：估计写出时间时每字节至少按这么多秒计算（约为BZip2压缩未匹配数据的速度）
+#define BSDIFF_BUDGET_OUTPUT_RATE 1.5e-7
+
+/**
+ * 功能：时间预算的状态（一次差分的所有分段共享）
+ */
+struct bsdiff_budget
+{
+	double start;                   // 开始时间（单调时钟，秒）
+	double limit;                   // 时间预算（秒）
+	int degraded;                   // 已经采用的降级策略（BSDIFF_DEGRADE_*组合，只增不减）
+	int (*cancel)(void*);           // 调用者的取消检查（可以为NULL）
+	void* opaque;                   // 传给cancel的参数
+	int64_t pending;                // 排序期间：这一段排完后还要写出的新文件字节数
+	double outtime;                 // 写出控制记录及其数据已经花费的时间（秒，含输出流的压缩）
+	int64_t outbytes;               // 已经写出的新文件字节数
+};
+
+/**
+ * 功能：尚未写出的控制记录
+ * 记录的ctrl[2]（旧文件偏移）要等到下一条记录的旧文件起点确定后才能计算，
+ * 因此每条记录先暂存在写出器中，下一条记录到来（或差分结束）时再写出
+ */
+struct bsdiff_record
+{
+	int64_t newpos;  // diff区段在新文件中的起始位置
+	int64_t oldpos;  // diff区段在旧文件中的起始位置
+	int64_t lenf;    // diff长度
+	int64_t extra;   // extra长度（extra区段紧跟在diff区段之后）
+};
+
+/**
+ * 功能：补丁写出器，负责把控制记录及其diff/extra数据写入输出流
+ * 所有位置都以完整的旧文件/新文件为基准
+ */
+struct bsdiff_writer
+{
+	const uint8_t* old;            // 完整旧文件数据指针
+	const uint8_t* new;            // 完整新文件数据指针（流式输入时为窗口）
+	int64_t newbase;               // new[0]在完整新文件中的位置（流式输入时随窗口移动，否则为0）
+	struct bsdiff_stream* stream;  // 输出流指针
+	uint8_t *buffer;               // 临时缓冲区（BSDIFF_SCRATCH_SIZE字节，新文件更小时为newsize+1字节）
+	int format;                    // 补丁格式（BSDIFF_FORMAT_*）
+	struct bsdiff_record recs[BSDIFF44_BLOCK_RECORDS+1];  // 暂存的记录
+	int nrecs;                     // 暂存的记录数
+	int64_t tail;                  // 最后一条记录之后旧文件应处的位置（决定其ctrl[2]）
+	int nrefs;                     // 多基准：旧文件个数（0表示普通补丁）
+	const int64_t* refstart;       // 多基准：各旧文件在拼接后的旧文件中的起始位置（nrefs+1项）
+	int64_t* cursor;               // 多基准：各旧文件的当前位置（相对于该旧文件开头）
+	struct bsdiff_budget* budget;  // 时间预算（NULL表示不限制），写出时测量写出速度
+};
+
+/**
+ * 功能：流式输入的新文件窗口
+ * 窗口中依次存放新文件从某个位置开始的filled个字节，扫描时只访问窗口中的数据
+ */
+struct bsdiff_window
+{
+	struct bsdiff_input* input;  // 新文件输入
+	uint8_t* buf;                // 窗口缓冲区
+	int64_t size;                // 窗口容量
+	int64_t filled;              // 窗口中已读入的字节数
+};
+
 /**
  * 功能：bsdiff内部使用的请求结构体
  * 用于传递差分计算所需的所有参数
+ * old/new可以是完整文件中的一段（预处理后剩余的未匹配区间），
+ * oldoff/newoff是这一段在完整文件中的起始位置
  */
 struct bsdiff_request
 {
@@ -328,234 +668,1550 @@ struct bsdiff_request
 	int64_t oldsize;                // 旧文件大小
 	const uint8_t* new;            // 新文件数据指针
 	int64_t newsize;                // 新文件大小
+	int64_t oldoff;                 // old在完整旧文件中的起始位置
+	int64_t newoff;                 // new在完整新文件中的起始位置
 	struct bsdiff_stream* stream;  // 输出流指针
-	int64_t *I;                     // 后缀数组指针
-	uint8_t *buffer;                // 临时缓冲区
+	struct bsdiff_writer* writer;  // 补丁写出器
+	const struct bsdiff_index* index;  // 覆盖完整旧文件的索引（NULL表示每段单独排序）
+	int flags;                      // BSDIFF_FLAG_*组合
+	int nrefs;                      // 多基准：拼接在old中的旧文件个数（0表示普通差分）
+	const int64_t* refstart;        // 多基准：各旧文件在old中的起始位置（nrefs+1项）
+	struct bsdiff_window* window;   // 流式输入：new即窗口缓冲区，newsize为窗口起点之后的剩余大小（否则为NULL）
+	int (*cancel)(void*);           // 取消检查（可以为NULL）
+	void* opaque;                   // 传给cancel的参数
+	struct bsdiff_budget* budget;   // 时间预算（NULL表示不限制）
 };
 
 /**
- * 功能：BSDiff算法的核心实现函数，计算两个文件的差分
+ * 功能：旧文件索引，即排好序的后缀数组及可选的搜索加速结构
+ * 索引只读，可以在多次差分（包括并发的差分）之间复用
+ */
+struct bsdiff_index
+{
+	const uint8_t* old;            // 旧文件数据指针（由调用者保证在索引释放前有效）
+	int64_t oldsize;                // 旧文件大小
+	int64_t *I;                     // 后缀数组
+	int64_t *V;                     // 逆后缀数组（仅BSDIFF_FLAG_CONTINUE，否则为NULL）
+	struct search_node *T;          // 搜索表（仅BSDIFF_FLAG_SEARCHTABLE，否则为NULL）
+	int levels;                     // 搜索表层数
+};
+
+/**
+ * 功能：释放索引占用的内存（不释放索引结构体本身）
  * 参数：
- *   - req: 包含旧文件、新文件和输出流的请求结构体
- * 返回：
- *   - 0: 成功
- *   - -1: 失败（内存分配失败或写入失败）
- * 
- * 算法原理：
- * 1. 首先对旧文件构建后缀数组
- * 2. 遍历新文件，使用二分搜索在后缀数组中查找最佳匹配
- * 3. 对于每个匹配区域，记录：匹配长度、差异数据、额外数据
- * 4. 将这三部分数据写入补丁文件
+ *   - idx: 索引
+ *   - stream: 提供free函数的数据流
  */
-static int bsdiff_internal(const struct bsdiff_request req)
+static void freeindex(struct bsdiff_index* idx,struct bsdiff_stream* stream)
 {
-	int64_t *I,*V;                    // I: 后缀数组; V: 临时辅助数组
-	int64_t scan,pos,len;              // scan: 新文件扫描位置; pos: 旧文件匹配位置; len: 当前匹配长度
-	int64_t lastscan,lastpos,lastoffset;  // 上次处理的扫描位置、匹配位置、偏移
-	int64_t oldscore,scsc;            // oldscore: 旧文件匹配分数; scsc: 扫描计数器
-	int64_t s,Sf,lenf,Sb,lenb;        // s: 临时计数器; Sf: 前向最大得分; lenf: 前向最大长度; Sb: 后向最大得分; lenb: 后向最大长度
-	int64_t overlap,Ss,lens;          // overlap: 重叠长度; Ss: 重叠得分; lens: 重叠长度
-	int64_t i;                         // 循环计数器
-	uint8_t *buffer;                   // 临时缓冲区指针
-	uint8_t buf[8 * 3];                // 控制数据缓冲区（3个64位整数，共24字节）
+	if(idx->I) stream->free(idx->I);
+	if(idx->V) stream->free(idx->V);
+	if(idx->T) stream->free(idx->T);
+	idx->I=NULL;
+	idx->V=NULL;
+	idx->T=NULL;
+}
 
-	// 为辅助数组V分配内存
-	if((V=req.stream->malloc((req.oldsize+1)*sizeof(int64_t)))==NULL) return -1;
-	I = req.I;  // 使用传入的后缀数组
+// 内部标志：排序被取消时不放弃，把部分排序的结果整理为近似索引（时间预算用完时使用）
+#define BSDIFF_FLAG_APPROXSORT 0x100
 
-	// 第一步：对旧文件构建后缀数组（这是算法的核心步骤）
-	qsufsort(I,V,req.old,req.oldsize);
-	// 释放辅助数组V（不再需要）
-	req.stream->free(V);
+/**
+ * 功能：为旧文件构建索引
+ * 参数：
+ *   - idx: 输出的索引
+ *   - old/oldsize: 旧文件数据及大小
+ *   - flags: BSDIFF_FLAG_*组合，决定保留哪些搜索加速结构以及是否校验排序结果；
+ *            另有内部标志BSDIFF_FLAG_APPROXSORT
+ *   - cancel/opaque: 取消检查（cancel可以为NULL）
+ *   - stream: 提供malloc/free函数的数据流
+ * 返回：
+ *   - 0: 成功
+ *   - 1: 排序被取消，按BSDIFF_FLAG_APPROXSORT构建了近似索引
+ *   - -1: 内存分配失败或已取消
+ */
+static int buildindex(struct bsdiff_index* idx,const uint8_t *old,int64_t oldsize,int flags,
+		int (*cancel)(void*),void *opaque,struct bsdiff_stream* stream)
+{
+	int approx=0;  // 是否为近似索引
+
+	idx->old=old;
+	idx->oldsize=oldsize;
+	idx->I=NULL;
+	idx->V=NULL;
+	idx->T=NULL;
+	idx->levels=0;
+
+	// 为后缀数组I和辅助数组V分配内存
+	if(((idx->I=stream->malloc((oldsize+1)*sizeof(int64_t)))==NULL) ||
+		((idx->V=stream->malloc((oldsize+1)*sizeof(int64_t)))==NULL)) {
+		freeindex(idx,stream);
+		return -1;
+	};
 
-	buffer = req.buffer;  // 使用传入的缓冲区
+	// 对旧文件构建后缀数组（这是算法的核心步骤）；近似索引本来就不是唯一正确的结果，不校验
+	if(qsufsort(idx->I,idx->V,old,oldsize,cancel,opaque)) {
+		if(!(flags&BSDIFF_FLAG_APPROXSORT)) {
+			freeindex(idx,stream);
+			return -1;
+		};
+		approxsort(idx->I,idx->V,oldsize);
+		approx=1;
+	} else if((flags&BSDIFF_FLAG_CHECKSORT)&&checksort(idx->I,idx->V,old,oldsize)) {
+		freeindex(idx,stream);
+		return -1;
+	};
+	// 排序结束后V[i]恰好是第i个后缀的排名（逆后缀数组），匹配延续模式需要保留它，
+	// 否则释放辅助数组V（不再需要）
+	if(!(flags&BSDIFF_FLAG_CONTINUE)) {
+		stream->free(idx->V);
+		idx->V=NULL;
+	};
 
-	/* 第二步：计算差分，同时写入控制数据 */
-	// 初始化扫描位置、匹配长度、匹配位置
-	scan=0;len=0;pos=0;
-	// lastscan是当前“候选”匹配区域在new中的开始位置；
-	// lastpos 是当前“候选”匹配区域在old中的开始位置；
-	// lastoffset是当前“候选”匹配区域中old中位置相对于new中对应位置的差值，
-	//   因此<new_pos>+lastoffset=<old_pos>；
-	lastscan=0;lastpos=0;lastoffset=0;
-	// 主循环：遍历整个新文件
-	while(scan<req.newsize) {
-		// 当前“候选”匹配区域为：new[lastscan, scan) <-> old[lastpos, scan+lastoffset)
-		oldscore=0;  // 初始化旧文件匹配分数
+	// 由排好序的后缀数组构建搜索表：层数足以覆盖整个二分过程即可，最多SEARCH_TABLE_LEVELS层
+	if(flags&BSDIFF_FLAG_SEARCHTABLE) {
+		while((idx->levels<SEARCH_TABLE_LEVELS)&&(((int64_t)1<<idx->levels)<oldsize))
+			idx->levels++;
+		if((idx->T=stream->malloc(((size_t)1<<idx->levels)*sizeof(struct search_node)))==NULL) {
+			freeindex(idx,stream);
+			return -1;
+		};
+		buildtable(idx->T,1,idx->levels,idx->I,old,oldsize,0,oldsize);
+	};
 
-		// 寻找下一个匹配点（使用贪心算法扩展匹配范围）
-		for(scsc=scan+=len;scan<req.newsize;scan++) {
-			// 在后缀数组中搜索与当前位置最佳匹配的位置，pos代表位置，len代表长度
-			len=search(I,req.old,req.oldsize,req.new+scan,req.newsize-scan,
-					0,req.oldsize,&pos);
+	return approx;
+}
 
-			// 上一步的搜索，得到了“候选”匹配区域new的向后延伸，在old中完全匹配区域的开始位置和长度，
-			//   但这个开始位置和“候选”匹配区域中old的结束位置有可能并不相连。
+/**
+ * 功能：返回单调时钟的当前时间（秒）
+ */
+static double monotonic(void)
+{
+	struct timespec ts;
 
-			// 统计new中[scan, scan+len)与old中“候选”匹配区域的对应延伸区段中相等的字节数，
-			// 累加到oldscore中。注意循环变量是scsc，因此不会重复累加。
-			for(;scsc<scan+len;scsc++)
-			if((scsc+lastoffset<req.oldsize) &&
-				(req.old[scsc+lastoffset] == req.new[scsc]))
-				oldscore++;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec*1e-9;
+}
 
-			// (len==oldscore) && (len!=0) 说明当前“候选”区域的延伸区域仍然匹配的很好，
-			//   那么可以扩展“候选”匹配区域，并继续向后搜索；
-			// (len>oldscore+8) 说明延伸区域中至少有8个以上的字节是不匹配的，
-			//   那么当前“候选”区域应该到此截止而不扩展；
-			if(((len==oldscore) && (len!=0)) || 
-				(len>oldscore+8)) break;
+/**
+ * 功能：写出一条记录的diff数据和extra数据
+ * 参数：
+ *   - w: 补丁写出器
+ *   - r: 控制记录
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 写入失败
+ */
+static int writerecorddata(struct bsdiff_writer* w,const struct bsdiff_record* r)
+{
+	const uint8_t* new = w->new + (r->newpos - w->newbase);  // diff区段在new中的位置
+	int64_t i,n,done;
+
+	/* 写入diff数据（差值：新文件-旧文件），每次处理一个临时缓冲区大小的片段 */
+	for(done=0;done<r->lenf;done+=n) {
+		n=MIN(r->lenf-done,BSDIFF_SCRATCH_SIZE);
+		for(i=0;i<n;i++)
+			w->buffer[i]=new[done+i]-w->old[r->oldpos+done+i];
+		if (writedata(w->stream, w->buffer, n))
+			return -1;
+	};
 
-			// 走到这里说明当前不相等的字节数没有大于8，需要继续循环。
-			// 由于下次循环是从scan+1的位置上尝试，因此若scan对应的字节是相等的，
-			// 它已经被计算在oldscore之内的值需要被减掉。
-			if((scan+lastoffset<req.oldsize) &&
-				(req.old[scan+lastoffset] == req.new[scan]))
-				oldscore--;
-		};
+	/* 写入额外数据（新文件中无法用旧文件表示的部分），直接来自新文件 */
+	if (writedata(w->stream, new + r->lenf, r->extra))
+		return -1;
 
-		// len!=oldscore说明当前“候选”匹配区域不需要再继续向后搜索了；
-		// scan==newsize说明已经已到达文件尾；
-		// 符合这两个条件之一时，我们开始处理当前这个近似匹配区域；
-		if((len!=oldscore) || (scan==req.newsize)) {
-			// 前向扩展：在前一个匹配点之后寻找更长的连续匹配
-			// 确定lenf的长度。区域[lastscan, lastscan+lenf)被称为forward extension
-			s=0;Sf=0;lenf=0;
-			for(i=0;(lastscan+i<scan)&&(lastpos+i<req.oldsize);) {
-				if(req.old[lastpos+i]==req.new[lastscan+i]) s++;
-				i++;
-				// 记录最佳前向匹配位置（得分函数：匹配数*2-总长度）
-				if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
-			};
+	return 0;
+}
 
-			// 后向扩展：在当前匹配点之前寻找更长的连续匹配
-			// 确定lenb的长度。区域[scan-lenb, scan)被称为backward extension
-			lenb=0;
-			if(scan<req.newsize) {
-				s=0;Sb=0;
-				for(i=1;(scan>=lastscan+i)&&(pos>=i);i++) {
-					if(req.old[pos-i]==req.new[scan-i]) s++;
-					// 记录最佳后向匹配位置
-					if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
-				};
-			};
+/**
+ * 功能：写出前n条暂存的控制记录及其diff数据和extra数据
+ * 参数：
+ *   - w: 补丁写出器
+ *   - n: 要写出的记录数
+ *   - nextold: 第n条记录之后没有暂存记录时，下一段在旧文件中的起始位置
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 写入失败
+ * 
+ * 格式说明：
+ *   BSDIFF43: 每条记录为3个8字节整数（bscodec_offtout编码），随后是diff数据和extra数据
+ *   BSDIFF44: 记录按块写出。块头4字节（小端序的记录数和控制数据字节数，各2字节），
+ *             随后是全部记录的控制数据（ctrl[0]、ctrl[1]为LEB128变长整数，
+ *             ctrl[2]为zigzag编码的LEB128变长整数），最后依次是各记录的diff数据和extra数据
+ *   多基准（BSDIFF44）: 每条记录有4个控制值：diff长度、extra长度、旧文件序号、旧文件偏移。
+ *             旧文件偏移在diff之前作用于该旧文件自己的当前位置，diff之后该位置前进diff长度
+ */
+static int flushrecords(struct bsdiff_writer* w,int n,int64_t nextold)
+{
+	uint8_t buf[4 + BSDIFF44_BLOCK_BYTES(4)];  // 控制数据缓冲区
+	int64_t seek;   // ctrl[2]: 旧文件偏移
+	int64_t local;  // 多基准：diff区段在所属旧文件中的起始位置
+	int i,len,ref;
+	double t0=0;    // 时间预算：开始写出的时间
+
+	if(w->budget) {
+		t0=monotonic();
+		for(i=0;i<n;i++) w->budget->outbytes+=w->recs[i].lenf+w->recs[i].extra;
+	};
 
-			// 处理重叠情况：如果前向扩展和后向扩展有重叠，选择最佳重叠点
-			// forword extension和backward extension区域出现重叠时需要调整lenf和lenb
-			if(lastscan+lenf>scan-lenb) {
-				overlap=(lastscan+lenf)-(scan-lenb);  // 计算重叠长度
-				s=0;Ss=0;lens=0;
-				// 遍历重叠区域，找到最佳的重叠点
-				for(i=0;i<overlap;i++) {
-					// 前向扩展的匹配得分
-					if(req.new[lastscan+lenf-overlap+i]==
-					   req.old[lastpos+lenf-overlap+i]) s++;
-					// 后向扩展的匹配得分（减去）
-					if(req.new[scan-lenb+i]==
-					   req.old[pos-lenb+i]) s--;
-					// 记录最高得分
-					if(s>Ss) { Ss=s; lens=i+1; };
-				};
+	for(i=0,len=4;i<n;i++) {
+		const struct bsdiff_record* r = &w->recs[i];
+
+		if (w->nrefs) {
+			// diff长度为0的记录不引用旧文件，固定使用0号旧文件且不移动位置
+			ref=0;seek=0;
+			if (r->lenf > 0) {
+				while (w->refstart[ref+1] <= r->oldpos) ref++;
+				local=r->oldpos-w->refstart[ref];
+				seek=local-w->cursor[ref];
+				w->cursor[ref]=local+r->lenf;
+			}
+			len+=bscodec_varintout(r->lenf,buf+len);
+			len+=bscodec_varintout(r->extra,buf+len);
+			len+=bscodec_varintout(ref,buf+len);
+			len+=bscodec_varintout(((uint64_t)seek<<1)^(uint64_t)(seek>>63),buf+len);
+			continue;
+		}
 
-				// 调整前向和后向的长度
-				lenf+=lens-overlap;
-				lenb-=lens;
-			};
+		seek=((i+1<w->nrecs) ? w->recs[i+1].oldpos : nextold)-(r->oldpos+r->lenf);
+		if (w->format == BSDIFF_FORMAT_44) {
+			len+=bscodec_varintout(r->lenf,buf+len);
+			len+=bscodec_varintout(r->extra,buf+len);
+			len+=bscodec_varintout(((uint64_t)seek<<1)^(uint64_t)(seek>>63),buf+len);
+			continue;
+		}
 
-			// 将控制数据编码为大端序格式
-			offtout(lenf,buf);                                    // ctrl[0]: diff长度
-			offtout((scan-lenb)-(lastscan+lenf),buf+8);           // ctrl[1]: extra长度
-			offtout((pos-lenb)-(lastpos+lenf),buf+16);           // ctrl[2]: 旧文件偏移
+		// 将控制数据编码为8字节整数
+		bscodec_offtout(r->lenf,buf);     // ctrl[0]: diff长度
+		bscodec_offtout(r->extra,buf+8);  // ctrl[1]: extra长度
+		bscodec_offtout(seek,buf+16);     // ctrl[2]: 旧文件偏移
 
-			/* 写入控制数据 */
-			if (writedata(req.stream, buf, sizeof(buf)))
-				return -1;
+		/* 写入控制数据 */
+		if (writedata(w->stream, buf, 24) || writerecorddata(w, r))
+			return -1;
+	};
 
-			/* 写入diff数据（差值：新文件-旧文件）*/
-			// forward extension即为diff区段，减去old中对应位置的值，结果写到buffer中
-			for(i=0;i<lenf;i++)
-				buffer[i]=req.new[lastscan+i]-req.old[lastpos+i];
-			// 写入三元组的x
-			if (writedata(req.stream, buffer, lenf))
-				return -1;
+	if ((w->format == BSDIFF_FORMAT_44) && (n > 0)) {
+		/* 写入块头和整块控制数据 */
+		buf[0]=n&0xFF;buf[1]=n>>8;
+		buf[2]=(len-4)&0xFF;buf[3]=(len-4)>>8;
+		if (writedata(w->stream, buf, len))
+			return -1;
 
-			/* 写入额外数据（新文件中无法用旧文件表示的部分）*/
-			// forward extension和backward extension若不相连，两者中间的区域
-			// 即为extra区段，其内容直接复制到buffer中
-			for(i=0;i<(scan-lenb)-(lastscan+lenf);i++)
-				buffer[i]=req.new[lastscan+lenf+i];
-			// 写入三元组的y
-			if (writedata(req.stream, buffer, (scan-lenb)-(lastscan+lenf)))
+		/* 依次写入各记录的diff数据和extra数据 */
+		for(i=0;i<n;i++)
+			if (writerecorddata(w, &w->recs[i]))
 				return -1;
-
-			// 更新位置追踪变量
-			// backward extension会被作为下一轮“候选”匹配区域的开始部分，
-			// 也就是变成下一次的forward extension的一部分
-			lastscan=scan-lenb;  // 更新上次扫描位置
-			lastpos=pos-lenb;    // 更新上次匹配位置
-			lastoffset=pos-scan;  // 更新偏移量
-		};
 	};
 
-	return 0;  // 成功完成差分计算
+	// 未写出的记录移到队首
+	memmove(w->recs, w->recs+n, (w->nrecs-n)*sizeof(w->recs[0]));
+	w->nrecs-=n;
+	if(w->budget) w->budget->outtime+=monotonic()-t0;
+	return 0;
 }
 
 /**
- * 功能：BSDiff公开API，计算两个文件的差分并生成补丁文件
+ * 功能：追加一条控制记录：new[newpos, newpos+lenf)由old[oldpos, oldpos+lenf)加diff得到，
+ *       随后的extra字节直接来自新文件
  * 参数：
- *   - old: 旧文件数据指针
- *   - oldsize: 旧文件大小（字节数）
+ *   - w: 补丁写出器
+ *   - newpos/oldpos: diff区段在新文件/旧文件中的起始位置
+ *   - lenf: diff长度
+ *   - extra: extra长度
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 写入失败
+ * 
+ * 注意：记录先暂存，凑满一块（BSDIFF43为1条）且下一条记录已知时才写出
+ */
+static int writerecord(struct bsdiff_writer* w,int64_t newpos,int64_t oldpos,int64_t lenf,int64_t extra)
+{
+	const int block = (w->format == BSDIFF_FORMAT_44) ? BSDIFF44_BLOCK_RECORDS : 1;
+	struct bsdiff_record* r = &w->recs[w->nrecs++];
+
+	r->newpos=newpos;
+	r->oldpos=oldpos;
+	r->lenf=lenf;
+	r->extra=extra;
+	w->tail=oldpos+lenf;
+
+	if ((w->nrecs > block) && flushrecords(w, block, 0))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * 功能：计算前向扩展的长度，即从候选区域开头起按得分（匹配数*2-总长度）最优的diff长度
+ * 参数：
+ *   - req: 请求结构体
+ *   - lastscan/lastpos: 候选区域在新文件/旧文件中的开始位置
+ *   - lastend: lastpos所在的基准区间的末尾
+ *   - scan: 候选区域在新文件中的结束位置
+ * 返回：前向扩展的长度
+ */
+static int64_t forwardext(const struct bsdiff_request* req,int64_t lastscan,int64_t lastpos,
+		int64_t lastend,int64_t scan)
+{
+	int64_t s,Sf,lenf,i;
+
+	s=0;Sf=0;lenf=0;
+	for(i=0;(lastscan+i<scan)&&(lastpos+i<lastend);) {
+		if(req->old[lastpos+i]==req->new[lastscan+i]) s++;
+		i++;
+		// 记录最佳前向匹配位置（得分函数：匹配数*2-总长度）
+		if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
+	};
+
+	return lenf;
+}
+
+/**
+ * 功能：估计写出一定量的新文件数据需要的时间
+ * 参数：
+ *   - b: 时间预算
+ *   - bytes: 新文件字节数
+ * 返回：估计的时间（秒）
+ *
+ * 按已经写出的数据实测的速度估计（包括输出流中的压缩），但不低于BSDIFF_BUDGET_OUTPUT_RATE：
+ * 已经写出的大多是几乎全为0的diff数据，压缩起来比预算用完时整段写出的额外数据快得多，
+ * 只按实测速度会低估最后这一段的时间
+ */
+static double outreserve(const struct bsdiff_budget* b,int64_t bytes)
+{
+	double rate=b->outbytes ? b->outtime/b->outbytes : 0;
+
+	return bytes*((rate>BSDIFF_BUDGET_OUTPUT_RATE) ? rate : BSDIFF_BUDGET_OUTPUT_RATE);
+}
+
+/**
+ * 功能：有时间预算时后缀排序使用的取消检查
+ * 参数：
+ *   - opaque: struct bsdiff_budget*
+ * 返回：
+ *   - 非0: 调用者取消，或排序用完了分给它的时间（此时设置BSDIFF_DEGRADE_SORT）
+ *
+ * 预算要为之后扫描并写出b->pending字节预留时间，排序只能用到预留时间之前；
+ * 扫描比预计的慢时由budgetcheck继续降级，预算用完之前仍然能够写完
+ */
+static int budgetcancel(void* opaque)
+{
+	struct bsdiff_budget* b=opaque;
+
+	if(b->cancel&&b->cancel(b->opaque)) return 1;
+	if(monotonic()-b->start+outreserve(b,b->pending)+b->pending*BSDIFF_BUDGET_SCAN_RATE>=b->limit) {
+		b->degraded|=BSDIFF_DEGRADE_SORT;
+		return 1;
+	};
+	return 0;
+}
+
+/**
+ * 功能：根据剩余时间决定扫描时采用的降级策略
+ * 参数：
+ *   - b: 时间预算
+ *   - t0: 本次扫描的开始时间
+ *   - done/total: 本次扫描已经处理的字节数和总字节数
+ * 返回：
+ *   - 更新后的降级策略（BSDIFF_DEGRADE_*组合）
+ *
+ * 按目前的速度（其中包括已经写出的部分的写出时间）预计会超出预算时限制搜索长度；
+ * 已用去3/4预算仍预计超出时增大扫描步长；剩余时间只够把剩余部分写出时，
+ * 剩余部分作为额外数据输出，这样写出也在预算之内完成
+ */
+static int budgetcheck(struct bsdiff_budget* b,double t0,int64_t done,int64_t total)
+{
+	double now=monotonic();
+	double projected=now+(now-t0)/(done ? done : 1)*(total-done);
+
+	if(now+outreserve(b,total-done)-b->start>=b->limit)
+		b->degraded|=BSDIFF_DEGRADE_EXTRA;
+	else if(projected-b->start>b->limit) {
+		b->degraded|=BSDIFF_DEGRADE_SEARCH;
+		if(now-b->start>=0.75*b->limit) b->degraded|=BSDIFF_DEGRADE_STRIDE;
+	};
+	return b->degraded;
+}
+
+/**
+ * 功能：丢弃窗口开头的d个字节，并从输入读入数据直到窗口填满或读完新文件
+ * 参数：
+ *   - win: 新文件窗口
+ *   - d: 丢弃的字节数
+ *   - remain: 丢弃之前窗口起点之后新文件的剩余字节数
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 读取失败
+ */
+static int slidewindow(struct bsdiff_window* win,int64_t d,int64_t remain)
+{
+	int64_t n;
+	int chunk;
+
+	memmove(win->buf,win->buf+d,win->filled-d);
+	win->filled-=d;
+
+	for(n=MIN(win->size,remain-d)-win->filled;n>0;n-=chunk) {
+		chunk=(int)MIN(n,INT_MAX);
+		if(win->input->read(win->input,win->buf+win->filled,chunk))
+			return -1;
+		win->filled+=chunk;
+	};
+
+	return 0;
+}
+
+/**
+ * 功能：求旧文件位置所在的基准区间
+ * 参数：
+ *   - req: 请求结构体
+ *   - pos: 旧文件中的位置
+ *   - begin/end: 输出的区间[begin, end)，普通差分时为整个旧文件
+ * 
+ * 注意：多基准差分中，匹配、前向扩展和后向扩展都不能跨越两个旧文件的边界
+ */
+static void refbounds(const struct bsdiff_request* req,int64_t pos,int64_t *begin,int64_t *end)
+{
+	int lo,hi,mid;
+
+	if(req->nrefs==0) { *begin=0; *end=req->oldsize; return; };
+
+	// 找到最后一个起始位置不大于pos的旧文件（跳过其前面的空文件）
+	lo=0;hi=req->nrefs-1;
+	while(lo<hi) {
+		mid=(lo+hi+1)/2;
+		if(req->refstart[mid]<=pos) lo=mid; else hi=mid-1;
+	};
+	*begin=req->refstart[lo];
+	*end=req->refstart[lo+1];
+}
+
+/**
+ * 功能：BSDiff算法的核心实现函数，利用旧文件索引计算差分
+ * 参数：
+ *   - req: 包含旧文件、新文件和输出流的请求结构体，req.index必须覆盖req.old
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败（写入失败）
+ * 
+ * 算法原理：
+ * 1. 遍历新文件，使用二分搜索在后缀数组中查找最佳匹配
+ * 2. 对于每个匹配区域，记录：匹配长度、差异数据、额外数据
+ * 3. 将这三部分数据写入补丁文件
+ */
+static int bsdiff_scan(struct bsdiff_request req)
+{
+	const int64_t *I,*V;               // I: 后缀数组; V: 逆后缀数组（可以为NULL）
+	const struct search_node *T;       // 搜索表（可以为NULL）
+	int64_t scan,pos,len;              // scan: 新文件扫描位置; pos: 旧文件匹配位置; len: 当前匹配长度
+	int64_t lastscan,lastpos,lastoffset;  // 上次处理的扫描位置、匹配位置、偏移
+	int64_t oldscore,scsc;            // oldscore: 旧文件匹配分数; scsc: 扫描计数器
+	int64_t s,lenf,Sb,lenb;           // s: 临时计数器; lenf: 前向扩展长度; Sb: 后向最大得分; lenb: 后向最大长度
+	int64_t overlap,Ss,lens;          // overlap: 重叠长度; Ss: 重叠得分; lens: 重叠长度
+	int64_t i;                         // 循环计数器
+	int64_t prevscan,prevpos,prevlen;  // 上一次搜索的扫描位置、匹配位置、匹配长度
+	int64_t posbegin,posend;           // pos所在的基准区间（普通差分时为整个旧文件）
+	int64_t lastend;                   // lastpos所在的基准区间的末尾
+	int64_t avail;                     // 本次搜索可以使用的新文件字节数
+	int64_t d;                         // 流式输入：窗口移动的距离
+	int64_t ticks=0;                   // 搜索次数（用于定期检查取消和剩余时间）
+	int degraded=0;                    // 时间预算：当前采用的降级策略
+	double t0=0;                       // 时间预算：本次扫描的开始时间
+
+	I = req.index->I;
+	V = req.index->V;
+	T = req.index->T;
+
+	/* 计算差分，同时写入控制数据 */
+	// 初始化扫描位置、匹配长度、匹配位置
+	scan=0;len=0;pos=0;
+	// lastscan是当前“候选”匹配区域在new中的开始位置；
+	// lastpos 是当前“候选”匹配区域在old中的开始位置；
+	// lastoffset是当前“候选”匹配区域中old中位置相对于new中对应位置的差值，
+	//   因此<new_pos>+lastoffset=<old_pos>；
+	lastscan=0;lastpos=0;lastoffset=0;
+	prevscan=0;prevpos=0;prevlen=0;
+	refbounds(&req,0,&posbegin,&posend);
+	lastend=posend;
+	if(req.budget) {
+		t0=monotonic();
+		degraded=req.budget->degraded;
+	};
+	// 主循环：遍历整个新文件
+	while(scan<req.newsize) {
+		// 当前“候选”匹配区域为：new[lastscan, scan) <-> old[lastpos, scan+lastoffset)
+		oldscore=0;  // 初始化旧文件匹配分数
+
+		// 寻找下一个匹配点（使用贪心算法扩展匹配范围）
+		for(scsc=scan+=len;scan<req.newsize;scan++) {
+			// 每搜索BSDIFF_CANCEL_INTERVAL次检查一次取消
+			ticks++;
+			if(req.cancel && ((ticks%BSDIFF_CANCEL_INTERVAL)==0) && req.cancel(req.opaque))
+				return -1;
+			// 时间预算：定期按剩余时间更新降级策略
+			if(req.budget && ((ticks%BSDIFF_BUDGET_INTERVAL)==0))
+				degraded=budgetcheck(req.budget,t0,scan,req.newsize);
+			// 预算用完：候选区域在scan处截止，之后的部分全部作为额外数据，补丁仍然有效
+			if(degraded&BSDIFF_DEGRADE_EXTRA) {
+				lenf=forwardext(&req,lastscan,lastpos,lastend,scan);
+				return writerecord(req.writer,req.newoff+lastscan,req.oldoff+lastpos,
+						lenf,req.newsize-(lastscan+lenf));
+			};
+			// 流式输入：窗口中需要有[scan, scan+BSDIFF_STREAM_LOOKAHEAD)（不超过文件末尾）
+			if(req.window && (MIN(req.newsize,scan+BSDIFF_STREAM_LOOKAHEAD)>req.window->filled)) {
+				// 暂存的记录全部写出（下一条记录的旧文件起点总是lastpos），窗口只需保留[lastscan, ...)
+				if(flushrecords(req.writer,req.writer->nrecs,req.oldoff+lastpos))
+					return -1;
+				// 当前候选区域超出窗口容量时，在scan处强制截断，先输出为一条记录
+				if(MIN(req.newsize,scan+BSDIFF_STREAM_LOOKAHEAD)-lastscan>req.window->size) {
+					lenf=forwardext(&req,lastscan,lastpos,lastend,scan);
+					if(writerecord(req.writer,req.newoff+lastscan,req.oldoff+lastpos,
+							lenf,scan-(lastscan+lenf)) ||
+						flushrecords(req.writer,req.writer->nrecs,req.oldoff+lastpos+(scan-lastscan)))
+						return -1;
+					lastpos+=scan-lastscan;
+					lastscan=scan;
+				};
+				// 丢弃lastscan之前的数据，新文件中的位置都随窗口平移
+				d=lastscan;
+				if(slidewindow(req.window,d,req.newsize))
+					return -1;
+				scan-=d;scsc-=d;lastscan-=d;prevscan-=d;lastoffset+=d;
+				req.newsize-=d;
+				req.newoff+=d;
+				req.writer->newbase=req.newoff;
+			};
+
+			// 流式输入时匹配在窗口的可见范围处截断
+			avail=req.newsize-scan;
+			if(req.window && (avail>BSDIFF_STREAM_LOOKAHEAD)) avail=BSDIFF_STREAM_LOOKAHEAD;
+			// 时间预算降级：只比较前BSDIFF_BUDGET_SEARCH_LIMIT个字节，
+			// 重复性很强的数据上每层比较的长度不再随匹配长度增长
+			if((degraded&BSDIFF_DEGRADE_SEARCH) && (avail>BSDIFF_BUDGET_SEARCH_LIMIT))
+				avail=BSDIFF_BUDGET_SEARCH_LIMIT;
+
+			// 在后缀数组中搜索与当前位置最佳匹配的位置，pos代表位置，len代表长度
+			// 匹配延续模式下，若上一次的匹配顺延到当前位置后仍与new至少有1个字节相同，
+			// 就从顺延后的后缀的排名出发就近搜索，否则在整个后缀数组中搜索
+			if(V && (scan-prevscan<prevlen))
+				len=searchnear(I,req.old,req.oldsize,req.new+scan,avail,
+						V[prevpos+scan-prevscan],&pos);
+			else if(T)
+				len=searchtable(T,req.index->levels,I,req.old,req.oldsize,
+						req.new+scan,avail,&pos);
+			else
+				len=search(I,req.old,req.oldsize,req.new+scan,avail,
+						0,req.oldsize,&pos);
+			// 多基准差分时匹配截止到所在旧文件的末尾
+			refbounds(&req,pos,&posbegin,&posend);
+			if(len>posend-pos) len=posend-pos;
+			prevscan=scan;prevpos=pos;prevlen=len;
+
+			// 上一步的搜索，得到了“候选”匹配区域new的向后延伸，在old中完全匹配区域的开始位置和长度，
+			//   但这个开始位置和“候选”匹配区域中old的结束位置有可能并不相连。
+
+			// 统计new中[scan, scan+len)与old中“候选”匹配区域的对应延伸区段中相等的字节数，
+			// 累加到oldscore中。注意循环变量是scsc，因此不会重复累加。
+			for(;scsc<scan+len;scsc++)
+			if((scsc+lastoffset<lastend) &&
+				(req.old[scsc+lastoffset] == req.new[scsc]))
+				oldscore++;
+
+			// (len==oldscore) && (len!=0) 说明当前“候选”区域的延伸区域仍然匹配的很好，
+			//   那么可以扩展“候选”匹配区域，并继续向后搜索；
+			// (len>oldscore+8) 说明延伸区域中至少有8个以上的字节是不匹配的，
+			//   那么当前“候选”区域应该到此截止而不扩展；
+			if(((len==oldscore) && (len!=0)) || 
+				(len>oldscore+8)) break;
+
+			// 走到这里说明当前不相等的字节数没有大于8，需要继续循环。
+			// 由于下次循环是从scan+1的位置上尝试，因此若scan对应的字节是相等的，
+			// 它已经被计算在oldscore之内的值需要被减掉。
+			if((scan+lastoffset<lastend) &&
+				(req.old[scan+lastoffset] == req.new[scan]))
+				oldscore--;
+
+			// 时间预算降级：跳过之后的若干个位置，其中已经计入oldscore的字节同样要减掉
+			if(degraded&BSDIFF_DEGRADE_STRIDE) {
+				for(i=1;(i<BSDIFF_BUDGET_STRIDE)&&(scan+1<req.newsize);i++) {
+					scan++;
+					if((scan<scsc) && (scan+lastoffset<lastend) &&
+						(req.old[scan+lastoffset] == req.new[scan]))
+						oldscore--;
+				};
+			};
+		};
+
+		// len!=oldscore说明当前“候选”匹配区域不需要再继续向后搜索了；
+		// scan==newsize说明已经已到达文件尾；
+		// 符合这两个条件之一时，我们开始处理当前这个近似匹配区域；
+		if((len!=oldscore) || (scan==req.newsize)) {
+			// 前向扩展：在前一个匹配点之后寻找更长的连续匹配
+			// 确定lenf的长度。区域[lastscan, lastscan+lenf)被称为forward extension
+			lenf=forwardext(&req,lastscan,lastpos,lastend,scan);
+
+			// 后向扩展：在当前匹配点之前寻找更长的连续匹配
+			// 确定lenb的长度。区域[scan-lenb, scan)被称为backward extension
+			lenb=0;
+			if(scan<req.newsize) {
+				s=0;Sb=0;
+				for(i=1;(scan>=lastscan+i)&&(pos-i>=posbegin);i++) {
+					if(req.old[pos-i]==req.new[scan-i]) s++;
+					// 记录最佳后向匹配位置
+					if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
+				};
+			};
+
+			// 处理重叠情况：如果前向扩展和后向扩展有重叠，选择最佳重叠点
+			// forword extension和backward extension区域出现重叠时需要调整lenf和lenb
+			if(lastscan+lenf>scan-lenb) {
+				overlap=(lastscan+lenf)-(scan-lenb);  // 计算重叠长度
+				s=0;Ss=0;lens=0;
+				// 遍历重叠区域，找到最佳的重叠点
+				for(i=0;i<overlap;i++) {
+					// 前向扩展的匹配得分
+					if(req.new[lastscan+lenf-overlap+i]==
+					   req.old[lastpos+lenf-overlap+i]) s++;
+					// 后向扩展的匹配得分（减去）
+					if(req.new[scan-lenb+i]==
+					   req.old[pos-lenb+i]) s--;
+					// 记录最高得分
+					if(s>Ss) { Ss=s; lens=i+1; };
+				};
+
+				// 调整前向和后向的长度
+				lenf+=lens-overlap;
+				lenb-=lens;
+			};
+
+			// 记录三元组：diff区段为forward extension，
+			// forward extension和backward extension若不相连，两者中间的区域即为extra区段
+			if (writerecord(req.writer,req.newoff+lastscan,req.oldoff+lastpos,
+					lenf,(scan-lenb)-(lastscan+lenf)))
+				return -1;
+
+			// 更新位置追踪变量
+			// backward extension会被作为下一轮“候选”匹配区域的开始部分，
+			// 也就是变成下一次的forward extension的一部分
+			lastscan=scan-lenb;  // 更新上次扫描位置
+			lastpos=pos-lenb;    // 更新上次匹配位置
+			lastoffset=pos-scan;  // 更新偏移量
+			lastend=posend;      // lastpos与pos在同一个旧文件中
+		};
+	};
+
+	// 最后一条记录的ctrl[2]指向最后一次匹配的位置（与下一段拼接时会被覆盖）
+	req.writer->tail=req.oldoff+lastpos;
+
+	return 0;  // 成功完成差分计算
+}
+
+/**
+ * 功能：对req.old构建临时索引并计算差分
+ * 参数：
+ *   - req: 请求结构体
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败（内存分配失败或写入失败）
+ */
+static int bsdiff_internal(struct bsdiff_request req)
+{
+	struct bsdiff_index idx;  // 临时索引
+	int result;
+
+	// 之前的分段已经用完时间预算，或剩余时间只够写出这一段：直接作为额外数据，不再排序
+	if(req.budget && !(req.budget->degraded&BSDIFF_DEGRADE_EXTRA) &&
+		(monotonic()+outreserve(req.budget,req.newsize)-req.budget->start>=req.budget->limit))
+		req.budget->degraded|=BSDIFF_DEGRADE_EXTRA;
+	if(req.budget && (req.budget->degraded&BSDIFF_DEGRADE_EXTRA))
+		return req.newsize ? writerecord(req.writer,req.newoff,req.oldoff,0,req.newsize) : 0;
+
+	// 第一步：对旧文件构建后缀数组。有时间预算时排序也要检查剩余时间，
+	// 分给排序的时间用完时不丢弃已经完成的部分，而是整理为近似索引继续扫描
+	if(req.budget) {
+		req.budget->pending=req.newsize;
+		result=buildindex(&idx,req.old,req.oldsize,req.flags|BSDIFF_FLAG_APPROXSORT,
+				budgetcancel,req.budget,req.stream);
+		// 近似索引是调用者取消（而不是预算用完）造成的：放弃
+		if((result>0)&&!(req.budget->degraded&BSDIFF_DEGRADE_SORT)) {
+			freeindex(&idx,req.stream);
+			return -1;
+		};
+	} else
+		result=buildindex(&idx,req.old,req.oldsize,req.flags,req.cancel,req.opaque,req.stream);
+	if(result<0)
+		return -1;
+
+	// 第二步：计算差分
+	req.index=&idx;
+	result=bsdiff_scan(req);
+
+	freeindex(&idx,req.stream);
+	return result;
+}
+
+// 相同区域预处理使用的内容定义分块（content-defined chunking）参数
+#define CDC_MIN_CHUNK 256                        // 最小块长（字节）
+#define CDC_MAX_CHUNK 8192                       // 最大块长（字节）
+#define CDC_BOUNDARY_MASK 0xFFC0000000000000ULL  // 高10位全为0时切块，平均块长约为最小块长+1KB
+#define PREPASS_MIN_SPAN 16384                   // 剩余区间小于此值时不再分块
+
+/**
+ * 功能：生成分块用的gear表（256个伪随机64位整数）
+ * 参数：
+ *   - gear: 输出的gear表
+ * 
+ * 注意：使用固定种子的splitmix64生成，保证每次运行结果一致
+ */
+static void geartable(uint64_t gear[256])
+{
+	uint64_t x=0x9E3779B97F4A7C15ULL,z;
+	int i;
+
+	for(i=0;i<256;i++) {
+		x+=0x9E3779B97F4A7C15ULL;
+		z=x;
+		z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+		z=(z^(z>>27))*0x94D049BB133111EBULL;
+		gear[i]=z^(z>>31);
+	}
+}
+
+/**
+ * 功能：计算从buf开始的下一个内容定义块的长度
+ * 参数：
+ *   - gear: gear表
+ *   - buf: 数据缓冲区
+ *   - size: 剩余数据长度
+ * 返回：块长度（最后一块可能短于最小块长）
+ * 
+ * 原理：gear滚动哈希的高位只取决于最近64个字节，因此切块位置只由局部内容决定，
+ *       相同内容在旧文件和新文件中会被切成相同的块，与其所在的偏移无关
+ */
+static int64_t cdcnext(const uint64_t gear[256],const uint8_t *buf,int64_t size)
+{
+	uint64_t h=0;
+	int64_t i;
+
+	if(size<=CDC_MIN_CHUNK) return size;
+
+	// 哈希窗口只有64字节，从最小块长之前64字节处开始滚动即可
+	for(i=CDC_MIN_CHUNK-64;(i<size)&&(i<CDC_MAX_CHUNK);i++) {
+		h=(h<<1)+gear[buf[i]];
+		if((i>=CDC_MIN_CHUNK)&&((h&CDC_BOUNDARY_MASK)==0)) return i+1;
+	};
+
+	return i;
+}
+
+/**
+ * 功能：计算数据块的64位哈希
+ * 参数：
+ *   - buf: 数据块
+ *   - len: 数据块长度
+ * 返回：哈希值
+ * 
+ * 注意：哈希仅用于查找候选块，命中后还会用memcmp逐字节确认
+ */
+static uint64_t chunkhash(const uint8_t *buf,int64_t len)
+{
+	uint64_t h=0xCBF29CE484222325ULL^(uint64_t)len,w;
+	int64_t i;
+
+	for(i=0;i+8<=len;i+=8) {
+		memcpy(&w,buf+i,8);
+		h=(h^w)*0x100000001B3ULL;
+		h^=h>>29;
+	};
+	for(;i<len;i++)
+		h=(h^buf[i])*0x100000001B3ULL;
+
+	h^=h>>32;
+	h*=0xD6E8FEB86659FD93ULL;
+	return h^(h>>32);
+}
+
+/**
+ * 功能：对旧文件和新文件中对应的一段未匹配区间执行完整的差分（排序+搜索）
+ * 参数：
+ *   - req: 请求结构体（描述完整文件）
+ *   - oldstart/oldend: 旧文件区间[oldstart, oldend)
+ *   - newstart/newend: 新文件区间[newstart, newend)
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+static int diffspan(const struct bsdiff_request req,int64_t oldstart,int64_t oldend,
+		int64_t newstart,int64_t newend)
+{
+	struct bsdiff_request sub = req;
+
+	if(newend==newstart) return 0;
+
+	sub.new=req.new+newstart;
+	sub.newsize=newend-newstart;
+	sub.newoff=req.newoff+newstart;
+
+	// 已有覆盖完整旧文件的索引时，未匹配区间可以直接在整个旧文件中搜索
+	if(req.index)
+		return bsdiff_scan(sub);
+
+	sub.old=req.old+oldstart;
+	sub.oldsize=oldend-oldstart;
+	sub.oldoff=req.oldoff+oldstart;
+
+	return bsdiff_internal(sub);
+}
+
+/**
+ * 功能：相同区域预处理，只让发生变化的区间进入后缀排序和搜索
+ * 参数：
+ *   - req: 请求结构体（描述完整文件）
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败（内存分配失败或写入失败）
+ * 
+ * 算法原理：
+ * 1. 剥离旧文件和新文件的公共前缀和公共后缀
+ * 2. 对剩余部分做内容定义分块，用哈希表找出新文件中与旧文件完全相同的块，
+ *    并逐字节向两侧扩展成尽可能长的相同区域（锚点）
+ * 3. 锚点在旧文件和新文件中都保持递增顺序，直接输出为diff全为0的控制记录
+ * 4. 相邻锚点之间的未匹配区间各自单独排序和搜索
+ * 
+ * 注意：没有预先构建的索引时，未匹配区间只能引用旧文件中对应的未匹配区间，
+ *       因此对于内容被大范围移动的文件，补丁可能比不做预处理时更大；
+ *       使用预先构建的索引时，未匹配区间在整个旧文件中搜索
+ */
+static int bsdiff_prepass(const struct bsdiff_request req)
+{
+	uint64_t gear[256];              // 分块用的gear表
+	int64_t prefix,suffix;           // 公共前缀、公共后缀长度
+	int64_t oldend,newend;           // 去掉公共后缀后的区间末尾
+	int64_t lastold,lastnew;         // 已处理到的旧文件、新文件位置
+	int64_t *chunks=NULL;            // 旧文件块表：每块占2项（起始位置、长度）
+	int64_t *table=NULL;             // 开放寻址哈希表，存储块序号+1，0表示空
+	uint64_t *hashes=NULL;           // 旧文件各块的哈希
+	uint64_t h;                      // 新文件当前块的哈希
+	int64_t nchunks,mask,p,o,len,i,slot;
+
+	// 第一步：剥离公共前缀和公共后缀
+	prefix=matchlen(req.old,req.oldsize,req.new,req.newsize);
+	for(suffix=0;(suffix<req.oldsize-prefix)&&(suffix<req.newsize-prefix);suffix++)
+		if(req.old[req.oldsize-1-suffix]!=req.new[req.newsize-1-suffix]) break;
+	oldend=req.oldsize-suffix;
+	newend=req.newsize-suffix;
+
+	if(prefix && writerecord(req.writer,req.newoff,req.oldoff,prefix,0))
+		return -1;
+	lastold=prefix;
+	lastnew=prefix;
+
+	// 第二步：剩余部分足够大时，用内容定义分块查找相同的块
+	if((oldend-prefix>=PREPASS_MIN_SPAN)&&(newend-prefix>=PREPASS_MIN_SPAN)) {
+		geartable(gear);
+
+		// 块数上限：除最后一块外每块至少CDC_MIN_CHUNK字节
+		nchunks=(oldend-prefix)/CDC_MIN_CHUNK+1;
+		for(mask=1;mask<2*nchunks;mask<<=1);
+		if(((chunks=req.stream->malloc(nchunks*2*sizeof(int64_t)))==NULL) ||
+			((hashes=req.stream->malloc(nchunks*sizeof(uint64_t)))==NULL) ||
+			((table=req.stream->malloc(mask*sizeof(int64_t)))==NULL)) {
+			if(chunks) req.stream->free(chunks);
+			if(hashes) req.stream->free(hashes);
+			return -1;
+		};
+		mask--;
+		for(i=0;i<=mask;i++) table[i]=0;
+
+		// 对旧文件分块并建立哈希表
+		for(nchunks=0,o=prefix;o<oldend;o+=len,nchunks++) {
+			len=cdcnext(gear,req.old+o,oldend-o);
+			chunks[2*nchunks]=o;
+			chunks[2*nchunks+1]=len;
+			hashes[nchunks]=chunkhash(req.old+o,len);
+			for(slot=hashes[nchunks]&mask;table[slot];slot=(slot+1)&mask);
+			table[slot]=nchunks+1;
+		};
+
+		// 对新文件分块，逐块在哈希表中查找
+		for(p=prefix;p<newend;) {
+			len=cdcnext(gear,req.new+p,newend-p);
+			h=chunkhash(req.new+p,len);
+			for(o=-1,slot=h&mask;table[slot];slot=(slot+1)&mask) {
+				i=table[slot]-1;
+				// 只接受位于上一个锚点之后的块，保证锚点在两个文件中都递增
+				if((hashes[i]==h)&&(chunks[2*i+1]==len)&&(chunks[2*i]>=lastold)&&
+					(memcmp(req.old+chunks[2*i],req.new+p,len)==0)) {
+					o=chunks[2*i];
+					break;
+				};
+			};
+
+			if(o<0) {
+				p+=len;
+				continue;
+			};
+
+			// 向前逐字节扩展，但不越过上一个锚点
+			while((p>lastnew)&&(o>lastold)&&(req.old[o-1]==req.new[p-1])) {
+				p--;o--;len++;
+			};
+			// 向后逐字节扩展
+			len+=matchlen(req.old+o+len,oldend-o-len,req.new+p+len,newend-p-len);
+
+			// 锚点之前的未匹配区间做完整差分，锚点本身直接输出
+			if(diffspan(req,lastold,o,lastnew,p) ||
+				writerecord(req.writer,req.newoff+p,req.oldoff+o,len,0)) {
+				req.stream->free(table);
+				req.stream->free(hashes);
+				req.stream->free(chunks);
+				return -1;
+			};
+
+			lastold=o+len;
+			lastnew=p+len;
+			p=lastnew;
+		};
+
+		req.stream->free(table);
+		req.stream->free(hashes);
+		req.stream->free(chunks);
+	};
+
+	// 第三步：最后一段未匹配区间和公共后缀
+	if(diffspan(req,lastold,oldend,lastnew,newend))
+		return -1;
+	if(suffix && writerecord(req.writer,req.newoff+newend,req.oldoff+oldend,suffix,0))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * 功能：BSDiff公开API，计算两个文件的差分并生成补丁文件
+ * 参数：
+ *   - old: 旧文件数据指针
+ *   - oldsize: 旧文件大小（字节数）
  *   - new: 新文件数据指针
  *   - newsize: 新文件大小（字节数）
  *   - stream: 输出流指针（用于写入补丁数据）
  * 返回：
  *   - 0: 成功
- *   - -1: 失败（内存分配失败）
+ *   - -1: 失败（内存分配失败）
+ */
+int bsdiff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream)
+{
+	return bsdiff_ex(old, oldsize, new, newsize, stream, NULL);
+}
+
+/**
+ * 功能：计算差分的公共部分，bsdiff_ex、bsdiff_index_diff、bsdiff_multi和bsdiff_streaming共用
+ * 参数：
+ *   - old/oldsize/new/newsize/stream: 同bsdiff
+ *   - index: 预先构建的旧文件索引，NULL表示临时构建
+ *   - refstart/nrefs: 多基准差分时各旧文件在old中的起始位置（nrefs+1项）及旧文件个数，
+ *                     普通差分时为NULL/0
+ *   - window: 流式输入的新文件窗口（此时new为窗口缓冲区），普通差分时为NULL
+ *   - options: 可选参数，NULL表示使用默认值
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败（内存分配失败或写入失败）
+ */
+static int bsdiff_run(const uint8_t* old, int64_t oldsize, const struct bsdiff_index* index,
+		const int64_t* refstart, int nrefs, struct bsdiff_window* window,
+		const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream,
+		const struct bsdiff_options* options)
+{
+	int result;                  // 返回值
+	int flags;                   // BSDIFF_FLAG_*组合
+	int i;
+	struct bsdiff_request req;   // 内部请求结构体
+	struct bsdiff_writer writer; // 补丁写出器
+	struct bsdiff_budget budget; // 时间预算
+
+	flags = options ? options->flags : 0;
+	if (options && options->format != BSDIFF_FORMAT_43 && options->format != BSDIFF_FORMAT_44)
+		return -1;
+
+	// 为临时缓冲区分配内存
+	if((writer.buffer=stream->malloc(MIN(newsize+1,BSDIFF_SCRATCH_SIZE)))==NULL)
+		return -1;
+
+	// 填充写出器
+	writer.old = old;
+	writer.new = new;
+	writer.newbase = 0;
+	writer.stream = stream;
+	writer.format = options ? options->format : BSDIFF_FORMAT_43;
+	writer.nrecs = 0;
+	writer.tail = 0;
+	writer.nrefs = nrefs;
+	writer.refstart = refstart;
+	writer.cursor = NULL;
+	if (nrefs && (writer.cursor = stream->malloc(nrefs * sizeof(int64_t))) == NULL) {
+		stream->free(writer.buffer);
+		return -1;
+	}
+	for (i = 0; i < nrefs; i++)
+		writer.cursor[i] = 0;
+
+	// 填充请求结构体
+	req.old = old;
+	req.oldsize = oldsize;
+	req.new = new;
+	req.newsize = newsize;
+	req.oldoff = 0;
+	req.newoff = 0;
+	req.stream = stream;
+	req.writer = &writer;
+	req.index = index;
+	req.flags = flags;
+	req.nrefs = nrefs;
+	req.refstart = refstart;
+	req.window = window;
+	req.cancel = options ? options->cancel : NULL;
+	req.opaque = options ? options->opaque : NULL;
+	req.budget = NULL;
+	if (options && options->budget > 0) {
+		budget.start = monotonic();
+		budget.limit = options->budget;
+		budget.degraded = 0;
+		budget.cancel = req.cancel;
+		budget.opaque = req.opaque;
+		budget.pending = 0;
+		budget.outtime = 0;
+		budget.outbytes = 0;
+		req.budget = &budget;
+	}
+	writer.budget = req.budget;
+
+	// 调用内部函数执行实际的差分计算，最后写出暂存的记录
+	if (flags & BSDIFF_FLAG_PREPASS)
+		result = bsdiff_prepass(req);
+	else if (index)
+		result = bsdiff_scan(req);
+	else
+		result = bsdiff_internal(req);
+	if (result == 0)
+		result = flushrecords(&writer, writer.nrecs, writer.tail);
+
+	// 释放分配的内存
+	stream->free(writer.buffer);
+	if (writer.cursor)
+		stream->free(writer.cursor);
+
+	// 报告实际采用的降级策略
+	if (options && options->degraded)
+		*options->degraded = req.budget ? budget.degraded : 0;
+
+	return result;
+}
+
+/**
+ * 功能：带可选参数的BSDiff公开API
+ * 参数：
+ *   - old/oldsize/new/newsize/stream: 同bsdiff
+ *   - options: 可选参数，NULL表示使用默认值
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败（内存分配失败或写入失败）
+ */
+int bsdiff_ex(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+		struct bsdiff_stream* stream, const struct bsdiff_options* options)
+{
+	return bsdiff_run(old, oldsize, NULL, NULL, 0, NULL, new, newsize, stream, options);
+}
+
+/**
+ * 功能：为旧文件构建可复用的索引
+ * 参数：
+ *   - old/oldsize: 旧文件数据及大小，在索引释放前必须保持有效
+ *   - stream: 提供malloc/free函数的数据流（write不会被调用）
+ *   - options: 可选参数，其中的BSDIFF_FLAG_SEARCHTABLE和BSDIFF_FLAG_CONTINUE决定构建哪些加速结构
+ * 返回：
+ *   - 索引指针，失败时返回NULL
+ */
+struct bsdiff_index* bsdiff_index_build(const uint8_t* old, int64_t oldsize,
+		struct bsdiff_stream* stream, const struct bsdiff_options* options)
+{
+	struct bsdiff_index* idx;
+
+	if ((idx = stream->malloc(sizeof(struct bsdiff_index))) == NULL)
+		return NULL;
+	if (buildindex(idx, old, oldsize, options ? options->flags : 0,
+			options ? options->cancel : NULL, options ? options->opaque : NULL, stream))
+	{
+		stream->free(idx);
+		return NULL;
+	}
+
+	return idx;
+}
+
+/**
+ * 功能：利用预先构建的索引计算差分
+ * 参数：
+ *   - index: bsdiff_index_build返回的索引
+ *   - new/newsize/stream: 同bsdiff
+ *   - options: 可选参数，NULL表示使用默认值
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败（内存分配失败或写入失败）
+ *
+ * 注意：索引只读，多个线程可以同时用同一个索引计算差分（各自使用自己的stream）
  */
-int bsdiff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream)
+int bsdiff_index_diff(const struct bsdiff_index* index, const uint8_t* new, int64_t newsize,
+		struct bsdiff_stream* stream, const struct bsdiff_options* options)
 {
-	int result;                  // 返回值
-	struct bsdiff_request req;   // 内部请求结构体
+	return bsdiff_run(index->old, index->oldsize, index, NULL, 0, NULL, new, newsize, stream, options);
+}
+
+/**
+ * 功能：多基准差分，新文件可以引用多个旧文件中的任意一个
+ * 参数：
+ *   - olds/oldsizes: 各旧文件数据及大小
+ *   - nold: 旧文件个数（至少1个）
+ *   - new/newsize/stream: 同bsdiff
+ *   - options: 可选参数，格式必须为BSDIFF_FORMAT_44；BSDIFF_FLAG_PREPASS被忽略
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败（参数无效、内存分配失败或写入失败）
+ * 
+ * 实现：把所有旧文件拼接起来只排序一次，扫描时每次匹配都截止到所在旧文件的末尾，
+ *       每条控制记录额外带一个旧文件序号
+ */
+int bsdiff_multi(const uint8_t* const* olds, const int64_t* oldsizes, int nold,
+		const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream,
+		const struct bsdiff_options* options)
+{
+	struct bsdiff_options multi;  // 去掉相同区域预处理后的参数
+	uint8_t* old;                 // 拼接后的旧文件
+	int64_t* refstart;            // 各旧文件在old中的起始位置
+	int64_t oldsize;
+	int i, result;
 
-	// 为后缀数组I分配内存
-	if((req.I=stream->malloc((oldsize+1)*sizeof(int64_t)))==NULL)
+	if (nold < 1 || options == NULL || options->format != BSDIFF_FORMAT_44)
 		return -1;
+	// 相同区域预处理假设新旧文件大致按顺序对应，对多个旧文件没有意义
+	multi = *options;
+	multi.flags &= ~BSDIFF_FLAG_PREPASS;
 
-	// 为临时缓冲区分配内存
-	if((req.buffer=stream->malloc(newsize+1))==NULL)
-	{
-		stream->free(req.I);  // 内存分配失败，释放之前分配的内存
+	if ((refstart = stream->malloc((nold + 1) * sizeof(int64_t))) == NULL)
 		return -1;
+	for (i = 0, oldsize = 0; i < nold; i++) {
+		refstart[i] = oldsize;
+		oldsize += oldsizes[i];
 	}
+	refstart[nold] = oldsize;
 
-	// 填充请求结构体
-	req.old = old;
-	req.oldsize = oldsize;
-	req.new = new;
-	req.newsize = newsize;
-	req.stream = stream;
+	if ((old = stream->malloc(oldsize + 1)) == NULL) {
+		stream->free(refstart);
+		return -1;
+	}
+	for (i = 0; i < nold; i++)
+		memcpy(old + refstart[i], olds[i], oldsizes[i]);
 
-	// 调用内部函数执行实际的差分计算
-	result = bsdiff_internal(req);
+	result = bsdiff_run(old, oldsize, NULL, refstart, nold, NULL, new, newsize, stream, &multi);
 
-	// 释放分配的内存
-	stream->free(req.buffer);
-	stream->free(req.I);
+	stream->free(old);
+	stream->free(refstart);
+	return result;
+}
+
+/**
+ * 功能：新文件通过读取回调流式输入的差分
+ * 参数：
+ *   - old/oldsize: 旧文件数据及大小
+ *   - input: 新文件输入，按顺序读取恰好newsize个字节
+ *   - newsize: 新文件大小
+ *   - stream: 同bsdiff
+ *   - options: 可选参数（可以为NULL）；BSDIFF_FLAG_PREPASS被忽略
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败（内存分配失败、读取失败或写入失败）
+ * 
+ * 实现：新文件只在一个BSDIFF_STREAM_WINDOW字节的窗口中保留从当前候选区域开头到
+ *       扫描位置之后BSDIFF_STREAM_LOOKAHEAD字节的数据。窗口不够时先写出全部暂存记录，
+ *       候选区域仍然太长就在扫描位置处强制截断为一条记录，再移动窗口
+ */
+int bsdiff_streaming(const uint8_t* old, int64_t oldsize, struct bsdiff_input* input, int64_t newsize,
+		struct bsdiff_stream* stream, const struct bsdiff_options* options)
+{
+	struct bsdiff_options streaming;  // 去掉相同区域预处理后的参数
+	struct bsdiff_window win;         // 新文件窗口
+	int result;
+
+	// 相同区域预处理需要随机访问整个新文件；剩余部分作为额外数据输出也需要，因此不支持时间预算
+	memset(&streaming, 0, sizeof(streaming));
+	if (options)
+		streaming = *options;
+	streaming.flags &= ~BSDIFF_FLAG_PREPASS;
+	streaming.budget = 0;
+
+	win.input = input;
+	win.size = MIN(newsize, BSDIFF_STREAM_WINDOW);
+	win.filled = 0;
+	if ((win.buf = stream->malloc(win.size + 1)) == NULL)
+		return -1;
+
+	result = bsdiff_run(old, oldsize, NULL, NULL, 0, &win, win.buf, newsize, stream, &streaming);
 
+	stream->free(win.buf);
 	return result;
 }
 
+/**
+ * 功能：返回索引占用的内存字节数（不含旧文件数据本身）
+ * 参数：
+ *   - index: 索引
+ * 返回：
+ *   - 字节数
+ */
+size_t bsdiff_index_memory(const struct bsdiff_index* index)
+{
+	size_t size = sizeof(struct bsdiff_index) + (index->oldsize + 1) * sizeof(int64_t);
+
+	if (index->V)
+		size += (index->oldsize + 1) * sizeof(int64_t);
+	if (index->T)
+		size += ((size_t)1 << index->levels) * sizeof(struct search_node);
+
+	return size;
+}
+
+/**
+ * 功能：释放索引
+ * 参数：
+ *   - index: 索引（可以为NULL）
+ *   - stream: 提供free函数的数据流
+ */
+void bsdiff_index_free(struct bsdiff_index* index, struct bsdiff_stream* stream)
+{
+	if (index == NULL)
+		return;
+	freeindex(index, stream);
+	stream->free(index);
+}
+
+/* 差分代价估算 */
+
+#define ESTIMATE_KMER 64                  // 锚点长度，与gear哈希覆盖的字节数相同
+#define ESTIMATE_SAMPLE_SHIFT 58          // 哈希高6位全为0的位置被采样，采样率约1/64
+#define ESTIMATE_WINDOW 4096              // 新文件每个采样窗口的长度
+#define ESTIMATE_MAX_WINDOWS 256          // 最多采样的窗口数（即最多采样1MB）
+#define ESTIMATE_GIVEUP 64                // 扩展匹配时得分比最高分低这么多就停止
+#define ESTIMATE_LZ_MIN 8                 // 压缩模型中重复串的最短长度
+#define ESTIMATE_LZ_BITS 16               // 压缩模型中重复串哈希表的位数
+#define ESTIMATE_LZ_MATCH_BITS 12.0       // 压缩模型中每个重复串的代价（比特）
+// 以下系数由实测确定，见提交说明中的校准数据
+#define ESTIMATE_BZIP2_RATIO 0.87         // bzip2压缩后大小与压缩模型估计值之比
+#define ESTIMATE_CTRL43_BYTES 8.0         // BSDIFF43每条控制记录压缩后的平均字节数
+#define ESTIMATE_CTRL44_BYTES 4.0         // BSDIFF44每条控制记录压缩后的平均字节数
+#define ESTIMATE_SORT_COST 6.5            // 排序每字节每层的耗时与构建草图每字节耗时之比
+#define ESTIMATE_SPAN_SORT_COST 4.8       // 相同区域预处理后分段排序每字节每层的耗时之比
+#define ESTIMATE_SEARCH_COST 11.0         // 每次搜索每层的耗时与构建草图每字节耗时之比
+#define ESTIMATE_PREPASS_COST 2.5         // 相同区域预处理每字节的耗时与构建草图每字节耗时之比
+#define ESTIMATE_MIN_HASH_SECONDS 1e-9    // 旧文件太小、计时不准时使用的每字节耗时下限
+
+/**
+ * 功能：旧文件草图中的一项
+ */
+struct sketch_slot
+{
+	uint64_t hash;   // 锚点末尾的gear哈希
+	int64_t pos;     // 锚点在旧文件中的起始位置+1，0表示空
+};
+
+/**
+ * 功能：计算以2为底的对数（估算只需要几位有效数字，避免依赖libm）
+ */
+static double flog2(double x)
+{
+	double r=0,y,y2,t,s=0;
+	int i;
+
+	if(x<=0) return 0;
+	while(x>=2) { x/=2; r++; };
+	while(x<1) { x*=2; r--; };
+	// ln(x)=2*atanh((x-1)/(x+1))，x在[1,2)时级数收敛很快
+	y=(x-1)/(x+1);
+	y2=y*y;
+	for(i=1,t=y;i<16;i+=2,t*=y2) s+=t/i;
+	return r+2*s/0.6931471805599453;
+}
+
+/**
+ * 功能：计算压缩模型中重复串哈希表的下标
+ */
+static uint32_t lzhash(const uint8_t *p)
+{
+	uint64_t x=0;
+	int i;
+
+	for(i=0;i<ESTIMATE_LZ_MIN;i++) x=(x<<8)|p[i];
+	return (uint32_t)((x*0x9E3779B97F4A7C15ULL)>>(64-ESTIMATE_LZ_BITS));
+}
+
+/**
+ * 功能：用一个简单的压缩模型估计数据压缩后的比特数，作为bzip2压缩结果的近似
+ * 参数：
+ *   - buf/len: 数据
+ *   - counts: 256*257项的计数表（每个上下文256个字节计数加1个总数）
+ *   - table: 2^ESTIMATE_LZ_BITS项的重复串哈希表
+ * 返回：估计的比特数
+ *
+ * 模型：与前文重复至少ESTIMATE_LZ_MIN字节的串按固定代价计，其余字节按以前一字节为上下文的
+ * 自适应一阶模型计。与只看字节分布的零阶熵相比，它对代码、文本和差异数据中的零串更接近bzip2
+ */
+static double modelbits(const uint8_t *buf,int64_t len,uint32_t *counts,int64_t *table)
+{
+	int64_t i,j,l;
+	uint32_t *ctx;
+	uint8_t prev=0;
+	double bits=0;
+
+	for(i=0;i<256*257;i++) counts[i]=0;
+	for(i=0;i<((int64_t)1<<ESTIMATE_LZ_BITS);i++) table[i]=0;
+
+	for(i=0;i<len;) {
+		if(i+ESTIMATE_LZ_MIN<=len) {
+			j=table[lzhash(buf+i)]-1;
+			table[lzhash(buf+i)]=i+1;
+			if((j>=0)&&(memcmp(buf+j,buf+i,ESTIMATE_LZ_MIN)==0)) {
+				for(l=ESTIMATE_LZ_MIN;(i+l<len)&&(buf[j+l]==buf[i+l]);l++);
+				bits+=ESTIMATE_LZ_MATCH_BITS;
+				// 重复串内部的位置也加入哈希表
+				for(j=i+1;(j<i+l)&&(j+ESTIMATE_LZ_MIN<=len);j++)
+					table[lzhash(buf+j)]=j+1;
+				prev=buf[i+l-1];
+				i+=l;
+				continue;
+			};
+		};
+		ctx=counts+257*prev;
+		bits+=flog2((ctx[256]+128.0)/(ctx[buf[i]]+0.5));
+		ctx[buf[i]]++;
+		ctx[256]++;
+		prev=buf[i];
+		i++;
+	};
+
+	return bits;
+}
+
+/**
+ * 功能：从锚点向一个方向扩展近似匹配，规则与扫描循环中的前向/后向扩展相同（得分=相同字节数*2-长度）
+ * 参数：
+ *   - old/new: 锚点处（向前扩展时为锚点前一个字节）的旧文件、新文件指针
+ *   - limit: 最多扩展的字节数
+ *   - dir: 1表示向后（地址增大方向），-1表示向前
+ * 返回：使得分最高的扩展长度
+ */
+static int64_t extendmatch(const uint8_t *old,const uint8_t *new,int64_t limit,int dir)
+{
+	int64_t i,score=0,best=0,len=0;
+
+	for(i=0;i<limit;i++) {
+		score+=(old[i*dir]==new[i*dir]) ? 1 : -1;
+		if(score>best) { best=score; len=i+1; };
+		if(score<best-ESTIMATE_GIVEUP) break;
+	};
+	return len;
+}
+
+/**
+ * 功能：不做完整差分，估算bsdiff_ex使用相同可选参数时的补丁大小、耗时和峰值内存
+ * 参数：
+ *   - old/oldsize/new/newsize: 同bsdiff
+ *   - stream: 只使用malloc/free（草图、样本和压缩模型的临时空间，约2MB加旧文件大小的一半）
+ *   - options: 将要用于bsdiff_ex的可选参数（可以为NULL），flags和format影响估算结果
+ *   - estimate: 输出的估算结果：
+ *       patchsize按样本的压缩模型位数乘以newsize/样本长度推算，另加控制数据和文件头；
+ *       similarity为样本中能与旧文件对齐的字节比例；
+ *       memory与bsdiff_ex的分配一一对应；seconds用本机构建草图的速度换算
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 内存分配失败（estimate不变）
+ * 
+ * 实现：对旧文件按内容采样建立锚点草图，在新文件中均匀取最多ESTIMATE_MAX_WINDOWS个窗口，
+ *       用草图找锚点并按扫描循环的规则扩展，生成样本对应的差异数据和额外数据后交给压缩模型。
+ *       耗时约为读一遍旧文件，远小于排序
+ */
+int bsdiff_estimate(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+		struct bsdiff_stream* stream, const struct bsdiff_options* options,
+		struct bsdiff_estimate* estimate)
+{
+	uint64_t gear[256];
+	struct sketch_slot* sketch=NULL;   // 旧文件草图
+	uint8_t* payload=NULL;             // 样本对应的补丁数据（差异数据和额外数据）
+	uint32_t* counts=NULL;             // 压缩模型的计数表
+	int64_t* table=NULL;               // 压缩模型的重复串哈希表
+	int64_t mask,slot,nslots,i,p,a,b,f,q,w,nwin,start,end,covered;
+	int64_t sampled=0,aligned=0,records=0,dirty=0,len=0,lastoff=-oldsize-1;
+	uint64_t h;
+	clock_t t0,t1;
+	double scale,bits,hashtime,logold,sortbytes,spanbytes,searches,d;
+	int flags,format,levels;
+
+	flags = options ? options->flags : 0;
+	format = options ? options->format : BSDIFF_FORMAT_43;
+
+	nwin=(newsize+ESTIMATE_WINDOW-1)/ESTIMATE_WINDOW;
+	if(nwin>ESTIMATE_MAX_WINDOWS) nwin=ESTIMATE_MAX_WINDOWS;
+	for(mask=1;mask<2*(oldsize>>6)+2;mask<<=1);
+	if(((sketch=stream->malloc(mask*sizeof(struct sketch_slot)))==NULL) ||
+		((payload=stream->malloc(nwin*ESTIMATE_WINDOW+1))==NULL) ||
+		((counts=stream->malloc(256*257*sizeof(uint32_t)))==NULL) ||
+		((table=stream->malloc(((size_t)1<<ESTIMATE_LZ_BITS)*sizeof(int64_t)))==NULL)) {
+		if(sketch) stream->free(sketch);
+		if(payload) stream->free(payload);
+		if(counts) stream->free(counts);
+		return -1;
+	};
+
+	/* 第一步：构建旧文件草图，即按内容采样的锚点哈希表 */
+	for(i=0;i<mask;i++) sketch[i].pos=0;
+	mask--;
+	geartable(gear);
+
+	// 记录构建草图的耗时，用来换算本机上排序和扫描的耗时
+	t0=clock();
+	for(i=0,h=0,nslots=0;(i<oldsize)&&(nslots<mask/2);i++) {
+		h=(h<<1)+gear[old[i]];
+		if((i<ESTIMATE_KMER-1)||(h>>ESTIMATE_SAMPLE_SHIFT)) continue;
+		for(slot=(int64_t)(h&mask);sketch[slot].pos&&(sketch[slot].hash!=h);slot=(slot+1)&mask);
+		if(sketch[slot].pos) continue;  // 相同的锚点只保留第一次出现的位置
+		sketch[slot].hash=h;
+		sketch[slot].pos=i-ESTIMATE_KMER+2;
+		nslots++;
+	};
+	t1=clock();
+
+	/* 第二步：在新文件中均匀取若干窗口，用草图找锚点并像扫描循环那样扩展，
+	   同时按补丁中的排列生成样本对应的差异数据和额外数据 */
+	for(w=0;w<nwin;w++) {
+		start=(nwin>1) ? w*((newsize-ESTIMATE_WINDOW)/(nwin-1)) : 0;
+		end=(start+ESTIMATE_WINDOW<newsize) ? start+ESTIMATE_WINDOW : newsize;
+		sampled+=end-start;
+
+		for(p=start,h=0,covered=start;p<end;p++) {
+			h=(h<<1)+gear[new[p]];
+			a=p-ESTIMATE_KMER+1;
+			if((a<covered)||(h>>ESTIMATE_SAMPLE_SHIFT)) continue;
+			// 与扫描循环一样优先沿用上一个区域的偏移，重复内容才不会被对齐到错误的位置
+			q=a+lastoff;
+			if((q<0)||(q+ESTIMATE_KMER>oldsize)||(memcmp(old+q,new+a,ESTIMATE_KMER)!=0)) {
+				for(slot=(int64_t)(h&mask);sketch[slot].pos&&(sketch[slot].hash!=h);slot=(slot+1)&mask);
+				if(sketch[slot].pos==0) continue;
+				q=sketch[slot].pos-1;
+				if(memcmp(old+q,new+a,ESTIMATE_KMER)!=0) continue;
+			};
+
+			// 向两侧扩展，窗口内[b,f)与旧文件中相同偏移的区域对齐
+			b=a-extendmatch(old+q-1,new+a-1,(a-covered<q) ? a-covered : q,-1);
+			f=a+ESTIMATE_KMER+extendmatch(old+q+ESTIMATE_KMER,new+a+ESTIMATE_KMER,
+					(end-a<oldsize-q) ? end-a-ESTIMATE_KMER : oldsize-q-ESTIMATE_KMER,1);
+
+			// [covered,b)作为额外数据，[b,f)作为差异数据；偏移改变时需要一条新的控制记录
+			for(i=covered;i<b;i++) payload[len++]=new[i];
+			for(i=b;i<f;i++) payload[len++]=new[i]-old[q+i-a];
+			if(q-a!=lastoff) records++;
+			lastoff=q-a;
+			aligned+=f-b;
+			covered=f;
+			p=f-1;
+		};
+		for(i=covered;i<end;i++) payload[len++]=new[i];
+	};
+
+	// 相同区域预处理以平均约CDC_MIN_CHUNK+1KB的块为单位比较，含有任何差异的块都要进入排序
+	for(p=0;p<len;p+=CDC_MIN_CHUNK+1024) {
+		for(i=p;(i<len)&&(i<p+CDC_MIN_CHUNK+1024)&&(payload[i]==0);i++);
+		if((i<len)&&(i<p+CDC_MIN_CHUNK+1024))
+			dirty+=((len-p<CDC_MIN_CHUNK+1024) ? len-p : CDC_MIN_CHUNK+1024);
+	};
+
+	bits=modelbits(payload,len,counts,table);
+	stream->free(table);
+	stream->free(counts);
+	stream->free(payload);
+	stream->free(sketch);
+
+	/* 第三步：由样本推算整个文件 */
+	scale=sampled ? (double)newsize/sampled : 0;
+
+	// 补丁大小：补丁数据按压缩模型计，控制数据按每条记录的平均压缩后大小计，另加文件头和bzip2的开销
+	bits=bits*ESTIMATE_BZIP2_RATIO+
+		8.0*records*((format==BSDIFF_FORMAT_44) ? ESTIMATE_CTRL44_BYTES : ESTIMATE_CTRL43_BYTES);
+	estimate->patchsize=(int64_t)(bits/8*scale)+((format==BSDIFF_FORMAT_44) ? 82 : 74);
+	estimate->similarity=sampled ? (double)aligned/sampled : 0;
+
+	// 峰值内存：与bsdiff_ex的分配一一对应（不含调用者持有的旧文件和新文件）
+	for(levels=0;(levels<SEARCH_TABLE_LEVELS)&&(((int64_t)1<<levels)<oldsize);levels++);
+	estimate->memory=MIN(newsize+1,BSDIFF_SCRATCH_SIZE)+2*(oldsize+1)*(int64_t)sizeof(int64_t);
+	if(flags&BSDIFF_FLAG_SEARCHTABLE) {
+		// 搜索表在释放V之后分配，匹配延续模式下V不释放
+		if(flags&BSDIFF_FLAG_CONTINUE)
+			estimate->memory+=((int64_t)1<<levels)*(int64_t)sizeof(struct search_node);
+		else if(((int64_t)1<<levels)*(int64_t)sizeof(struct search_node)>(oldsize+1)*(int64_t)sizeof(int64_t))
+			estimate->memory+=((int64_t)1<<levels)*(int64_t)sizeof(struct search_node)-
+				(oldsize+1)*(int64_t)sizeof(int64_t);
+	};
+	// 相同区域预处理只对未匹配的区间分别排序，此时上式是上限
+	if(flags&BSDIFF_FLAG_PREPASS)
+		estimate->memory+=(oldsize/CDC_MIN_CHUNK+1)*5*(int64_t)sizeof(int64_t);
+
+	// 耗时：排序约为n*log2(n)，扫描时未对齐的字节每个都要搜索一次，对齐区域只在开头搜索；
+	// 用本机构建草图每字节的耗时换算成秒。相同区域预处理先对两个文件分块计算哈希，
+	// 之后只有含差异的块参与排序
+	hashtime=oldsize ? (double)(t1-t0)/CLOCKS_PER_SEC/oldsize : 0;
+	if(hashtime<ESTIMATE_MIN_HASH_SECONDS) hashtime=ESTIMATE_MIN_HASH_SECONDS;
+	logold=flog2((double)oldsize+2);
+	sortbytes=oldsize;
+	searches=(sampled-aligned+records)*scale;
+	if((flags&BSDIFF_FLAG_PREPASS)&&sampled) {
+		// 含差异的块随机分布时，连续的含差异块（即一段需要排序的区间）平均长度为块长/(1-d)
+		d=(double)dirty/sampled;
+		sortbytes*=d;
+		spanbytes=(d<1) ? (CDC_MIN_CHUNK+1024)/(1-d) : sortbytes;
+		if(spanbytes>sortbytes) spanbytes=sortbytes;
+		estimate->seconds=hashtime*(ESTIMATE_PREPASS_COST*(oldsize+newsize)+
+			ESTIMATE_SPAN_SORT_COST*sortbytes*flog2(spanbytes+2)+
+			ESTIMATE_SEARCH_COST*searches*logold);
+	} else {
+		estimate->seconds=hashtime*(ESTIMATE_SORT_COST*sortbytes*flog2(sortbytes+2)+
+			ESTIMATE_SEARCH_COST*searches*logold);
+	};
+
+	return 0;
+}
+
 #if defined(BSDIFF_EXECUTABLE)
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <bzlib.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "bsalloc.h"
+#include "bscache.h"
+#include "bsfilter.h"
+#include "bshash.h"
+#include "bspatch.h"
+#include "bszstd.h"
+
+// 命令行用法
+#define USAGE "usage: %s [-pcsSVD] [-f 43|44] [-z level] [-T seconds] [-C cachedir [-M maxMB]] [-H thp|2m|1g]\n" \
+	"       [-N interleave|local] [-B x86|arm64|auto] [-m oldfile]... oldfile newfile patchfile\n" \
+	"       %s -E [-pcs] [-f 43|44] [-B x86|arm64|auto] oldfile newfile\n"
+
 /**
  * 功能：向BZip2压缩流中写入数据
  * 参数：
@@ -582,6 +2238,304 @@ static int bz2_write(struct bsdiff_stream* stream, const void* buffer, int size)
 	return 0;  // 成功
 }
 
+/**
+ * 功能：把文件私有映射到内存（用于补丁缓存模式，命中时只需计算哈希；
+ *       预处理过滤器会原地改写映射的内容，但不会写回文件）
+ * 参数：
+ *   - path: 文件路径
+ *   - size: 输出的文件大小
+ * 返回：
+ *   - 映射的地址，空文件返回一个1字节的堆缓冲区（由unmapfile统一释放）
+ *   失败时由err函数直接退出
+ */
+static uint8_t* mapfile(const char* path,off_t* size)
+{
+	int fd;
+	struct stat sb;
+	uint8_t* p;
+
+	if(((fd=open(path,O_RDONLY,0))<0)||fstat(fd,&sb)) err(1,"%s",path);
+	*size=sb.st_size;
+	if(*size==0) {
+		// mmap不接受0长度
+		if((p=malloc(1))==NULL) err(1,"%s",path);
+	} else {
+		if((p=mmap(NULL,*size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0))==MAP_FAILED) err(1,"%s",path);
+		madvise(p,*size,MADV_WILLNEED);
+	};
+	if(close(fd)==-1) err(1,"%s",path);
+
+	return p;
+}
+
+/**
+ * 功能：释放mapfile返回的内存
+ */
+static void unmapfile(uint8_t* p,off_t size)
+{
+	if(size==0) free(p); else munmap(p,size);
+}
+
+/**
+ * 功能：直接写入补丁文件（zstd引擎的输出已经是压缩数据）
+ * 参数：
+ *   - stream: 数据流，opaque指向补丁文件
+ *   - buffer/size: 要写入的数据
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 写入失败
+ */
+static int file_write(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+	return (fwrite(buffer, 1, size, (FILE*)stream->opaque) == (size_t)size) ? 0 : -1;
+}
+
+/**
+ * 功能：用zstd引擎生成补丁数据（参数同bszstd_diff）
+ */
+static int zstd_diff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+		struct bsdiff_stream* stream, int level)
+{
+#if defined(HAVE_ZSTD)
+	return bszstd_diff(old, oldsize, new, newsize, stream, level);
+#else
+	(void)old; (void)oldsize; (void)new; (void)newsize; (void)stream; (void)level;
+	return -1;  // 不会到达：没有zstd支持时-z在解析参数时就被拒绝
+#endif
+}
+
+/**
+ * 功能：从文件描述符读取新文件（流式输入模式）
+ * 参数：
+ *   - input: 新文件输入流，opaque指向文件描述符
+ *   - buffer: 输出缓冲区
+ *   - length: 要读取的字节数
+ * 返回：
+ *   - 0: 成功读取length字节
+ *   - -1: 读取失败或文件提前结束
+ */
+static int fd_read(const struct bsdiff_input* input, void* buffer, int length)
+{
+	int fd = *(int*)input->opaque;
+	ssize_t n;
+
+	while (length > 0) {
+		if ((n = read(fd, buffer, length)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buffer = (uint8_t*)buffer + n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * 功能：把整个文件读入内存（多基准模式的其他旧文件）
+ * 参数：
+ *   - path: 文件路径
+ *   - size: 输出的文件大小
+ * 返回：
+ *   - 文件内容（多分配1字节），失败时由err函数直接退出
+ */
+static uint8_t* readfile(const char* path,int64_t* size)
+{
+	int fd;
+	uint8_t* p;
+
+	if(((fd=open(path,O_RDONLY,0))<0) ||
+		((*size=lseek(fd,0,SEEK_END))==-1) ||
+		((p=malloc(*size+1))==NULL) ||
+		(lseek(fd,0,SEEK_SET)!=0) ||
+		(read(fd,p,*size)!=*size) ||
+		(close(fd)==-1)) err(1,"%s",path);
+
+	return p;
+}
+
+/**
+ * 功能：从BZip2压缩的补丁中读取数据（-V校验时使用）
+ * 参数：同bspatch_stream.read，opaque指向BZip2文件句柄
+ * 返回：
+ *   - 0: 成功读取length字节
+ *   - -1: 读取失败
+ */
+static int bz2_read(const struct bspatch_stream* stream, void* buffer, int length)
+{
+	int bz2err;
+
+	if (BZ2_bzRead(&bz2err, (BZFILE*)stream->opaque, buffer, length) != length)
+		return -1;
+	return 0;
+}
+
+#if defined(HAVE_ZSTD)
+/**
+ * 功能：直接从补丁文件中读取数据（-V校验zstd引擎的补丁时使用）
+ */
+static int file_read(const struct bspatch_stream* stream, void* buffer, int length)
+{
+	return (fread(buffer, 1, length, (FILE*)stream->opaque) == (size_t)length) ? 0 : -1;
+}
+#endif
+
+/**
+ * 功能：-V：重新读入刚写出的补丁文件，在内存中应用并与新文件比较
+ * 参数：
+ *   - path: 补丁文件路径
+ *   - hdrlen: 补丁文件头的长度
+ *   - zlevel: 非0表示zstd引擎生成的补丁
+ *   - format: 补丁格式
+ *   - refs/refsizes/nrefs: 全部旧文件（0号为oldfile，普通补丁nrefs为1）
+ *   - new/newsize: 新文件（与生成补丁时相同，包括预处理过滤器的变换）
+ * 返回：
+ *   - 0: 补丁能够精确重建新文件
+ *   - -1: 读取失败或重建结果不同
+ */
+static int verifypatch(const char* path, long hdrlen, int zlevel, int format,
+		const uint8_t* const* refs, const int64_t* refsizes, int nrefs,
+		const uint8_t* new, int64_t newsize)
+{
+	struct bspatch_stream stream;
+	struct bspatch_options options;
+	FILE* f;
+	BZFILE* bz2 = NULL;
+	uint8_t* out;
+	int bz2err, result = -1;
+
+	if ((out = malloc(newsize + 1)) == NULL)
+		return -1;
+	if ((f = fopen(path, "r")) == NULL || fseek(f, hdrlen, SEEK_SET)) {
+		free(out);
+		if (f)
+			fclose(f);
+		return -1;
+	}
+
+	memset(&options, 0, sizeof(options));
+	options.format = format;
+	if (nrefs > 1) {
+		options.nrefs = nrefs;
+		options.refs = refs;
+		options.refsizes = refsizes;
+		if ((options.refpos = calloc(nrefs, sizeof(int64_t))) == NULL)
+			goto out;
+	}
+	if (zlevel) {
+#if defined(HAVE_ZSTD)
+		stream.read = file_read;
+		stream.opaque = f;
+		if (bszstd_patch(refs[0], refsizes[0], out, newsize, &stream))
+			goto out;
+#endif
+	} else {
+		if ((bz2 = BZ2_bzReadOpen(&bz2err, f, 0, 0, NULL, 0)) == NULL)
+			goto out;
+		stream.read = bz2_read;
+		stream.opaque = bz2;
+		if (bspatch_ex(refs[0], refsizes[0], out, newsize, &stream, &options))
+			goto out;
+	}
+	if (memcmp(out, new, newsize) == 0)
+		result = 0;
+
+out:
+	if (bz2)
+		BZ2_bzReadClose(&bz2err, bz2);
+	fclose(f);
+	free(options.refpos);
+	free(out);
+	return result;
+}
+
+// -B auto：新旧文件合计不超过这个大小时实际差分两次比较，否则只比较估算结果
+#define FILTER_TRIAL_MAX (4 << 20)
+
+/**
+ * 功能：-B auto：实际差分一次，返回压缩后的补丁数据大小（不含文件头）
+ * 参数：
+ *   - old/oldsize/new/newsize: 同bsdiff
+ *   - stream: 只使用malloc/free
+ *   - options: 同bsdiff_ex（不输出降级策略）
+ * 返回：
+ *   - >=0: 补丁数据大小
+ *   - -1: 失败
+ */
+static int64_t trialsize(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+		const struct bsdiff_stream* stream, const struct bsdiff_options* options)
+{
+	struct bsdiff_stream trial = *stream;
+	struct bsdiff_options opts = *options;
+	FILE* f;
+	BZFILE* bz2;
+	unsigned int inlo, inhi, outlo, outhi;
+	int bz2err, result;
+
+	if ((f = fopen("/dev/null", "w")) == NULL)
+		return -1;
+	if ((bz2 = BZ2_bzWriteOpen(&bz2err, f, 9, 0, 0)) == NULL) {
+		fclose(f);
+		return -1;
+	}
+	trial.write = bz2_write;
+	trial.opaque = bz2;
+	opts.degraded = NULL;
+	result = bsdiff_ex(old, oldsize, new, newsize, &trial, &opts);
+	BZ2_bzWriteClose64(&bz2err, bz2, result != 0, &inlo, &inhi, &outlo, &outhi);
+	fclose(f);
+	if (result || bz2err != BZ_OK)
+		return -1;
+
+	return ((int64_t)outhi << 32) | outlo;
+}
+
+/**
+ * 功能：-B auto：判断预处理过滤器能否使补丁变小
+ * 参数：
+ *   - old/oldsize/new/newsize: 新旧文件（判断后恢复原样）
+ *   - stream/options: 同bsdiff_estimate
+ * 返回：
+ *   - BSFILTER_*：新文件是x86或arm64可执行文件，并且使用过滤器时补丁明显更小
+ *   - BSFILTER_NONE: 其他情况
+ *
+ * bsdiff逐字节相减，本来就能很好地处理整体移动的代码中不变的相对调用，过滤器在多数情况下
+ * 反而使补丁变大，因此需要先比较。新旧文件合计不超过FILTER_TRIAL_MAX时实际差分两次，
+ * 保留较小的一个；更大的文件只用bsdiff_estimate估算（代价是差分时间的几个百分点），
+ * 估算有误差，过滤后的估算值要小于不过滤时的95%才使用过滤器
+ */
+static int choosefilter(uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
+		struct bsdiff_stream* stream, const struct bsdiff_options* options)
+{
+	struct bsdiff_estimate raw, filtered;
+	int filter, trial;
+
+	if ((filter = bsfilter_detect(new, newsize)) == BSFILTER_NONE)
+		return BSFILTER_NONE;
+	trial = (oldsize + newsize <= FILTER_TRIAL_MAX);
+	if (trial)
+		raw.patchsize = trialsize(old, oldsize, new, newsize, stream, options);
+	else if (bsdiff_estimate(old, oldsize, new, newsize, stream, options, &raw))
+		raw.patchsize = -1;
+	if (raw.patchsize < 0)
+		return BSFILTER_NONE;
+	bsfilter_encode(old, oldsize, filter);
+	bsfilter_encode(new, newsize, filter);
+	if (trial)
+		filtered.patchsize = trialsize(old, oldsize, new, newsize, stream, options);
+	else if (bsdiff_estimate(old, oldsize, new, newsize, stream, options, &filtered))
+		filtered.patchsize = -1;
+	bsfilter_decode(old, oldsize, filter);
+	bsfilter_decode(new, newsize, filter);
+	if (filtered.patchsize < 0)
+		return BSFILTER_NONE;
+
+	if (trial)
+		return (filtered.patchsize < raw.patchsize) ? filter : BSFILTER_NONE;
+	return (filtered.patchsize < 0.95 * raw.patchsize) ? filter : BSFILTER_NONE;
+}
+
 /**
  * 功能：程序主入口，生成补丁文件
  * 参数：
@@ -600,36 +2554,223 @@ int main(int argc,char *argv[])
 	uint8_t buf[8];                // 临时缓冲区（用于存储新文件大小）
 	FILE * pf;                     // 补丁文件指针
 	struct bsdiff_stream stream;   // 数据流结构
+	struct bsdiff_options options; // 差分可选参数
 	BZFILE* bz2;                   // BZip2文件句柄
+	int ch;                        // 命令行选项
+	const char* cachedir = NULL;   // 补丁缓存目录（NULL表示不使用缓存）
+	uint64_t cachemax = 0;         // 补丁缓存大小上限（0表示不限制）
+	char settings[64];             // 影响补丁内容的设置，参与缓存键的计算
+	uint8_t key[BSCACHE_KEY_LEN];  // 补丁缓存键
+	int alloc = 0;                 // 大块内存分配策略（BSALLOC_*组合）
+	int estimate = 0;              // 只估算代价，不生成补丁
+	struct bsdiff_estimate est;    // 估算结果
+	const char** refpaths;         // 多基准：-m指定的其他旧文件路径
+	const uint8_t** refs = NULL;   // 多基准：全部旧文件（0号为oldfile）
+	int64_t* refsizes = NULL;      // 多基准：全部旧文件的大小
+	int nrefs = 0;                 // 多基准：-m指定的旧文件个数
+	int streaming = 0;             // 流式读取新文件，不把新文件整个读入内存
+	int newfd = -1;                // 流式输入：新文件描述符
+	struct bsdiff_input input;     // 流式输入：新文件输入流
+	int zlevel = 0;                // zstd引擎的压缩级别（0表示使用后缀排序引擎）
+	int degraded = 0;              // 时间预算：实际采用的降级策略
+	int filter = BSFILTER_NONE;    // 预处理过滤器（BSFILTER_*）
+	int autofilter = 0;            // -B auto：根据估算结果决定是否使用过滤器
+	int verify = 0;                // -V：生成后重新应用补丁并与新文件比较
+	int digests = 0;               // -D：在文件头中附带旧文件和新文件的摘要
+	uint8_t digest[2*BSHASH_LEN];  // 旧文件和新文件的摘要（过滤器变换之前）
+	int i;
+
+	if ((refpaths = malloc(argc * sizeof(char*))) == NULL)
+		err(1, NULL);
 
 	// 初始化BZip2句柄
 	memset(&bz2, 0, sizeof(bz2));
 	// 设置数据流的内存分配函数
-	stream.malloc = malloc;
-	stream.free = free;
+	stream.malloc = bsalloc_malloc;
+	stream.free = bsalloc_free;
 	stream.write = bz2_write;
+	memset(&options, 0, sizeof(options));
+	options.degraded = &degraded;
+
+	// 解析命令行选项
+	//   -p: 启用相同区域预处理
+	//   -c: 启用匹配延续模式
+	//   -s: 使用缓存友好的搜索表
+	//   -f 43|44: 补丁格式（默认43，兼容旧版bspatch）
+	//   -C dir: 使用按内容寻址的补丁缓存目录
+	//   -M maxMB: 补丁缓存大小上限（MB）
+	//   -H thp|2m|1g: 后缀数组等大块内存使用大页
+	//   -N interleave|local: 后缀数组等大块内存的NUMA放置
+	//   -E: 估算补丁大小、耗时和峰值内存，不生成补丁
+	//   -m oldfile: 多基准差分，新文件还可以引用这个旧文件（可以重复，隐含-f 44）
+	//   -S: 流式读取新文件，新文件占用的内存与其大小无关
+	//   -z level: 使用zstd引擎（旧文件作为前缀字典+长距离匹配），速度快得多，补丁略大
+	//   -T seconds: 时间预算，预计超时时降低匹配质量，补丁可能更大
+	//   -B x86|arm64|auto: 可执行文件预处理过滤器（隐含-f 44），auto表示按估算结果决定
+	//   -V: 校验：检查后缀数组，并在写出补丁后重新应用补丁，结果必须与新文件完全相同
+	//   -D: 文件头中附带旧文件和新文件的摘要，供bspatch检查（隐含-f 44）
+	while((ch=getopt(argc,argv,"pcsf:C:M:H:N:Em:Sz:T:B:VD"))!=-1) {
+		switch(ch) {
+		case 'p': options.flags|=BSDIFF_FLAG_PREPASS; break;
+		case 'c': options.flags|=BSDIFF_FLAG_CONTINUE; break;
+		case 's': options.flags|=BSDIFF_FLAG_SEARCHTABLE; break;
+		case 'f':
+			if(strcmp(optarg,"43")==0) options.format=BSDIFF_FORMAT_43;
+			else if(strcmp(optarg,"44")==0) options.format=BSDIFF_FORMAT_44;
+			else errx(1,"unknown patch format: %s\n",optarg);
+			break;
+		case 'C': cachedir=optarg; break;
+		case 'E': estimate=1; break;
+		case 'm': refpaths[nrefs++]=optarg; break;
+		case 'S': streaming=1; break;
+		case 'z':
+			zlevel=atoi(optarg);
+			if(zlevel<1||zlevel>22) errx(1,"zstd level must be 1-22: %s\n",optarg);
+			break;
+		case 'T':
+			options.budget=atof(optarg);
+			if(options.budget<=0) errx(1,"time budget must be positive: %s\n",optarg);
+			break;
+		case 'B':
+			if(strcmp(optarg,"x86")==0) filter=BSFILTER_X86;
+			else if(strcmp(optarg,"arm64")==0) filter=BSFILTER_ARM64;
+			else if(strcmp(optarg,"auto")==0) autofilter=1;
+			else errx(1,"unknown filter: %s\n",optarg);
+			break;
+		case 'V': verify=1; options.flags|=BSDIFF_FLAG_CHECKSORT; break;
+		case 'D': digests=1; break;
+		case 'M': cachemax=(uint64_t)strtoull(optarg,NULL,10)<<20; break;
+		case 'H':
+			if(strcmp(optarg,"thp")==0) alloc|=BSALLOC_HUGE_THP;
+			else if(strcmp(optarg,"2m")==0) alloc|=BSALLOC_HUGE_2M;
+			else if(strcmp(optarg,"1g")==0) alloc|=BSALLOC_HUGE_1G;
+			else errx(1,"unknown huge page mode: %s\n",optarg);
+			break;
+		case 'N':
+			if(strcmp(optarg,"interleave")==0) alloc|=BSALLOC_NUMA_INTERLEAVE;
+			else if(strcmp(optarg,"local")==0) alloc|=BSALLOC_NUMA_LOCAL;
+			else errx(1,"unknown NUMA placement: %s\n",optarg);
+			break;
+		default: errx(1,USAGE,argv[0],argv[0]);
+		}
+	}
+	argc-=optind-1;
+	argv+=optind-1;
+
+	// 检查命令行参数数量（估算模式没有补丁文件参数）
+	if(argc!=(estimate ? 3 : 4)) errx(1,USAGE,argv[0],argv[0]);
+	if(estimate) cachedir=NULL;
+	if(nrefs && (estimate || cachedir))
+		errx(1,"-m cannot be combined with -E or -C\n");
+	if(streaming && (nrefs || estimate || cachedir))
+		errx(1,"-S cannot be combined with -m, -E or -C\n");
+	if(zlevel && (nrefs || estimate || streaming))
+		errx(1,"-z cannot be combined with -m, -E or -S\n");
+	if(options.budget>0 && (zlevel || estimate || streaming))
+		errx(1,"-T cannot be combined with -z, -E or -S\n");
+#if !defined(HAVE_ZSTD)
+	if(zlevel) errx(1,"zstd support was not compiled in\n");
+#endif
+	if((filter || autofilter) && (streaming || zlevel))
+		errx(1,"-B cannot be combined with -S or -z\n");
+	if(verify && (streaming || estimate))
+		errx(1,"-V cannot be combined with -S or -E\n");
+	if(digests && (streaming || zlevel))
+		errx(1,"-D cannot be combined with -S or -z\n");
+	if(nrefs || filter || autofilter || digests) options.format=BSDIFF_FORMAT_44;
+	bsalloc_configure(alloc);
+
+	if (cachedir != NULL) {
+		/* 缓存模式：映射两个文件并计算缓存键，命中时直接复制缓存中的补丁 */
+		old = mapfile(argv[1], &oldsize);
+		new = mapfile(argv[2], &newsize);
+		if (zlevel)
+			snprintf(settings, sizeof(settings), "zstd level=%d", zlevel);
+		else
+			snprintf(settings, sizeof(settings), "bsdiff flags=%d format=%d bzip2=9 filter=%d digests=%d",
+					options.flags & ~BSDIFF_FLAG_CHECKSORT, options.format, autofilter ? -1 : filter, digests);
+		if (bscache_key(old, oldsize, new, newsize, settings, key))
+			errx(1, "bscache_key");
+		switch (bscache_fetch(cachedir, key, argv[3])) {
+		case 0:
+			unmapfile(old, oldsize);
+			unmapfile(new, newsize);
+			return 0;
+		case 1:
+			break;
+		default:
+			// 缓存不可用时照常生成补丁
+			warn("%s", cachedir);
+			break;
+		}
+	} else {
+		/* 读取旧文件到内存 */
+		// 分配oldsize+1字节而不是oldsize字节，确保即使oldsize=0也能正确工作
+		if(((fd=open(argv[1],O_RDONLY,0))<0) ||                    // 以只读模式打开旧文件
+			((oldsize=lseek(fd,0,SEEK_END))==-1) ||                // 获取文件大小
+			((old=malloc(oldsize+1))==NULL) ||                     // 分配内存
+			(lseek(fd,0,SEEK_SET)!=0) ||                           // 定位到文件开头
+			(read(fd,old,oldsize)!=oldsize) ||                     // 读取整个文件
+			(close(fd)==-1)) err(1,"%s",argv[1]);                 // 关闭文件
+
+		/* 流式输入：只打开新文件，差分时再按顺序读取 */
+		if (streaming) {
+			if(((newfd=open(argv[2],O_RDONLY,0))<0) ||
+				((newsize=lseek(newfd,0,SEEK_END))==-1) ||
+				(lseek(newfd,0,SEEK_SET)!=0)) err(1,"%s",argv[2]);
+			new=NULL;
+		} else
+		/* 读取新文件到内存 */
+		// 分配newsize+1字节而不是newsize字节，确保即使newsize=0也能正确工作
+		if(((fd=open(argv[2],O_RDONLY,0))<0) ||                    // 以只读模式打开新文件
+			((newsize=lseek(fd,0,SEEK_END))==-1) ||                // 获取文件大小
+			((new=malloc(newsize+1))==NULL) ||                     // 分配内存
+			(lseek(fd,0,SEEK_SET)!=0) ||                           // 定位到文件开头
+			(read(fd,new,newsize)!=newsize) ||                     // 读取整个文件
+			(close(fd)==-1)) err(1,"%s",argv[2]);                 // 关闭文件
+	}
 
-	// 检查命令行参数数量
-	if(argc!=4) errx(1,"usage: %s oldfile newfile patchfile\n",argv[0]);
+	/* 多基准：读入其他旧文件，0号旧文件为oldfile */
+	if (nrefs) {
+		if (((refs = malloc((nrefs + 1) * sizeof(uint8_t*))) == NULL) ||
+			((refsizes = malloc((nrefs + 1) * sizeof(int64_t))) == NULL))
+			err(1, NULL);
+		refs[0] = old;
+		refsizes[0] = oldsize;
+		for (i = 0; i < nrefs; i++)
+			refs[i + 1] = readfile(refpaths[i], &refsizes[i + 1]);
+	}
 
-	/* 读取旧文件到内存 */
-	// 分配oldsize+1字节而不是oldsize字节，确保即使oldsize=0也能正确工作
-	if(((fd=open(argv[1],O_RDONLY,0))<0) ||                    // 以只读模式打开旧文件
-		((oldsize=lseek(fd,0,SEEK_END))==-1) ||                // 获取文件大小
-		((old=malloc(oldsize+1))==NULL) ||                     // 分配内存
-		(lseek(fd,0,SEEK_SET)!=0) ||                           // 定位到文件开头
-		(read(fd,old,oldsize)!=oldsize) ||                     // 读取整个文件
-		(close(fd)==-1)) err(1,"%s",argv[1]);                 // 关闭文件
+	/* 摘要：针对磁盘上的原始文件，因此在过滤器变换之前计算 */
+	if (digests && !estimate) {
+		bshash_buffer(old, oldsize, digest);
+		bshash_buffer(new, newsize, digest + BSHASH_LEN);
+	}
 
+	/* 预处理过滤器：所有旧文件和新文件都做同样的变换 */
+	if (autofilter)
+		filter = choosefilter(old, oldsize, new, newsize, &stream, &options);
+	if (filter != BSFILTER_NONE) {
+		bsfilter_encode(old, oldsize, filter);
+		bsfilter_encode(new, newsize, filter);
+		for (i = 1; i <= nrefs; i++)
+			bsfilter_encode((uint8_t*)refs[i], refsizes[i], filter);
+	}
 
-	/* 读取新文件到内存 */
-	// 分配newsize+1字节而不是newsize字节，确保即使newsize=0也能正确工作
-	if(((fd=open(argv[2],O_RDONLY,0))<0) ||                    // 以只读模式打开新文件
-		((newsize=lseek(fd,0,SEEK_END))==-1) ||                // 获取文件大小
-		((new=malloc(newsize+1))==NULL) ||                     // 分配内存
-		(lseek(fd,0,SEEK_SET)!=0) ||                           // 定位到文件开头
-		(read(fd,new,newsize)!=newsize) ||                     // 读取整个文件
-		(close(fd)==-1)) err(1,"%s",argv[2]);                 // 关闭文件
+	/* 估算模式：输出估算结果后退出（峰值内存包含命令行工具自己持有的两个文件） */
+	if (estimate) {
+		if (bsdiff_estimate(old, oldsize, new, newsize, &stream, &options, &est))
+			err(1, "bsdiff_estimate");
+		printf("patch size:  %lld bytes\n", (long long)est.patchsize);
+		printf("diff time:   %.2f s\n", est.seconds);
+		printf("peak memory: %lld bytes\n", (long long)(est.memory + oldsize + newsize + 2));
+		printf("similarity:  %.1f%%\n", 100 * est.similarity);
+		if (autofilter)
+			printf("filter:      %s\n", filter == BSFILTER_X86 ? "x86" : filter == BSFILTER_ARM64 ? "arm64" : "none");
+		free(old);
+		free(new);
+		return 0;
+	}
 
 	/* 创建补丁文件 */
 	if ((pf = fopen(argv[3], "w")) == NULL)
@@ -637,36 +2778,100 @@ int main(int argc,char *argv[])
 
 	/* 写入补丁文件头（魔数+新文件大小）*/
 	// 将新文件大小编码为8字节大端序格式
-	offtout(newsize, buf);
-	// 写入魔数"ENDSLEY/BSDIFF43"（16字节）
-	if (fwrite("ENDSLEY/BSDIFF43", 16, 1, pf) != 1 ||
+	bscodec_offtout(newsize, buf);
+	// 写入魔数"ENDSLEY/BSDIFF43"、"ENDSLEY/BSDIFF44"或"ENDSLEY/BSDZSTD1"（16字节）
+	if (fwrite(zlevel ? BSZSTD_MAGIC : options.format == BSDIFF_FORMAT_44 ? "ENDSLEY/BSDIFF44" : "ENDSLEY/BSDIFF43",
+			16, 1, pf) != 1 ||
 		fwrite(buf, sizeof(buf), 1, pf) != 1)                    // 写入新文件大小（8字节）
 		err(1, "Failed to write header");
+	// BSDIFF44在新文件大小之后还有8字节的头部标志位（BSDIFF44_HEADER_*组合）
+	bscodec_offtout((nrefs ? BSDIFF44_HEADER_MULTIREF : 0) |
+			(filter == BSFILTER_X86 ? BSDIFF44_HEADER_FILTER_X86 : 0) |
+			(filter == BSFILTER_ARM64 ? BSDIFF44_HEADER_FILTER_ARM64 : 0) |
+			(digests ? BSDIFF44_HEADER_DIGESTS : 0), buf);
+	if (!zlevel && options.format == BSDIFF_FORMAT_44 && fwrite(buf, sizeof(buf), 1, pf) != 1)
+		err(1, "Failed to write header");
+	// 多基准补丁：标志位之后是8字节的旧文件个数
+	bscodec_offtout(nrefs + 1, buf);
+	if (nrefs && fwrite(buf, sizeof(buf), 1, pf) != 1)
+		err(1, "Failed to write header");
+	// 摘要：最后是旧文件（多基准补丁为0号旧文件）和新文件的摘要
+	if (digests && fwrite(digest, sizeof(digest), 1, pf) != 1)
+		err(1, "Failed to write header");
 
 
-	/* 打开BZip2压缩流 */
-	// 使用压缩级别9（最高压缩率）打开BZip2写入器
-	if (NULL == (bz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)))
-		errx(1, "BZ2_bzWriteOpen, bz2err=%d", bz2err);
+	if (zlevel) {
+		/* zstd引擎：文件头之后直接写入zstd帧 */
+		stream.opaque = pf;
+		stream.write = file_write;
+	} else {
+		/* 打开BZip2压缩流 */
+		// 使用压缩级别9（最高压缩率）打开BZip2写入器
+		if (NULL == (bz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)))
+			errx(1, "BZ2_bzWriteOpen, bz2err=%d", bz2err);
 
-	// 设置opaque指针指向BZip2句柄
-	stream.opaque = bz2;
+		// 设置opaque指针指向BZip2句柄
+		stream.opaque = bz2;
+	}
 	// 调用bsdiff函数生成补丁数据
-	if (bsdiff(old, oldsize, new, newsize, &stream))
+	input.opaque = &newfd;
+	input.read = fd_read;
+	if (zlevel ? zstd_diff(old, oldsize, new, newsize, &stream, zlevel) :
+			nrefs ? bsdiff_multi(refs, refsizes, nrefs + 1, new, newsize, &stream, &options) :
+			streaming ? bsdiff_streaming(old, oldsize, &input, newsize, &stream, &options) :
+			bsdiff_ex(old, oldsize, new, newsize, &stream, &options))
 		err(1, "bsdiff");
+	if (streaming && close(newfd) == -1)
+		err(1, "%s", argv[2]);
+	// 请求的大页或NUMA策略不可用时已经退回，提示用户
+	if ((bsalloc_applied() & alloc) != alloc && oldsize + 1 >= (off_t)(BSALLOC_MIN_SIZE / sizeof(int64_t)))
+		warnx("some of the requested allocation policies were unavailable (applied: %#x)", bsalloc_applied());
+	// 超出时间预算时报告采用了哪些降级策略
+	if (degraded)
+		warnx("time budget exceeded, degraded:%s%s%s%s",
+				(degraded & BSDIFF_DEGRADE_SORT) ? " sort" : "",
+				(degraded & BSDIFF_DEGRADE_SEARCH) ? " search" : "",
+				(degraded & BSDIFF_DEGRADE_STRIDE) ? " stride" : "",
+				(degraded & BSDIFF_DEGRADE_EXTRA) ? " extra" : "");
 
 	/* 关闭BZip2压缩流 */
-	BZ2_bzWriteClose(&bz2err, bz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		err(1, "BZ2_bzWriteClose, bz2err=%d", bz2err);
+	if (!zlevel) {
+		BZ2_bzWriteClose(&bz2err, bz2, 0, NULL, NULL);
+		if (bz2err != BZ_OK)
+			err(1, "BZ2_bzWriteClose, bz2err=%d", bz2err);
+	}
 
 	/* 关闭补丁文件 */
 	if (fclose(pf))
 		err(1, "fclose");
 
+	/* 校验：在内存中应用刚写出的补丁（过滤器变换后的数据上比较，与bspatch的逆变换无关） */
+	if (verify && verifypatch(argv[3],
+			24 + (!zlevel && options.format == BSDIFF_FORMAT_44 ? 8 : 0) + (nrefs ? 8 : 0) +
+			(digests ? 2 * BSHASH_LEN : 0), zlevel, options.format,
+			nrefs ? (const uint8_t* const*)refs : (const uint8_t* const*)&old,
+			nrefs ? refsizes : (const int64_t*)&oldsize, nrefs + 1, new, newsize)) {
+		unlink(argv[3]);
+		errx(1, "%s: patch verification failed", argv[3]);
+	}
+
+	/* 把补丁加入缓存（失败不影响已经生成的补丁）；降级生成的补丁与耗时有关，不加入缓存 */
+	if (cachedir != NULL && !degraded && bscache_store(cachedir, key, argv[3], cachemax))
+		warn("%s", cachedir);
+
 	/* 释放分配的内存 */
-	free(old);
-	free(new);
+	if (cachedir != NULL) {
+		unmapfile(old, oldsize);
+		unmapfile(new, newsize);
+	} else {
+		free(old);
+		free(new);
+	}
+	for (i = 1; i <= nrefs; i++)
+		free((void*)refs[i]);
+	free(refs);
+	free(refsizes);
+	free(refpaths);
 
 	return 0;
 }
@@ -44,6 +44,73 @@ struct bsdiff_stream
 	int (*write)(struct bsdiff_stream* stream, const void* buffer, int size);  // 数据写入函数指针
 };
 
+/**
+ * 功能：新文件输入流结构体，定义读取操作
+ * 用于bsdiff_streaming按顺序读取新文件，新文件不需要整个放在内存中
+ */
+struct bsdiff_input
+{
+	void* opaque;  // 不透明指针，存储用户自定义数据（如文件句柄）
+	int (*read)(const struct bsdiff_input* input, void* buffer, int length);  // 读取恰好length字节，成功返回0，失败返回-1
+};
+
+/**
+ * 功能：bsdiff_ex的可选参数
+ * 传入NULL或全部清零时与bsdiff行为一致
+ */
+struct bsdiff_options
+{
+	int flags;   // BSDIFF_FLAG_*组合
+	int format;  // 控制数据编码格式（BSDIFF_FORMAT_*）
+	// 取消检查（可以为NULL）：后缀排序和扫描期间定期调用，
+	// 返回非0时差分中止，函数返回-1（已写出的补丁数据不完整，应丢弃）
+	int (*cancel)(void* opaque);
+	void* opaque;  // 传给cancel的参数
+	// 时间预算（秒，0表示不限制）：按目前的速度预计会超时时依次改用更便宜的策略
+	// （BSDIFF_DEGRADE_*），补丁始终有效，但可能更大，且内容与耗时有关
+	double budget;
+	int* degraded;  // 输出（可以为NULL）：实际采用的降级策略（BSDIFF_DEGRADE_*组合）
+};
+
+// 补丁格式：BSDIFF43为每个控制值固定8字节；
+// BSDIFF44将控制记录按块存放并使用变长整数编码，控制数据更小、解码更快
+# define BSDIFF_FORMAT_43 0
+# define BSDIFF_FORMAT_44 1
+
+// BSDIFF44补丁文件头的标志位：多基准补丁（由bsdiff_multi生成），标志位之后是8字节的旧文件个数
+# define BSDIFF44_HEADER_MULTIREF 0x1
+// BSDIFF44补丁文件头的标志位：新旧文件在差分前经过了bsfilter预处理（x86或arm64），
+// bspatch应用补丁前对旧文件做同样的变换，应用之后对新文件做逆变换
+# define BSDIFF44_HEADER_FILTER_X86 0x2
+# define BSDIFF44_HEADER_FILTER_ARM64 0x4
+// BSDIFF44补丁文件头的标志位：文件头末尾（多基准补丁在旧文件个数之后）附带旧文件和新文件的
+// BLAKE3摘要（bshash，各32字节），bspatch应用前检查旧文件，应用后检查生成的新文件
+# define BSDIFF44_HEADER_DIGESTS 0x8
+
+// 相同区域预处理：剥离公共前后缀，并用内容定义分块找出完全相同的块直接输出，
+// 只有剩余的未匹配区间才进行后缀排序和搜索。适用于新旧文件只有少量改动的情况
+# define BSDIFF_FLAG_PREPASS 0x1
+// 搜索表：排序后额外构建一个约1MB的表，按访问顺序存放二分搜索前16层的中间位置及其前8个字节，
+// 使每次搜索的前几层不必访问后缀数组和旧文件。生成的补丁与不使用时完全相同
+# define BSDIFF_FLAG_SEARCHTABLE 0x2
+// 匹配延续：上一次的匹配顺延到当前扫描位置后仍然有效时，借助逆后缀数组从顺延后的后缀
+// 出发就近搜索，而不是每次都在整个后缀数组中二分。需要在扫描期间多保留(oldsize+1)*8字节
+# define BSDIFF_FLAG_CONTINUE 0x4
+// 排序校验：排序后用逆后缀数组在线性时间内检查后缀数组是一个排列、且相邻后缀严格递增。
+// 后缀数组是唯一的，通过校验即与参考实现qsufsort的结果完全相同，用于验证替换的排序实现，
+// 校验失败时函数返回-1
+# define BSDIFF_FLAG_CHECKSORT 0x8
+
+// 时间预算的降级策略（bsdiff_options.degraded）
+// 搜索时只比较前256个字节，匹配长度也以此为上限
+# define BSDIFF_DEGRADE_SEARCH 0x1
+// 扫描步长从1字节增大到16字节
+# define BSDIFF_DEGRADE_STRIDE 0x2
+// 预算用完，剩余部分作为额外数据输出
+# define BSDIFF_DEGRADE_EXTRA 0x4
+// 后缀排序没有在分给它的时间内完成，使用只按前缀部分排好的近似索引搜索
+# define BSDIFF_DEGRADE_SORT 0x8
+
 /**
  * 功能：计算两个文件的差分并生成补丁文件
  * 参数：
@@ -58,4 +125,127 @@ struct bsdiff_stream
  */
 int bsdiff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream);
 
+/**
+ * 功能：带可选参数的bsdiff
+ * 参数：
+ *   - old/oldsize/new/newsize/stream: 同bsdiff
+ *   - options: 可选参数（可以为NULL）
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+int bsdiff_ex(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+		struct bsdiff_stream* stream, const struct bsdiff_options* options);
+
+/**
+ * 功能：多基准差分，新文件可以引用多个旧文件中的任意一个（例如对多个历史版本同时做差分）
+ * 参数：
+ *   - olds/oldsizes: 各旧文件数据及大小
+ *   - nold: 旧文件个数（至少1个）
+ *   - new/newsize/stream: 同bsdiff
+ *   - options: 可选参数，格式必须为BSDIFF_FORMAT_44；BSDIFF_FLAG_PREPASS被忽略
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ *
+ * 每条控制记录多一个旧文件序号，应用时需要按相同顺序提供全部旧文件（见bspatch_options.nrefs）。
+ * 内部把所有旧文件拼接后排序，内存按旧文件总大小计算
+ */
+int bsdiff_multi(const uint8_t* const* olds, const int64_t* oldsizes, int nold,
+		const uint8_t* new, int64_t newsize, struct bsdiff_stream* stream,
+		const struct bsdiff_options* options);
+
+/**
+ * 功能：新文件流式输入的差分
+ * 参数：
+ *   - old/oldsize: 旧文件数据及大小
+ *   - input: 新文件输入流
+ *   - newsize: 新文件大小
+ *   - stream: 同bsdiff
+ *   - options: 可选参数（可以为NULL）；BSDIFF_FLAG_PREPASS和budget被忽略
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ *
+ * 新文件只保留在一个固定大小（8MB）的窗口中，除旧文件索引外的内存不随新文件大小增长。
+ * 每次搜索最多向后看1MB，超出窗口的候选区域会被强制截断，因此新文件大于1MB时补丁
+ * 可能与bsdiff_ex略有不同
+ */
+int bsdiff_streaming(const uint8_t* old, int64_t oldsize, struct bsdiff_input* input, int64_t newsize,
+		struct bsdiff_stream* stream, const struct bsdiff_options* options);
+
+/**
+ * 功能：bsdiff_estimate的结果
+ */
+struct bsdiff_estimate
+{
+	int64_t patchsize;   // 预计的补丁大小（bzip2压缩后，含文件头，字节数）
+	int64_t memory;      // 预计的峰值内存（bsdiff_ex内部分配的部分，字节数）
+	double seconds;      // 预计的差分耗时（秒，按本机速度换算）
+	double similarity;   // 样本中能与旧文件对齐的字节比例（0~1）
+};
+
+/**
+ * 功能：不做完整差分，估算补丁大小、耗时和峰值内存
+ * 参数：
+ *   - old/oldsize/new/newsize/stream: 同bsdiff（stream只使用malloc/free）
+ *   - options: 将要用于bsdiff_ex的可选参数（可以为NULL）
+ *   - estimate: 输出的估算结果
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败（内存分配失败）
+ *
+ * 对旧文件按内容采样建立草图，在新文件中均匀取最多1MB的窗口与草图匹配，
+ * 耗时约为读一遍旧文件，远小于排序
+ */
+int bsdiff_estimate(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+		struct bsdiff_stream* stream, const struct bsdiff_options* options,
+		struct bsdiff_estimate* estimate);
+
+/**
+ * 功能：旧文件索引（不透明类型），由bsdiff_index_build构建
+ * 同一个旧文件要和多个新文件做差分时，可以只排序一次
+ */
+struct bsdiff_index;
+
+/**
+ * 功能：为旧文件构建可复用的索引
+ * 参数：
+ *   - old/oldsize: 旧文件数据及大小，在索引释放前必须保持有效
+ *   - stream: 提供malloc/free函数的数据流
+ *   - options: 可选参数，决定构建哪些搜索加速结构（可以为NULL）
+ * 返回：
+ *   - 索引指针，失败时返回NULL
+ */
+struct bsdiff_index* bsdiff_index_build(const uint8_t* old, int64_t oldsize,
+		struct bsdiff_stream* stream, const struct bsdiff_options* options);
+
+/**
+ * 功能：利用预先构建的索引计算差分
+ * 不使用BSDIFF_FLAG_PREPASS时结果与对同一旧文件调用bsdiff_ex相同；
+ * 使用时未匹配区间在整个旧文件中搜索，补丁可能不同
+ * 参数：
+ *   - index: 旧文件索引（只读，可以被多个线程同时使用）
+ *   - new/newsize/stream: 同bsdiff
+ *   - options: 可选参数（可以为NULL）
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+int bsdiff_index_diff(const struct bsdiff_index* index, const uint8_t* new, int64_t newsize,
+		struct bsdiff_stream* stream, const struct bsdiff_options* options);
+
+/**
+ * 功能：返回索引占用的内存字节数（不含旧文件数据本身）
+ */
+size_t bsdiff_index_memory(const struct bsdiff_index* index);
+
+/**
+ * 功能：释放索引
+ * 参数：
+ *   - index: 索引（可以为NULL）
+ *   - stream: 提供free函数的数据流
+ */
+void bsdiff_index_free(struct bsdiff_index* index, struct bsdiff_stream* stream);
+
 #endif
@@ -0,0 +1,412 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * bsdiff_ex/bspatch_ex的C++20封装（只有头文件，需要与bsdiff.c、bspatch.c一起链接）
+ *
+ * 输入是std::span<const std::byte>，结果是只能移动的类型；失败时抛出bsdiffpp::error，
+ * 取消时抛出bsdiffpp::cancelled。异步版本把任务交给调用者提供的执行器，返回std::future，
+ * 通过std::stop_token取消：后缀排序和扫描期间定期检查。
+ * 补丁数据是bsdiff_ex写出的原始数据（不含文件头，不压缩），与命令行工具的补丁文件不同。
+ */
+
+#ifndef BSDIFF_HPP
+# define BSDIFF_HPP
+
+# include <algorithm>
+# include <condition_variable>
+# include <cstddef>
+# include <cstdint>
+# include <cstdlib>
+# include <cstring>
+# include <deque>
+# include <exception>
+# include <functional>
+# include <future>
+# include <memory>
+# include <mutex>
+# include <new>
+# include <span>
+# include <stdexcept>
+# include <stop_token>
+# include <thread>
+# include <utility>
+# include <vector>
+
+// C头文件中的参数名new在C++中是关键字，包含时临时替换（必须在所有标准头文件之后）
+# define new new_
+extern "C" {
+# include "bsdiff.h"
+# include "bspatch.h"
+}
+# undef new
+
+namespace bsdiffpp {
+
+/**
+ * 功能：补丁格式（与BSDIFF_FORMAT_*对应）
+ */
+enum class format : int
+{
+	v43 = BSDIFF_FORMAT_43,
+	v44 = BSDIFF_FORMAT_44,
+};
+
+/**
+ * 功能：差分参数
+ */
+struct options
+{
+	int flags = 0;                               // BSDIFF_FLAG_*组合
+	enum format format = bsdiffpp::format::v43;  // 补丁格式
+};
+
+/**
+ * 功能：差分或应用补丁失败（内存分配失败、补丁损坏等）
+ */
+class error : public std::runtime_error
+{
+public:
+	using std::runtime_error::runtime_error;
+};
+
+/**
+ * 功能：任务通过stop_token被取消
+ */
+class cancelled : public error
+{
+public:
+	cancelled() : error("bsdiff: cancelled") {}
+};
+
+/**
+ * 功能：只能移动的字节缓冲区（apply的结果）
+ */
+class buffer
+{
+public:
+	buffer() = default;
+	explicit buffer(std::vector<std::byte> data) noexcept : data_(std::move(data)) {}
+
+	buffer(const buffer&) = delete;
+	buffer& operator=(const buffer&) = delete;
+	buffer(buffer&&) noexcept = default;
+	buffer& operator=(buffer&&) noexcept = default;
+
+	std::span<const std::byte> bytes() const noexcept { return data_; }
+	const std::byte* data() const noexcept { return data_.data(); }
+	std::size_t size() const noexcept { return data_.size(); }
+
+	// 取出内部存储，之后缓冲区为空
+	std::vector<std::byte> release() && noexcept { return std::move(data_); }
+
+private:
+	std::vector<std::byte> data_;
+};
+
+/**
+ * 功能：只能移动的补丁（diff的结果），带有应用时需要的新文件大小和格式
+ */
+class delta
+{
+public:
+	delta() = default;
+	delta(std::vector<std::byte> data, std::int64_t newsize, enum format format) noexcept
+		: data_(std::move(data)), newsize_(newsize), format_(format) {}
+
+	delta(const delta&) = delete;
+	delta& operator=(const delta&) = delete;
+	delta(delta&&) noexcept = default;
+	delta& operator=(delta&&) noexcept = default;
+
+	std::span<const std::byte> bytes() const noexcept { return data_; }
+	std::size_t size() const noexcept { return data_.size(); }
+	std::int64_t newsize() const noexcept { return newsize_; }
+	enum format format() const noexcept { return format_; }
+
+	// 取出补丁数据，之后补丁为空
+	std::vector<std::byte> release() && noexcept { return std::move(data_); }
+
+private:
+	std::vector<std::byte> data_;
+	std::int64_t newsize_ = 0;
+	enum format format_ = bsdiffpp::format::v43;
+};
+
+namespace detail {
+
+/**
+ * 功能：返回span的数据指针（空span也返回有效指针）
+ */
+inline const std::uint8_t* bytes(std::span<const std::byte> s) noexcept
+{
+	static const std::byte empty{};
+
+	return reinterpret_cast<const std::uint8_t*>(s.empty() ? &empty : s.data());
+}
+
+/**
+ * 功能：bsdiff_stream的写入回调，追加到std::vector（异常不能穿过C代码，转换为-1）
+ */
+inline int vector_write(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+	auto* out = static_cast<std::vector<std::byte>*>(stream->opaque);
+	auto* p = static_cast<const std::byte*>(buffer);
+
+	try {
+		out->insert(out->end(), p, p + size);
+	} catch (...) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * 功能：从span顺序读取的补丁数据流
+ */
+struct span_source
+{
+	std::span<const std::byte> data;  // 剩余的补丁数据
+};
+
+/**
+ * 功能：bspatch_stream的读取回调，剩余数据不足时失败
+ */
+inline int span_read(const struct bspatch_stream* stream, void* buffer, int length)
+{
+	auto* in = static_cast<span_source*>(stream->opaque);
+
+	if (length < 0 || static_cast<std::size_t>(length) > in->data.size())
+		return -1;
+	std::memcpy(buffer, in->data.data(), length);
+	in->data = in->data.subspan(length);
+	return 0;
+}
+
+/**
+ * 功能：bsdiff_options的取消检查回调
+ */
+inline int stop_requested(void* opaque)
+{
+	return static_cast<const std::stop_token*>(opaque)->stop_requested() ? 1 : 0;
+}
+
+} // namespace detail
+
+/**
+ * 功能：计算差分
+ * 参数：
+ *   - old/new_: 旧文件和新文件
+ *   - opt: 差分参数
+ *   - stop: 取消令牌（默认不可取消）
+ * 返回：
+ *   - 补丁
+ * 异常：
+ *   - cancelled: stop在完成前被请求
+ *   - error: 差分失败
+ */
+inline delta diff(std::span<const std::byte> old, std::span<const std::byte> new_,
+		const options& opt = {}, std::stop_token stop = {})
+{
+	std::vector<std::byte> out;
+	struct bsdiff_stream stream = { &out, std::malloc, std::free, detail::vector_write };
+	struct bsdiff_options o = {};
+
+	o.flags = opt.flags;
+	o.format = static_cast<int>(opt.format);
+	if (stop.stop_possible()) {
+		o.cancel = detail::stop_requested;
+		o.opaque = &stop;
+	}
+
+	if (stop.stop_requested())
+		throw cancelled();
+	if (bsdiff_ex(detail::bytes(old), static_cast<std::int64_t>(old.size()),
+			detail::bytes(new_), static_cast<std::int64_t>(new_.size()), &stream, &o)) {
+		if (stop.stop_requested())
+			throw cancelled();
+		throw error("bsdiff: diff failed");
+	}
+
+	return delta(std::move(out), static_cast<std::int64_t>(new_.size()), opt.format);
+}
+
+/**
+ * 功能：应用补丁数据
+ * 参数：
+ *   - old: 旧文件
+ *   - patch: 补丁数据（bsdiff_ex写出的原始数据）
+ *   - newsize: 新文件大小
+ *   - fmt: 补丁格式
+ * 返回：
+ *   - 新文件
+ * 异常：
+ *   - error: 补丁损坏或与旧文件不匹配
+ */
+inline buffer apply(std::span<const std::byte> old, std::span<const std::byte> patch,
+		std::int64_t newsize, enum format fmt = bsdiffpp::format::v43)
+{
+	detail::span_source in = { patch };
+	struct bspatch_stream stream = { &in, detail::span_read };
+	struct bspatch_options o = {};
+	std::vector<std::byte> out;
+
+	if (newsize < 0)
+		throw error("bspatch: invalid new size");
+	out.resize(static_cast<std::size_t>(newsize));
+	o.format = static_cast<int>(fmt);
+	if (bspatch_ex(detail::bytes(old), static_cast<std::int64_t>(old.size()),
+			reinterpret_cast<std::uint8_t*>(out.data()), newsize, &stream, &o))
+		throw error("bspatch: corrupt patch");
+
+	return buffer(std::move(out));
+}
+
+/**
+ * 功能：应用diff生成的补丁
+ */
+inline buffer apply(std::span<const std::byte> old, const delta& d)
+{
+	return apply(old, d.bytes(), d.newsize(), d.format());
+}
+
+/**
+ * 功能：执行器，即可以接受一个任务并在某个线程上运行它的对象，
+ * 例如[&](std::function<void()> f) { pool.post(std::move(f)); }
+ */
+template <class E>
+concept executor = requires(E& ex, std::function<void()> task) { ex(std::move(task)); };
+
+/**
+ * 功能：在执行器上异步计算差分
+ * 参数：同diff；old/new_指向的数据必须保持有效，直到返回的future就绪
+ * 返回：
+ *   - 补丁的future，失败或取消时future中保存相应的异常
+ *
+ * 任务开始运行之前就已经取消时直接以cancelled结束，不占用执行器的时间
+ */
+template <executor E>
+std::future<delta> async_diff(E& ex, std::span<const std::byte> old, std::span<const std::byte> new_,
+		options opt = {}, std::stop_token stop = {})
+{
+	// std::function要求可复制，promise通过shared_ptr持有
+	auto promise = std::make_shared<std::promise<delta>>();
+	std::future<delta> result = promise->get_future();
+
+	ex([promise, old, new_, opt, stop]() {
+		try {
+			promise->set_value(diff(old, new_, opt, stop));
+		} catch (...) {
+			promise->set_exception(std::current_exception());
+		}
+	});
+	return result;
+}
+
+/**
+ * 功能：在执行器上异步应用补丁
+ * 参数：同apply；old和d必须保持有效，直到返回的future就绪
+ * 返回：
+ *   - 新文件的future
+ *
+ * 应用补丁是线性的，只在开始之前检查一次取消
+ */
+template <executor E>
+std::future<buffer> async_apply(E& ex, std::span<const std::byte> old, const delta& d,
+		std::stop_token stop = {})
+{
+	auto promise = std::make_shared<std::promise<buffer>>();
+	std::future<buffer> result = promise->get_future();
+
+	ex([promise, old, &d, stop]() {
+		try {
+			if (stop.stop_requested())
+				throw cancelled();
+			promise->set_value(apply(old, d));
+		} catch (...) {
+			promise->set_exception(std::current_exception());
+		}
+	});
+	return result;
+}
+
+/**
+ * 功能：简单的固定大小线程池，满足executor的要求
+ * 析构时先执行完队列中剩余的任务，再结束所有线程
+ */
+class thread_pool
+{
+public:
+	explicit thread_pool(unsigned threads = std::thread::hardware_concurrency())
+	{
+		threads = std::max(threads, 1u);
+		for (unsigned i = 0; i < threads; i++)
+			workers_.emplace_back([this](std::stop_token stop) { run(stop); });
+	}
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	// 提交任务
+	void operator()(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			queue_.push_back(std::move(task));
+		}
+		cv_.notify_one();
+	}
+
+private:
+	/**
+	 * 功能：工作线程主循环，收到停止请求且队列为空时退出
+	 */
+	void run(std::stop_token stop)
+	{
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cv_.wait(lock, stop, [this] { return !queue_.empty(); });
+				if (queue_.empty())
+					return;
+				task = std::move(queue_.front());
+				queue_.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::mutex mutex_;
+	std::condition_variable_any cv_;
+	std::deque<std::function<void()>> queue_;
+	std::vector<std::jthread> workers_;  // 最后声明，析构时最先停止并等待线程结束
+};
+
+} // namespace bsdiffpp
+
+#endif
@@ -0,0 +1,789 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * bsdiffd：常驻的差分服务
+ *
+ * 在本地Unix套接字上接受差分请求，旧文件的索引（后缀数组）保存在按LRU淘汰、
+ * 有内存上限的缓存中，请求由固定数量的工作线程处理。
+ * 缓存命中时请求只需要扫描新文件，不再读取和排序旧文件；
+ * 同一对(旧文件, 新文件)的并发请求只计算一次，其余请求复制计算结果。
+ *
+ * 协议：每个连接一个请求，请求为一行文本
+ *   DIFF\t<旧文件路径>\t<新文件路径>\t<补丁文件路径>\n
+ * 路径由服务进程打开，应使用绝对路径。应答为一行文本：
+ *   OK hit|miss|shared\n   成功（索引命中缓存/新构建索引/复用并发请求的结果）
+ *   ERR <原因>\n            失败
+ * 不使用-p时，生成的补丁文件与bsdiff命令行工具使用相同选项时生成的完全相同。
+ * 请求中的文件以服务进程的身份读写，因此套接字只允许属主访问（0600），
+ * 并且只接受与服务进程有效用户相同的对端，其他连接应答ERR permission denied。
+ */
+
+#if defined(__linux__)
+# define _GNU_SOURCE  // struct ucred（SO_PEERCRED）
+#endif
+
+#include "bsdiff.h"
+#include "bscodec.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <bzlib.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// 命令行用法
+#define USAGE "usage: %s [-w workers] [-m cacheMB] [-pcs] [-f 43|44] socket\n" \
+	"       %s -r socket oldfile newfile patchfile\n"
+
+// 默认工作线程数
+#define DEFAULT_WORKERS 4
+// 默认缓存上限（MB）
+#define DEFAULT_CACHE_MB 1024
+// 等待处理的连接队列长度
+#define QUEUE_LEN 64
+// 请求行最大长度
+#define MAX_REQUEST (3*PATH_MAX+16)
+
+/**
+ * 功能：文件身份，用于判断两次请求是否引用同一个文件的同一个版本
+ */
+struct file_id
+{
+	dev_t dev;             // 设备号
+	ino_t ino;             // inode号
+	off_t size;            // 文件大小
+	struct timespec mtime; // 修改时间
+};
+
+/**
+ * 功能：缓存项，保存一个旧文件的内容及其索引
+ */
+struct cache_entry
+{
+	struct file_id id;            // 旧文件身份
+	uint8_t* old;                 // 旧文件内容
+	int64_t oldsize;              // 旧文件大小
+	struct bsdiff_index* index;   // 旧文件索引
+	size_t memory;                // 旧文件内容和索引占用的内存
+	int refs;                     // 正在使用该项的请求数
+	int ready;                    // 索引是否已构建完成
+	int failed;                   // 索引构建是否失败
+	int linked;                   // 是否仍在LRU链表中
+	struct cache_entry* prev;     // LRU链表中较新的一项
+	struct cache_entry* next;     // LRU链表中较旧的一项
+};
+
+/**
+ * 功能：进行中的请求，用于合并同一对(旧文件, 新文件)的并发请求
+ */
+struct inflight
+{
+	struct file_id old;           // 旧文件身份
+	struct file_id new;           // 新文件身份
+	const char* patch;            // 负责计算的请求写出的补丁文件路径
+	int done;                     // 是否已完成
+	int result;                   // 计算结果（0为成功）
+	int waiters;                  // 等待结果的请求数
+	struct inflight* next;        // 链表中的下一项
+};
+
+/**
+ * 功能：服务的全局状态
+ */
+struct server
+{
+	struct bsdiff_options options;  // 差分可选参数（所有请求相同）
+	size_t cap;                     // 缓存内存上限
+	size_t memory;                  // 缓存当前占用的内存
+
+	pthread_mutex_t lock;           // 保护以下所有字段
+	pthread_cond_t changed;         // 索引构建完成、请求完成或队列变化时广播
+	struct cache_entry* head;       // LRU链表头（最近使用）
+	struct cache_entry* tail;       // LRU链表尾（最久未使用）
+	struct inflight* inflight;      // 进行中的请求
+	int queue[QUEUE_LEN];           // 等待处理的连接
+	int qhead,qlen;                 // 队列头位置及长度
+};
+
+/**
+ * 功能：比较两个文件身份
+ * 返回：
+ *   - 1: 相同
+ *   - 0: 不同
+ */
+static int sameid(const struct file_id* a,const struct file_id* b)
+{
+	return a->dev==b->dev && a->ino==b->ino && a->size==b->size &&
+		a->mtime.tv_sec==b->mtime.tv_sec && a->mtime.tv_nsec==b->mtime.tv_nsec;
+}
+
+/**
+ * 功能：获取已打开文件的身份
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+static int getid(int fd,struct file_id* id)
+{
+	struct stat sb;
+
+	if(fstat(fd,&sb)) return -1;
+	memset(id,0,sizeof(*id));
+	id->dev=sb.st_dev;
+	id->ino=sb.st_ino;
+	id->size=sb.st_size;
+	id->mtime=sb.st_mtim;
+	return 0;
+}
+
+/**
+ * 功能：将已打开的文件完整读入内存
+ * 参数：
+ *   - fd: 文件描述符
+ *   - size: 文件大小
+ * 返回：
+ *   - 文件内容（多分配1字节，确保size=0时也能正确工作），失败时返回NULL
+ */
+static uint8_t* readall(int fd,off_t size)
+{
+	uint8_t* buf;
+	ssize_t n;
+	off_t done;
+
+	if((buf=malloc(size+1))==NULL) return NULL;
+	for(done=0;done<size;done+=n) {
+		if((n=pread(fd,buf+done,size-done,done))<=0) {
+			free(buf);
+			return NULL;
+		};
+	};
+	return buf;
+}
+
+/**
+ * 功能：把缓存项从LRU链表中摘下（调用时必须持有锁）
+ */
+static void unlink_entry(struct server* s,struct cache_entry* e)
+{
+	if(e->prev) e->prev->next=e->next; else s->head=e->next;
+	if(e->next) e->next->prev=e->prev; else s->tail=e->prev;
+	e->prev=e->next=NULL;
+	e->linked=0;
+}
+
+/**
+ * 功能：把缓存项放到LRU链表头部（调用时必须持有锁）
+ */
+static void push_entry(struct server* s,struct cache_entry* e)
+{
+	e->prev=NULL;
+	e->next=s->head;
+	if(s->head) s->head->prev=e; else s->tail=e;
+	s->head=e;
+	e->linked=1;
+}
+
+/**
+ * 功能：释放缓存项
+ */
+static void free_entry(struct cache_entry* e)
+{
+	struct bsdiff_stream stream;
+
+	stream.malloc=malloc;
+	stream.free=free;
+	bsdiff_index_free(e->index,&stream);
+	free(e->old);
+	free(e);
+}
+
+/**
+ * 功能：从LRU链表尾部开始淘汰没有被使用的缓存项，直到内存不超过上限（调用时必须持有锁）
+ * 正在被使用的项不会被淘汰，因此内存占用可能暂时超过上限
+ */
+static void evict(struct server* s)
+{
+	struct cache_entry *e,*prev;
+
+	for(e=s->tail;(e!=NULL)&&(s->memory>s->cap);e=prev) {
+		prev=e->prev;
+		if(e->refs||!e->ready) continue;
+		unlink_entry(s,e);
+		s->memory-=e->memory;
+		free_entry(e);
+	};
+}
+
+/**
+ * 功能：获取旧文件对应的缓存项，未命中时读取旧文件并构建索引
+ * 参数：
+ *   - s: 服务状态
+ *   - fd: 已打开的旧文件
+ *   - id: 旧文件身份
+ *   - hit: 输出，是否命中缓存
+ * 返回：
+ *   - 缓存项（引用计数已加1，用完后调用release），失败时返回NULL
+ *
+ * 同一个旧文件同时被多个请求使用时索引只构建一次，其余请求等待构建完成
+ */
+static struct cache_entry* acquire(struct server* s,int fd,const struct file_id* id,int* hit)
+{
+	struct cache_entry* e;
+	struct bsdiff_stream stream;
+
+	pthread_mutex_lock(&s->lock);
+	for(e=s->head;e!=NULL;e=e->next)
+		if(sameid(&e->id,id)) break;
+
+	if(e!=NULL) {
+		// 命中：移到链表头部，等待可能仍在进行的构建
+		e->refs++;
+		unlink_entry(s,e);
+		push_entry(s,e);
+		while(!e->ready&&!e->failed)
+			pthread_cond_wait(&s->changed,&s->lock);
+		pthread_mutex_unlock(&s->lock);
+		*hit=1;
+		return e;
+	};
+
+	// 未命中：先插入一个未完成的项，使并发的请求等待而不是重复构建
+	if((e=calloc(1,sizeof(*e)))==NULL) {
+		pthread_mutex_unlock(&s->lock);
+		return NULL;
+	};
+	e->id=*id;
+	e->refs=1;
+	push_entry(s,e);
+	pthread_mutex_unlock(&s->lock);
+
+	// 读取旧文件并构建索引（不持有锁）
+	stream.malloc=malloc;
+	stream.free=free;
+	e->oldsize=id->size;
+	if((e->old=readall(fd,id->size))!=NULL)
+		e->index=bsdiff_index_build(e->old,e->oldsize,&stream,&s->options);
+
+	pthread_mutex_lock(&s->lock);
+	if(e->index!=NULL) {
+		e->ready=1;
+		e->memory=e->oldsize+bsdiff_index_memory(e->index);
+		s->memory+=e->memory;
+		evict(s);
+	} else {
+		// 构建失败：从链表中摘下，由最后一个使用者释放
+		e->failed=1;
+		unlink_entry(s,e);
+	};
+	pthread_cond_broadcast(&s->changed);
+	pthread_mutex_unlock(&s->lock);
+
+	*hit=0;
+	return e;
+}
+
+/**
+ * 功能：释放对缓存项的引用
+ */
+static void release(struct server* s,struct cache_entry* e)
+{
+	pthread_mutex_lock(&s->lock);
+	e->refs--;
+	if(e->failed) {
+		if(e->refs==0) free_entry(e);
+	} else {
+		evict(s);
+	};
+	pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * 功能：向BZip2压缩流中写入数据
+ * 参数：
+ *   - stream: 指向数据流结构的指针
+ *   - buffer: 要写入的数据缓冲区
+ *   - size: 要写入的数据大小（字节数）
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 写入失败
+ */
+static int bz2_write(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+	int bz2err;
+	BZFILE* bz2 = (BZFILE*)stream->opaque;
+
+	BZ2_bzWrite(&bz2err, bz2, (void*)buffer, size);
+	if (bz2err != BZ_STREAM_END && bz2err != BZ_OK)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * 功能：生成补丁文件，文件格式与bsdiff命令行工具生成的相同
+ * 参数：
+ *   - s: 服务状态
+ *   - e: 旧文件的缓存项
+ *   - new/newsize: 新文件内容及大小
+ *   - path: 补丁文件路径
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+static int writepatch(struct server* s,const struct cache_entry* e,const uint8_t* new,
+		int64_t newsize,const char* path)
+{
+	FILE* pf;
+	BZFILE* bz2;
+	int bz2err;
+	uint8_t buf[8];
+	struct bsdiff_stream stream;
+	int result;
+
+	if((pf=fopen(path,"w"))==NULL) return -1;
+
+	// 文件头：魔数、新文件大小，BSDIFF44还有8字节的头部标志位
+	bscodec_offtout(newsize,buf);
+	if((fwrite(s->options.format==BSDIFF_FORMAT_44 ? "ENDSLEY/BSDIFF44" : "ENDSLEY/BSDIFF43",16,1,pf)!=1) ||
+		(fwrite(buf,sizeof(buf),1,pf)!=1)) {
+		fclose(pf);
+		return -1;
+	};
+	bscodec_offtout(0,buf);
+	if((s->options.format==BSDIFF_FORMAT_44)&&(fwrite(buf,sizeof(buf),1,pf)!=1)) {
+		fclose(pf);
+		return -1;
+	};
+
+	if((bz2=BZ2_bzWriteOpen(&bz2err,pf,9,0,0))==NULL) {
+		fclose(pf);
+		return -1;
+	};
+
+	stream.opaque=bz2;
+	stream.malloc=malloc;
+	stream.free=free;
+	stream.write=bz2_write;
+	result=bsdiff_index_diff(e->index,new,newsize,&stream,&s->options);
+
+	BZ2_bzWriteClose(&bz2err,bz2,result!=0,NULL,NULL);
+	if(bz2err!=BZ_OK) result=-1;
+	if(fclose(pf)) result=-1;
+
+	return result;
+}
+
+/**
+ * 功能：复制文件（用于把合并请求的结果复制到各自的补丁文件路径）
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+static int copyfile(const char* from,const char* to)
+{
+	int in,out;
+	ssize_t n;
+	char buf[65536];
+	int result=0;
+
+	// 两个请求要求写到同一个文件时无需复制
+	if(strcmp(from,to)==0) return 0;
+
+	if((in=open(from,O_RDONLY))<0) return -1;
+	if((out=open(to,O_WRONLY|O_CREAT|O_TRUNC,0666))<0) {
+		close(in);
+		return -1;
+	};
+	while((n=read(in,buf,sizeof(buf)))>0)
+		if(write(out,buf,n)!=n) { result=-1; break; };
+	if(n<0) result=-1;
+	close(in);
+	if(close(out)) result=-1;
+
+	return result;
+}
+
+/**
+ * 功能：处理一个差分请求
+ * 参数：
+ *   - s: 服务状态
+ *   - oldpath/newpath/patchpath: 请求中的三个路径
+ *   - status: 输出，成功时为应答中的状态（hit/miss/shared），失败时为原因
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+static int handle(struct server* s,const char* oldpath,const char* newpath,const char* patchpath,
+		const char** status)
+{
+	int oldfd=-1,newfd=-1;
+	struct file_id oldid,newid;
+	struct inflight self,*f,**pp;
+	struct cache_entry* e;
+	uint8_t* new=NULL;
+	int hit,result=-1;
+
+	if(((oldfd=open(oldpath,O_RDONLY))<0)||getid(oldfd,&oldid)) {
+		*status="cannot open oldfile";
+		goto out;
+	};
+	if(((newfd=open(newpath,O_RDONLY))<0)||getid(newfd,&newid)) {
+		*status="cannot open newfile";
+		goto out;
+	};
+
+	// 已有相同的请求正在计算时，等待其完成并复制结果
+	pthread_mutex_lock(&s->lock);
+	for(f=s->inflight;f!=NULL;f=f->next)
+		if(sameid(&f->old,&oldid)&&sameid(&f->new,&newid)) break;
+	if(f!=NULL) {
+		f->waiters++;
+		while(!f->done)
+			pthread_cond_wait(&s->changed,&s->lock);
+		pthread_mutex_unlock(&s->lock);
+		// 负责计算的请求在所有等待者复制完成之前不会离开，f->patch保持有效
+		if(f->result==0) result=copyfile(f->patch,patchpath);
+		*status=(result==0) ? "shared" : "cannot write patchfile";
+		pthread_mutex_lock(&s->lock);
+		f->waiters--;
+		pthread_cond_broadcast(&s->changed);
+		pthread_mutex_unlock(&s->lock);
+		goto out;
+	};
+	memset(&self,0,sizeof(self));
+	self.old=oldid;
+	self.new=newid;
+	self.patch=patchpath;
+	self.result=-1;
+	self.next=s->inflight;
+	s->inflight=&self;
+	pthread_mutex_unlock(&s->lock);
+
+	// 自己负责计算
+	if((e=acquire(s,oldfd,&oldid,&hit))==NULL||!e->ready) {
+		*status="cannot index oldfile";
+	} else if((new=readall(newfd,newid.size))==NULL) {
+		*status="cannot read newfile";
+	} else if(writepatch(s,e,new,newid.size,patchpath)) {
+		*status="cannot write patchfile";
+	} else {
+		*status=hit ? "hit" : "miss";
+		result=0;
+	};
+	if(e) release(s,e);
+
+	// 通知等待者，并等它们复制完结果后再从进行中的请求中移除
+	pthread_mutex_lock(&s->lock);
+	self.result=result;
+	self.done=1;
+	pthread_cond_broadcast(&s->changed);
+	while(self.waiters)
+		pthread_cond_wait(&s->changed,&s->lock);
+	for(pp=&s->inflight;*pp!=&self;pp=&(*pp)->next);
+	*pp=self.next;
+	pthread_mutex_unlock(&s->lock);
+
+out:
+	free(new);
+	if(oldfd>=0) close(oldfd);
+	if(newfd>=0) close(newfd);
+	return result;
+}
+
+/**
+ * 功能：检查连接的对端进程是否与服务进程属于同一用户
+ * 参数：
+ *   - fd: 已接受的连接
+ * 返回：
+ *   - 1: 对端的用户等于服务进程的有效用户
+ *   - 0: 不是，或无法取得对端的身份
+ */
+static int samepeer(int fd)
+{
+#if defined(__linux__)
+	struct ucred cred;
+	socklen_t len=sizeof(cred);
+
+	if(getsockopt(fd,SOL_SOCKET,SO_PEERCRED,&cred,&len)||(len!=sizeof(cred))) return 0;
+	return cred.uid==geteuid();
+#else
+	uid_t uid;
+	gid_t gid;
+
+	if(getpeereid(fd,&uid,&gid)) return 0;
+	return uid==geteuid();
+#endif
+}
+
+/**
+ * 功能：读取并处理一个连接上的请求，写回应答（对端不是同一用户时直接拒绝）
+ */
+static void serve(struct server* s,int fd)
+{
+	char req[MAX_REQUEST+1];
+	char reply[128];
+	char *oldpath,*newpath,*patchpath,*end;
+	const char* status="malformed request";
+	size_t len=0;
+	ssize_t n;
+	int result=-1;
+
+	// 路径由服务进程打开，其他用户的请求会借用服务进程的权限，直接拒绝
+	if(!samepeer(fd)) {
+		status="permission denied";
+		goto out;
+	};
+
+	// 读取一行请求
+	while((len<MAX_REQUEST)&&(memchr(req,'\n',len)==NULL)) {
+		if((n=read(fd,req+len,MAX_REQUEST-len))<=0) break;
+		len+=n;
+	};
+	req[len]=0;
+
+	// 解析：DIFF\t<旧文件>\t<新文件>\t<补丁文件>\n
+	if((strncmp(req,"DIFF\t",5)==0)&&((end=strchr(req,'\n'))!=NULL)) {
+		*end=0;
+		oldpath=req+5;
+		if(((newpath=strchr(oldpath,'\t'))!=NULL)&&
+			((patchpath=strchr(newpath+1,'\t'))!=NULL)&&
+			(strchr(patchpath+1,'\t')==NULL)) {
+			*newpath++=0;
+			*patchpath++=0;
+			result=handle(s,oldpath,newpath,patchpath,&status);
+		};
+	};
+
+out:
+	snprintf(reply,sizeof(reply),"%s %s\n",result==0 ? "OK" : "ERR",status);
+	if(write(fd,reply,strlen(reply))<0)
+		warn("write reply");
+	close(fd);
+}
+
+/**
+ * 功能：工作线程，不断从队列中取出连接并处理
+ */
+static void* worker(void* arg)
+{
+	struct server* s=arg;
+	int fd;
+
+	for(;;) {
+		pthread_mutex_lock(&s->lock);
+		while(s->qlen==0)
+			pthread_cond_wait(&s->changed,&s->lock);
+		fd=s->queue[s->qhead];
+		s->qhead=(s->qhead+1)%QUEUE_LEN;
+		s->qlen--;
+		pthread_cond_broadcast(&s->changed);
+		pthread_mutex_unlock(&s->lock);
+
+		serve(s,fd);
+	};
+
+	return NULL;
+}
+
+/**
+ * 功能：连接到Unix套接字
+ * 返回：
+ *   - 套接字描述符，失败时返回-1
+ */
+static int connectto(const char* path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(strlen(path)>=sizeof(addr.sun_path)) { errno=ENAMETOOLONG; return -1; };
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	strcpy(addr.sun_path,path);
+	if((fd=socket(AF_UNIX,SOCK_STREAM,0))<0) return -1;
+	if(connect(fd,(struct sockaddr*)&addr,sizeof(addr))) {
+		close(fd);
+		return -1;
+	};
+	return fd;
+}
+
+/**
+ * 功能：客户端模式，向服务发送一个请求并等待应答
+ * 参数：
+ *   - sock: 套接字路径
+ *   - argv: 旧文件、新文件、补丁文件路径
+ * 返回：
+ *   - 0: 成功
+ *   - 1: 失败
+ */
+static int client(const char* sock,char* argv[])
+{
+	char path[3][PATH_MAX];
+	char req[MAX_REQUEST+1];
+	char reply[128];
+	const char* dir;
+	char* slash;
+	ssize_t n;
+	size_t len=0;
+	int fd,i;
+
+	// 服务进程的工作目录与客户端不同，因此发送绝对路径；补丁文件可能还不存在，只解析其所在目录
+	for(i=0;i<2;i++)
+		if(realpath(argv[i],path[i])==NULL) err(1,"%s",argv[i]);
+	if((slash=strrchr(argv[2],'/'))!=NULL) {
+		*slash=0;
+		dir=(slash==argv[2]) ? "/" : argv[2];
+	} else {
+		dir=".";
+	};
+	if(realpath(dir,path[2])==NULL) err(1,"%s",dir);
+	if(strlen(path[2])+strlen(slash ? slash+1 : argv[2])+2>sizeof(path[2]))
+		errx(1,"%s: path too long",argv[2]);
+	if(strcmp(path[2],"/")!=0) strcat(path[2],"/");
+	strcat(path[2],slash ? slash+1 : argv[2]);
+
+	snprintf(req,sizeof(req),"DIFF\t%s\t%s\t%s\n",path[0],path[1],path[2]);
+	if((fd=connectto(sock))<0) err(1,"%s",sock);
+	if(write(fd,req,strlen(req))!=(ssize_t)strlen(req)) err(1,"%s",sock);
+	while((len<sizeof(reply)-1)&&((n=read(fd,reply+len,sizeof(reply)-1-len))>0))
+		len+=n;
+	reply[len]=0;
+	close(fd);
+
+	if(strncmp(reply,"OK ",3)==0) return 0;
+	if((slash=strchr(reply,'\n'))!=NULL) *slash=0;
+	warnx("%s",len ? reply : "no reply");
+	return 1;
+}
+
+/**
+ * 功能：程序主入口
+ * 参数：
+ *   - argc: 命令行参数数量
+ *   - argv: 命令行参数数组
+ * 返回：
+ *   - 0: 成功（服务模式不会返回）
+ *   其他值: 失败
+ */
+int main(int argc,char *argv[])
+{
+	struct server s;
+	struct sockaddr_un addr;
+	pthread_t thread;
+	const char* prog=argv[0];
+	const char* remote=NULL;
+	int workers=DEFAULT_WORKERS;
+	long cachemb=DEFAULT_CACHE_MB;
+	int ch,fd,lfd,i;
+
+	memset(&s,0,sizeof(s));
+
+	// 解析命令行选项
+	//   -w: 工作线程数
+	//   -m: 缓存上限（MB）
+	//   -p/-c/-s/-f: 与bsdiff相同
+	//   -r: 客户端模式，向指定套接字上的服务发送请求
+	while((ch=getopt(argc,argv,"w:m:pcsf:r:"))!=-1) {
+		switch(ch) {
+		case 'w':
+			if((workers=atoi(optarg))<1) errx(1,"invalid worker count: %s",optarg);
+			break;
+		case 'm':
+			if((cachemb=atol(optarg))<0) errx(1,"invalid cache size: %s",optarg);
+			break;
+		case 'p': s.options.flags|=BSDIFF_FLAG_PREPASS; break;
+		case 'c': s.options.flags|=BSDIFF_FLAG_CONTINUE; break;
+		case 's': s.options.flags|=BSDIFF_FLAG_SEARCHTABLE; break;
+		case 'f':
+			if(strcmp(optarg,"43")==0) s.options.format=BSDIFF_FORMAT_43;
+			else if(strcmp(optarg,"44")==0) s.options.format=BSDIFF_FORMAT_44;
+			else errx(1,"unknown patch format: %s",optarg);
+			break;
+		case 'r': remote=optarg; break;
+		default: errx(1,USAGE,argv[0],argv[0]);
+		}
+	}
+	argc-=optind;
+	argv+=optind;
+
+	if(remote!=NULL) {
+		if(argc!=3) errx(1,USAGE,prog,prog);
+		return client(remote,argv);
+	};
+	if(argc!=1) errx(1,USAGE,prog,prog);
+
+	s.cap=(size_t)cachemb<<20;
+	pthread_mutex_init(&s.lock,NULL);
+	pthread_cond_init(&s.changed,NULL);
+
+	// 客户端提前断开时不应终止服务
+	signal(SIGPIPE,SIG_IGN);
+
+	// 监听套接字（残留的套接字文件会被替换）
+	if(strlen(argv[0])>=sizeof(addr.sun_path)) errx(1,"%s: path too long",argv[0]);
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	strcpy(addr.sun_path,argv[0]);
+	// 只有属主能连接；bind与chmod之间连入的其他用户由serve按对端身份拒绝
+	unlink(argv[0]);
+	if(((lfd=socket(AF_UNIX,SOCK_STREAM,0))<0) ||
+		bind(lfd,(struct sockaddr*)&addr,sizeof(addr)) ||
+		chmod(argv[0],S_IRUSR|S_IWUSR) ||
+		listen(lfd,QUEUE_LEN)) err(1,"%s",argv[0]);
+
+	for(i=0;i<workers;i++)
+		if((errno=pthread_create(&thread,NULL,worker,&s))!=0) err(1,"pthread_create");
+
+	// 主线程只负责接受连接并放入队列，队列满时等待
+	for(;;) {
+		if((fd=accept(lfd,NULL,NULL))<0) {
+			if(errno!=EINTR) warn("accept");
+			continue;
+		};
+		pthread_mutex_lock(&s.lock);
+		while(s.qlen==QUEUE_LEN)
+			pthread_cond_wait(&s.changed,&s.lock);
+		s.queue[(s.qhead+s.qlen)%QUEUE_LEN]=fd;
+		s.qlen++;
+		pthread_cond_broadcast(&s.changed);
+		pthread_mutex_unlock(&s.lock);
+	};
+
+	return 0;
+}
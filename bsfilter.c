@@ -0,0 +1,132 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 可执行文件预处理过滤器（与xz等压缩工具的BCJ过滤器类似）
+ *
+ * 插入一行代码后，后面的代码整体移动，所有跨过插入点的相对调用的位移都会改变，
+ * 在差分中表现为大量零散的diff字节或者断开的匹配。把位移换成"位移+指令位置"的
+ * 绝对地址后，调用同一个函数的指令无论位于哪里都相同。
+ *
+ * 变换必须能够精确还原，而是否变换只能根据变换后仍然不变的信息来判断：
+ *   - x86：E8/E9之后的32位位移，最高字节为0x00或0xFF（即位移在±16MB之内）时才变换。
+ *     变换在低25位上按模2^25进行，再把第25位符号扩展到最高字节，结果的最高字节
+ *     仍然是0x00或0xFF。无论是否变换都跳过这5个字节，因此用来判断的字节只会被
+ *     同一位置的变换改动，逆变换时会在同一位置做出相同的判断。
+ *   - arm64：4字节对齐的BL指令，在26位立即数上按模2^26变换，操作码不变。
+ */
+
+#include "bsfilter.h"
+
+#include <string.h>
+
+/**
+ * 功能：x86 E8/E9变换
+ * 参数：
+ *   - buf/size: 数据
+ *   - encode: 1为正向变换，0为逆变换
+ */
+static void x86(uint8_t* buf, int64_t size, int encode)
+{
+	int64_t i;
+	uint32_t v, pc;
+
+	for(i=0;i+5<=size;i++) {
+		if((buf[i]&0xFE)!=0xE8) continue;
+		// 不变换时也跳过这5个字节，之后的变换就不会改动这里用来判断的字节
+		if((buf[i+4]!=0x00)&&(buf[i+4]!=0xFF)) { i+=4; continue; };
+		v=buf[i+1]|(buf[i+2]<<8)|(buf[i+3]<<16)|((uint32_t)buf[i+4]<<24);
+		pc=(uint32_t)(i+5);
+		v=encode ? v+pc : v-pc;
+		// 取低25位并符号扩展
+		v&=0x01FFFFFF;
+		if(v&0x01000000) v|=0xFE000000;
+		buf[i+1]=(uint8_t)v;
+		buf[i+2]=(uint8_t)(v>>8);
+		buf[i+3]=(uint8_t)(v>>16);
+		buf[i+4]=(uint8_t)(v>>24);
+		i+=4;
+	};
+}
+
+/**
+ * 功能：arm64 BL变换
+ * 参数：同x86
+ */
+static void arm64(uint8_t* buf, int64_t size, int encode)
+{
+	int64_t i;
+	uint32_t v, pc;
+
+	for(i=0;i+4<=size;i+=4) {
+		if((buf[i+3]&0xFC)!=0x94) continue;
+		v=buf[i]|(buf[i+1]<<8)|(buf[i+2]<<16)|((uint32_t)(buf[i+3]&0x03)<<24);
+		pc=(uint32_t)(i>>2);
+		v=(encode ? v+pc : v-pc)&0x03FFFFFF;
+		buf[i]=(uint8_t)v;
+		buf[i+1]=(uint8_t)(v>>8);
+		buf[i+2]=(uint8_t)(v>>16);
+		buf[i+3]=(uint8_t)(0x94|(v>>24));
+	};
+}
+
+void bsfilter_encode(uint8_t* buf, int64_t size, int filter)
+{
+	if(filter==BSFILTER_X86) x86(buf,size,1);
+	else if(filter==BSFILTER_ARM64) arm64(buf,size,1);
+}
+
+void bsfilter_decode(uint8_t* buf, int64_t size, int filter)
+{
+	if(filter==BSFILTER_X86) x86(buf,size,0);
+	else if(filter==BSFILTER_ARM64) arm64(buf,size,0);
+}
+
+int bsfilter_detect(const uint8_t* buf, int64_t size)
+{
+	unsigned machine;
+	uint32_t pe;
+
+	// ELF：e_machine位于偏移18（只处理小端序）
+	if((size>=20)&&(memcmp(buf,"\177ELF",4)==0)&&(buf[5]==1)) {
+		machine=buf[18]|(buf[19]<<8);
+		if((machine==3)||(machine==62)) return BSFILTER_X86;   // EM_386, EM_X86_64
+		if(machine==183) return BSFILTER_ARM64;                 // EM_AARCH64
+		return BSFILTER_NONE;
+	};
+
+	// PE：偏移0x3C处是PE文件头的位置，"PE\0\0"之后是Machine
+	if((size>=0x40)&&(buf[0]=='M')&&(buf[1]=='Z')) {
+		pe=buf[0x3C]|(buf[0x3D]<<8)|(buf[0x3E]<<16)|((uint32_t)buf[0x3F]<<24);
+		if((pe>size-6)||(memcmp(buf+pe,"PE\0\0",4)!=0)) return BSFILTER_NONE;
+		machine=buf[pe+4]|(buf[pe+5]<<8);
+		if((machine==0x14C)||(machine==0x8664)) return BSFILTER_X86;
+		if(machine==0xAA64) return BSFILTER_ARM64;
+	};
+
+	return BSFILTER_NONE;
+}
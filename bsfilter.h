@@ -0,0 +1,67 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSFILTER_H
+# define BSFILTER_H
+
+# include <stdint.h>
+
+// 可执行文件预处理过滤器：把相对跳转的位移换成绝对地址，使代码移动后大量调用指令保持不变
+# define BSFILTER_NONE 0
+// x86/x86-64：E8（call rel32）和E9（jmp rel32）
+# define BSFILTER_X86 1
+// arm64：BL imm26
+# define BSFILTER_ARM64 2
+
+/**
+ * 功能：正向变换（生成补丁前作用于旧文件和新文件，应用补丁前作用于旧文件）
+ * 参数：
+ *   - buf: 数据（原地变换）
+ *   - size: 数据大小
+ *   - filter: BSFILTER_*
+ *
+ * 变换只依赖于字节在buf中的位置，因此buf必须是整个文件，不能分段调用
+ */
+void bsfilter_encode(uint8_t* buf, int64_t size, int filter);
+
+/**
+ * 功能：逆变换，bsfilter_decode(bsfilter_encode(buf))与原数据完全相同
+ * 参数：同bsfilter_encode
+ */
+void bsfilter_decode(uint8_t* buf, int64_t size, int filter);
+
+/**
+ * 功能：根据ELF或PE文件头判断适用的过滤器
+ * 参数：
+ *   - buf: 文件内容
+ *   - size: 文件大小
+ * 返回：
+ *   - BSFILTER_*，不是可识别的x86或arm64可执行文件时返回BSFILTER_NONE
+ */
+int bsfilter_detect(const uint8_t* buf, int64_t size);
+
+#endif
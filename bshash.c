@@ -0,0 +1,287 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bshash.h"
+
+#include <string.h>
+
+// BLAKE3的压缩标志位
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+
+// 初始向量（与SHA-256相同）
+static const uint32_t IV[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+// 每轮之间消息字的置换
+static const uint8_t PERMUTATION[16] = { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+
+// 32位循环右移
+#define ROTR(x,n) (((x)>>(n))|((x)<<(32-(n))))
+
+/**
+ * 功能：BLAKE3的G混合函数
+ */
+static void g(uint32_t *s,int a,int b,int c,int d,uint32_t mx,uint32_t my)
+{
+	s[a]=s[a]+s[b]+mx; s[d]=ROTR(s[d]^s[a],16);
+	s[c]=s[c]+s[d];    s[b]=ROTR(s[b]^s[c],12);
+	s[a]=s[a]+s[b]+my; s[d]=ROTR(s[d]^s[a],8);
+	s[c]=s[c]+s[d];    s[b]=ROTR(s[b]^s[c],7);
+}
+
+/**
+ * 功能：BLAKE3压缩函数
+ * 参数：
+ *   - cv: 输入链接值
+ *   - block: 64字节分组
+ *   - counter: 块序号（父节点为0）
+ *   - blocklen: 分组中的有效字节数
+ *   - flags: 压缩标志位
+ *   - out: 输出的16个字（前8个为新的链接值）
+ */
+static void compress(const uint32_t cv[8],const uint8_t block[64],uint64_t counter,
+		uint32_t blocklen,uint32_t flags,uint32_t out[16])
+{
+	uint32_t m[16],t[16],s[16];
+	int i,r;
+
+	for(i=0;i<16;i++)
+		m[i]=(uint32_t)block[4*i]|((uint32_t)block[4*i+1]<<8)|
+			((uint32_t)block[4*i+2]<<16)|((uint32_t)block[4*i+3]<<24);
+
+	for(i=0;i<8;i++) s[i]=cv[i];
+	for(i=0;i<4;i++) s[8+i]=IV[i];
+	s[12]=(uint32_t)counter;
+	s[13]=(uint32_t)(counter>>32);
+	s[14]=blocklen;
+	s[15]=flags;
+
+	for(r=0;r<7;r++) {
+		g(s,0,4,8,12,m[0],m[1]);
+		g(s,1,5,9,13,m[2],m[3]);
+		g(s,2,6,10,14,m[4],m[5]);
+		g(s,3,7,11,15,m[6],m[7]);
+		g(s,0,5,10,15,m[8],m[9]);
+		g(s,1,6,11,12,m[10],m[11]);
+		g(s,2,7,8,13,m[12],m[13]);
+		g(s,3,4,9,14,m[14],m[15]);
+		for(i=0;i<16;i++) t[i]=m[PERMUTATION[i]];
+		memcpy(m,t,sizeof(m));
+	};
+
+	for(i=0;i<8;i++) {
+		out[i]=s[i]^s[i+8];
+		out[i+8]=s[i+8]^cv[i];
+	};
+}
+
+/**
+ * 功能：把两个子树的链接值合并为父节点的64字节分组
+ */
+static void parentblock(const uint32_t left[8],const uint32_t right[8],uint8_t block[64])
+{
+	int i;
+
+	for(i=0;i<16;i++) {
+		uint32_t w = (i<8) ? left[i] : right[i-8];
+		block[4*i]=(uint8_t)w;
+		block[4*i+1]=(uint8_t)(w>>8);
+		block[4*i+2]=(uint8_t)(w>>16);
+		block[4*i+3]=(uint8_t)(w>>24);
+	};
+}
+
+/**
+ * 功能：计算父节点的链接值
+ */
+static void parentcv(const uint32_t left[8],const uint32_t right[8],uint32_t cv[8])
+{
+	uint8_t block[64];
+	uint32_t out[16];
+
+	parentblock(left,right,block);
+	compress(IV,block,0,64,PARENT,out);
+	memcpy(cv,out,8*sizeof(uint32_t));
+}
+
+/**
+ * 功能：当前块的压缩标志位（第一个分组需要CHUNK_START）
+ */
+static uint32_t startflag(const struct bshash* h)
+{
+	return h->blocks==0 ? CHUNK_START : 0;
+}
+
+void bshash_init(struct bshash* h)
+{
+	memcpy(h->cv,IV,sizeof(h->cv));
+	h->chunk=0;
+	h->blocklen=0;
+	h->blocks=0;
+	h->stacklen=0;
+	memset(h->block,0,sizeof(h->block));
+}
+
+/**
+ * 功能：把一棵子树的链接值压入子树栈，并与栈顶相同大小的子树逐层合并
+ * 参数：
+ *   - h: 哈希状态（h->chunk为压入前的块数，必须是chunks的整数倍）
+ *   - cv: 子树的链接值
+ *   - chunks: 子树的块数（2的幂）
+ */
+static void pushcv(struct bshash* h,const uint32_t cv[8],uint64_t chunks)
+{
+	uint32_t c[8];
+	uint64_t total;
+
+	memcpy(c,cv,sizeof(c));
+	// 块总数（以子树大小为单位）的二进制末尾有几个0，就有几对相同大小的子树需要合并
+	h->chunk+=chunks;
+	for(total=h->chunk/chunks;(total&1)==0;total>>=1)
+		parentcv(h->stack[--h->stacklen],c,c);
+	memcpy(h->stack[h->stacklen++],c,sizeof(c));
+}
+
+/**
+ * 功能：结束已满的当前块（1024字节），合并到子树栈中并开始下一个块
+ */
+static void endchunk(struct bshash* h)
+{
+	uint32_t out[16];
+
+	compress(h->cv,h->block,h->chunk,h->blocklen,startflag(h)|CHUNK_END,out);
+	pushcv(h,out,1);
+
+	memcpy(h->cv,IV,sizeof(h->cv));
+	h->blocklen=0;
+	h->blocks=0;
+	memset(h->block,0,sizeof(h->block));
+}
+
+void bshash_update(struct bshash* h, const void* data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t out[16];
+	size_t take;
+
+	while(len>0) {
+		// 当前块已满（1024字节）且还有后续数据：结束该块并合并到子树栈中
+		if(h->blocks*64+h->blocklen==BSHASH_CHUNK_LEN)
+			endchunk(h);
+
+		// 当前分组已满且还有后续数据：压缩该分组（最后一个分组要留到结束时处理）
+		if(h->blocklen==64) {
+			compress(h->cv,h->block,h->chunk,64,startflag(h),out);
+			memcpy(h->cv,out,sizeof(h->cv));
+			h->blocks++;
+			h->blocklen=0;
+			memset(h->block,0,sizeof(h->block));
+		}
+
+		take=64-h->blocklen;
+		if(take>len) take=len;
+		memcpy(h->block+h->blocklen,p,take);
+		h->blocklen+=(uint8_t)take;
+		p+=take;
+		len-=take;
+	};
+}
+
+void bshash_final(const struct bshash* h, uint8_t out[BSHASH_LEN])
+{
+	uint32_t cv[8],words[16],flags;
+	uint8_t block[64];
+	int i,n;
+
+	// 从当前块的最后一个分组开始，自底向上与子树栈中的链接值逐层合并
+	memcpy(cv,h->cv,sizeof(cv));
+	memcpy(block,h->block,sizeof(block));
+	flags=startflag(h)|CHUNK_END;
+	for(i=0,n=h->stacklen;;) {
+		if(n==0) {
+			// 根节点
+			compress(cv,block,i ? 0 : h->chunk,i ? 64 : h->blocklen,flags|ROOT,words);
+			break;
+		}
+		compress(cv,block,i ? 0 : h->chunk,i ? 64 : h->blocklen,flags,words);
+		parentblock(h->stack[--n],words,block);
+		memcpy(cv,IV,sizeof(cv));
+		flags=PARENT;
+		i++;
+	};
+
+	for(i=0;i<8;i++) {
+		out[4*i]=(uint8_t)words[i];
+		out[4*i+1]=(uint8_t)(words[i]>>8);
+		out[4*i+2]=(uint8_t)(words[i]>>16);
+		out[4*i+3]=(uint8_t)(words[i]>>24);
+	};
+}
+
+void bshash_buffer(const void* data, size_t len, uint8_t out[BSHASH_LEN])
+{
+	struct bshash h;
+
+	bshash_init(&h);
+	bshash_update(&h,data,len);
+	bshash_final(&h,out);
+}
+
+void bshash_subtree(const void* data, uint64_t chunk, uint64_t chunks, uint32_t cv[8])
+{
+	const uint8_t *p = data;
+	uint32_t stack[54][8],out[16],c[8];
+	uint64_t i,total;
+	int j,n=0;
+
+	for(i=0;i<chunks;i++,p+=BSHASH_CHUNK_LEN) {
+		// 完整的块：16个分组依次压缩，最后一个分组带CHUNK_END
+		memcpy(c,IV,sizeof(c));
+		for(j=0;j<16;j++) {
+			compress(c,p+64*j,chunk+i,64,(j==0 ? CHUNK_START : 0)|(j==15 ? CHUNK_END : 0),out);
+			memcpy(c,out,sizeof(c));
+		};
+		for(total=i+1;(total&1)==0;total>>=1)
+			parentcv(stack[--n],c,c);
+		memcpy(stack[n++],c,sizeof(c));
+	};
+	// 块数是2的幂，最后栈中只剩子树的根
+	memcpy(cv,stack[0],sizeof(stack[0]));
+}
+
+void bshash_append(struct bshash* h, const uint32_t cv[8], uint64_t chunks)
+{
+	// 上一次追加的数据恰好填满一个块时，该块还没有结束
+	if(h->blocks*64+h->blocklen==BSHASH_CHUNK_LEN)
+		endchunk(h);
+	pushcv(h,cv,chunks);
+}
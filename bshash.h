@@ -0,0 +1,108 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSHASH_H
+# define BSHASH_H
+
+# include <stddef.h>
+# include <stdint.h>
+
+// 摘要长度（字节数）
+# define BSHASH_LEN 32
+// 块长度（字节数）
+# define BSHASH_CHUNK_LEN 1024
+
+/**
+ * 功能：增量哈希状态（BLAKE3算法，256位输出）
+ * 用于补丁缓存、断点续传日志等需要强哈希的地方
+ */
+struct bshash
+{
+	uint32_t cv[8];             // 当前块的链接值
+	uint64_t chunk;             // 当前块的序号
+	uint8_t block[64];          // 当前块中尚未压缩的分组
+	uint8_t blocklen;           // block中的有效字节数
+	uint8_t blocks;             // 当前块中已经压缩的分组数
+	uint32_t stack[54][8];      // 已完成子树的链接值
+	uint8_t stacklen;           // stack中的子树数
+};
+
+/**
+ * 功能：初始化哈希状态
+ * 参数：
+ *   - h: 哈希状态
+ */
+void bshash_init(struct bshash* h);
+
+/**
+ * 功能：向哈希状态追加数据
+ * 参数：
+ *   - h: 哈希状态
+ *   - data: 数据
+ *   - len: 数据长度（字节数）
+ */
+void bshash_update(struct bshash* h, const void* data, size_t len);
+
+/**
+ * 功能：计算摘要（不改变哈希状态，可以继续追加数据）
+ * 参数：
+ *   - h: 哈希状态
+ *   - out: 输出的摘要（BSHASH_LEN字节）
+ */
+void bshash_final(const struct bshash* h, uint8_t out[BSHASH_LEN]);
+
+/**
+ * 功能：一次性计算一段数据的摘要
+ * 参数：
+ *   - data: 数据
+ *   - len: 数据长度（字节数）
+ *   - out: 输出的摘要（BSHASH_LEN字节）
+ */
+void bshash_buffer(const void* data, size_t len, uint8_t out[BSHASH_LEN]);
+
+/**
+ * 功能：计算一棵完整子树的链接值，用于把一段数据分给多个线程并行计算摘要
+ * 参数：
+ *   - data: 子树的数据（chunks*BSHASH_CHUNK_LEN字节）
+ *   - chunk: 子树第一个块在整个输入中的序号（必须是chunks的整数倍）
+ *   - chunks: 子树的块数（2的幂）
+ *   - cv: 输出的链接值
+ */
+void bshash_subtree(const void* data, uint64_t chunk, uint64_t chunks, uint32_t cv[8]);
+
+/**
+ * 功能：把bshash_subtree计算的子树追加到哈希状态中，效果与用bshash_update追加这段数据相同
+ * 参数：
+ *   - h: 哈希状态（已追加的数据长度必须是子树长度的整数倍）
+ *   - cv: 子树的链接值
+ *   - chunks: 子树的块数
+ *
+ * 注意：子树不能是整个输入的结尾，之后至少还要用bshash_update追加1个字节
+ */
+void bshash_append(struct bshash* h, const uint32_t cv[8], uint64_t chunks);
+
+#endif
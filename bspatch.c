@@ -26,35 +26,38 @@
  */
 
 #include <limits.h>
+#include <stddef.h>
 #include "bspatch.h"
+#include "bscodec.h"
 
 /**
- * 功能：将大端序的8字节数据转换为有符号64位整数（补丁文件使用此格式）
+ * 功能：从补丁数据流中读取并解码一个BSDIFF44控制块
  * 参数：
- *   - buf: 指向8字节缓冲区的指针，使用大端序（网络字节序）存储
- * 返回：转换后的有符号64位整数
- * 
- * 原理：大端序是最高字节在前，小端序是最低字节在前
- *       这里将8个大端序字节组合成一个64位整数，并处理符号位
+ *   - stream: 补丁数据流
+ *   - ctrl: 输出的控制记录数组（至少BSDIFF44_BLOCK_RECORDS项）
+ *   - count: 输出参数，块中的记录数
+ *   - fields: 每条记录的控制值个数
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 读取失败或数据损坏
  */
-static int64_t offtin(uint8_t *buf)
+static int readblock(struct bspatch_stream* stream,int64_t (*ctrl)[4],int *count,int fields)
 {
-	int64_t y;  // 用于存储最终结果的64位有符号整数
-    
-	// 从高位到低位逐字节组合
-	y=buf[7]&0x7F;           // 取第8个字节（最高字节）的低7位，清空符号位
-    y=y*256;y+=buf[6];       // 左移1字节（乘以256），加上第7个字节
-	y=y*256;y+=buf[5];       // 继续左移并加上第6个字节
-	y=y*256;y+=buf[4];       // 继续左移并加上第5个字节
-	y=y*256;y+=buf[3];       // 继续左移并加上第4个字节
-	y=y*256;y+=buf[2];       // 继续左移并加上第3个字节
-	y=y*256;y+=buf[1];       // 继续左移并加上第2个字节
-	y=y*256;y+=buf[0];       // 继续左移并加上第1个字节（最低字节）
-
-	// 判断符号位（第8个字节的最高位）
-	if(buf[7]&0x80) y=-y;    // 如果符号位为1，表示负数，需要取反
-
-	return y;
+	uint8_t buf[BSDIFF44_BLOCK_BYTES(4)];  // 控制数据缓冲区
+	int len;                            // 控制数据字节数
+
+	/* 读取块头：记录数和控制数据字节数（各2字节小端序）*/
+	if (stream->read(stream, buf, 4))
+		return -1;
+	*count=buf[0]|(buf[1]<<8);
+	len=buf[2]|(buf[3]<<8);
+	if((*count<1)||(*count>BSDIFF44_BLOCK_RECORDS)||(len>BSDIFF44_BLOCK_BYTES(fields)))
+		return -1;
+
+	/* 读取整块控制数据并批量解码 */
+	if (stream->read(stream, buf, len))
+		return -1;
+	return bscodec_decodeblock(buf,len,ctrl,*count,fields);
 }
 
 /**
@@ -76,27 +79,80 @@ static int64_t offtin(uint8_t *buf)
  *   ctrl[2] - 旧文件偏移：旧文件中需要跳过的字节数
  */
 int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize, struct bspatch_stream* stream)
+{
+	return bspatch_ex(old, oldsize, new, newsize, stream, NULL);
+}
+
+/**
+ * 功能：带可选参数的bspatch
+ * 参数：
+ *   - old/oldsize/new/newsize/stream: 同bspatch
+ *   - options: 可选参数，NULL表示使用默认值
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败（读取错误、数据损坏或格式不支持）
+ */
+int bspatch_ex(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
+		struct bspatch_stream* stream, const struct bspatch_options* options)
 {
 	uint8_t buf[8];          // 临时缓冲区，用于读取8字节的控制数据
 	int64_t oldpos,newpos;   // 旧文件和新文件的当前位置指针
 	int64_t ctrl[3];         // 控制数据数组：ctrl[0]=diff长度, ctrl[1]=extra长度, ctrl[2]=旧文件偏移
+	int64_t block[BSDIFF44_BLOCK_RECORDS][4];  // BSDIFF44：当前控制块中已解码的记录
+	int nblock,iblock;       // BSDIFF44：当前控制块的记录数、下一条要使用的记录
+	int format;              // 补丁格式
+	int nrefs;               // 多基准：旧文件个数（0表示普通补丁）
+	int64_t ref;             // 多基准：当前记录引用的旧文件序号
 	int64_t i;               // 循环计数器
 
-	// 初始化：从文件开头开始
-	oldpos=0;  // 旧文件的当前位置，从0开始
-	newpos=0;  // 新文件的当前位置，从0开始
+	format = options ? options->format : BSDIFF_FORMAT_43;
+	if (format != BSDIFF_FORMAT_43 && format != BSDIFF_FORMAT_44)
+		return -1;
+	nrefs = options ? options->nrefs : 0;
+	if (nrefs < 0 || (nrefs > 0 && (format != BSDIFF_FORMAT_44 || options->refpos == NULL)))
+		return -1;
+	ref=0;
+	nblock=0;
+	iblock=0;
+
+	// 初始化：从文件开头开始，或从检查点恢复
+	oldpos = options ? options->oldpos : 0;  // 旧文件的当前位置
+	newpos = options ? options->newpos : 0;  // 新文件的当前位置
+	if (newpos<0 || newpos>newsize)
+		return -1;
 	
 	// 主循环：直到新文件的所有字节都被写入
 	while(newpos<newsize) {
 		
 		/* 读取控制数据 */
 		// 每次操作需要3个控制值（diff长度、extra长度、旧文件偏移）
-		for(i=0;i<=2;i++) {
+		if (format == BSDIFF_FORMAT_44) {
+			// 当前控制块用完后，读取并批量解码下一个控制块
+			if (iblock == nblock) {
+				if (readblock(stream, block, &nblock, nrefs ? 4 : 3))
+					return -1;  // 读取失败或数据损坏，返回错误
+				iblock=0;
+			}
+			ctrl[0]=block[iblock][0];
+			ctrl[1]=block[iblock][1];
+			if (nrefs) {
+				// 多基准：切换到本记录引用的旧文件，旧文件偏移在diff之前作用于它的当前位置
+				ref=block[iblock][2];
+				if (ref >= nrefs)
+					return -1;
+				old=options->refs[ref];
+				oldsize=options->refsizes[ref];
+				oldpos=options->refpos[ref]+block[iblock][3];
+				ctrl[2]=0;
+			} else
+				ctrl[2]=block[iblock][2];
+			iblock++;
+		} else for(i=0;i<=2;i++) {
 			// 从补丁数据流中读取8字节的控制数据
 			if (stream->read(stream, buf, 8))
 				return -1;  // 读取失败，返回错误
 			// 将8字节的大端序数据转换为64位整数
-			ctrl[i]=offtin(buf);
+			ctrl[i]=bscodec_offtin(buf);
 		};
 
 		/* 安全检查：验证控制数据的有效性 */
@@ -119,12 +175,17 @@ int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
 			if((oldpos+i>=0) && (oldpos+i<oldsize))
 				// 将旧文件数据加到diff数据上
 				new[newpos+i]+=old[oldpos+i];
+		if (options && options->copied && ctrl[0] > 0 &&
+			options->copied(options, newpos, oldpos, ctrl[0], (int)ref))
+			return -1;
 
 		/* 调整新文件和旧文件的指针位置 */
 		// 新文件位置向前移动diff长度
 		newpos+=ctrl[0];
 		// 旧文件位置向前移动diff长度
 		oldpos+=ctrl[0];
+		if (nrefs)
+			options->refpos[ref]=oldpos;
 
 		/* 再次安全检查：验证extra数据的有效性 */
 		// 检查：当前新文件位置加上extra长度不能超出新文件大小
@@ -141,6 +202,12 @@ int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
 		newpos+=ctrl[1];
 		// 旧文件位置向前移动ctrl[2]长度（跳过旧文件中的某些数据）
 		oldpos+=ctrl[2];
+
+		/* 检查点：BSDIFF43每条记录之后，BSDIFF44每个控制块之后 */
+		if (options && options->checkpoint &&
+			(format == BSDIFF_FORMAT_43 || iblock == nblock) &&
+			options->checkpoint(options, new, oldpos, newpos))
+			return -1;
 	};
 
 	return 0;  // 成功完成补丁应用
@@ -158,6 +225,135 @@ int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
 #include <sys/stat.h>   // 系统库：文件状态
 #include <unistd.h>     // 系统库：POSIX操作系统API
 #include <fcntl.h>      // 系统库：文件控制
+#include <errno.h>      // 标准库：错误码
+#include <pthread.h>    // 系统库：线程（并行计算旧文件摘要）
+#if defined(__linux__)
+# include <sys/ioctl.h> // 系统库：FICLONE/FICLONERANGE
+# include <sys/syscall.h>
+# include <linux/fs.h>
+#endif
+#include "bsfilter.h"   // 可执行文件预处理过滤器
+#include "bshash.h"     // 强哈希（用于断点续传日志和补丁文件头中的摘要）
+#include "bszstd.h"     // zstd差分引擎
+
+// 命令行用法
+#define USAGE "usage: %s [-j|-u] [-m oldfile]... oldfile newfile patchfile\n"
+
+// 断点续传：每生成这么多字节的新文件数据写一次检查点
+#define CHECKPOINT_INTERVAL ((int64_t)64 * 1024 * 1024)
+// 断点续传日志的魔数、文件头长度、每个条目的长度
+#define JOURNAL_MAGIC "BSPATCH/JOURNAL1"
+#define JOURNAL_HEADER_LEN (16 + BSHASH_LEN)
+#define JOURNAL_ENTRY_LEN (8 * 3 + BSHASH_LEN + 8)
+// 更新模式：比较和写入的块大小（与常见文件系统的块大小相同，也是FICLONERANGE的对齐单位）
+#define UPDATE_BLOCK 4096
+// 并行计算摘要时每个线程一次处理的子树大小（1MB，即1024个块），以及最多使用的线程数
+#define HASH_SUBTREE ((int64_t)1024 * BSHASH_CHUNK_LEN)
+#define HASH_MAX_THREADS 64
+
+/**
+ * 功能：BZip2补丁数据流的状态
+ */
+struct patchfile
+{
+	FILE* f;           // 补丁文件（位于文件头之后）
+	BZFILE* bz2;       // BZip2文件句柄
+	int64_t consumed;  // 已经读出的解压后字节数（即控制流中的位置）
+};
+
+/**
+ * 功能：断点续传的状态
+ * 日志文件由文件头（魔数+补丁标识）和若干个定长条目组成，每个条目记录一个检查点：
+ * 旧文件位置、新文件位置、控制流位置、本段新文件数据的摘要，以及用于识别
+ * 写了一半的条目的校验值
+ */
+struct journal
+{
+	int fd;                  // 输出文件描述符
+	int jfd;                 // 日志文件描述符
+	int64_t written;         // new[0, written)已经写入输出文件并落盘
+	int64_t newsize;         // 新文件大小
+	struct patchfile* pf;    // 补丁数据流状态（提供控制流位置）
+};
+
+/**
+ * 功能：更新模式下一条控制记录的diff部分（由复制回调记录）
+ */
+struct segment
+{
+	int64_t newpos;          // 新文件中的位置
+	int64_t oldpos;          // 对应的旧文件位置
+	int64_t length;          // 长度
+};
+
+/**
+ * 功能：更新模式的状态
+ * 输出文件是旧文件的副本（或者就是旧文件本身），只有内容改变的块才需要写入
+ */
+struct update
+{
+	struct segment* segs;    // 0号旧文件的diff部分，按新文件位置排列
+	int64_t nsegs, cap;
+	int oldfd;               // 旧文件（移动过的相同数据从这里克隆或复制）
+	int fd;                  // 输出文件
+	int clone;               // 是否可以从旧文件克隆或复制（输出文件就是旧文件时不可以）
+	int verify;              // 输出文件是事先存在的另一个文件，跳过和克隆的块都要读回比较
+};
+
+/**
+ * 功能：并行计算摘要时一个线程的任务
+ * 第i个子树由第i%threads个线程计算，链接值存入cvs[i]
+ */
+struct hashjob
+{
+	const uint8_t* data;     // 数据
+	int64_t nsubtrees;       // 完整子树的个数
+	uint32_t (*cvs)[8];      // 各子树的链接值
+	int id, threads;         // 线程序号和线程总数
+};
+
+/**
+ * 功能：新文件摘要的增量计算状态
+ * 检查点回调中把刚生成的一段新文件数据计入摘要，此时数据还在缓存中，不需要最后再读一遍。
+ * 这两个回调包装了断点续传或更新模式原有的回调，后者仍然通过opaque取得自己的状态
+ */
+struct digest
+{
+	struct bshash h;         // 哈希状态
+	int64_t hashed;          // new[0, hashed)已经计入摘要
+	void* opaque;            // 被包装的回调使用的opaque
+	int (*checkpoint)(const struct bspatch_options*, const uint8_t*, int64_t, int64_t);
+	int (*copied)(const struct bspatch_options*, int64_t, int64_t, int64_t, int);
+};
+
+/**
+ * 功能：当前BZip2流结束后，用它多读入的字节打开下一个流
+ * 参数：
+ *   - pf: 补丁数据流状态
+ * 返回：
+ *   - 0: 成功（文件已经结束时pf->bz2置为NULL）
+ *   - -1: 失败
+ *
+ * 补丁数据可以由多个首尾相接的BZip2流组成（bstranscode -j多线程压缩时生成）
+ */
+static int nextstream(struct patchfile* pf)
+{
+	char unused[BZ_MAX_UNUSED];  // 上一个流多读入的字节
+	void* tail;
+	int ntail, bz2err;
+
+	BZ2_bzReadGetUnused(&bz2err, pf->bz2, &tail, &ntail);
+	if (bz2err != BZ_OK)
+		return -1;
+	memcpy(unused, tail, ntail);
+	BZ2_bzReadClose(&bz2err, pf->bz2);
+	pf->bz2 = NULL;
+	if (ntail == 0 && (ntail = fread(unused, 1, sizeof(unused), pf->f)) == 0)
+		return ferror(pf->f) ? -1 : 0;
+	if ((pf->bz2 = BZ2_bzReadOpen(&bz2err, pf->f, 0, 0, unused, ntail)) == NULL)
+		return -1;
+	return 0;
+}
 
 /**
  * 功能：从BZip2压缩的补丁文件中读取数据
@@ -167,29 +363,572 @@ int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
  *   - length: 要读取的字节数
  * 返回：
  *   - 0: 成功读取指定长度的数据
- *   - -1: 读取失败（实际读取的字节数与请求的不一致）
+ *   - -1: 读取失败（数据损坏或不够）
  * 
  * 注意：这是一个回调函数，用于bspatch函数从BZip2压缩文件中读取数据
  */
 static int bz2_read(const struct bspatch_stream* stream, void* buffer, int length)
 {
-	int n;              // 实际读取的字节数
-	int bz2err;         // BZip2错误码
-	BZFILE* bz2;        // BZip2文件句柄指针
+	int n;                  // 实际读取的字节数
+	int bz2err;             // BZip2错误码
+	struct patchfile* pf;   // 补丁数据流状态
 
-	// 从stream的opaque字段获取BZip2文件句柄
-	bz2 = (BZFILE*)stream->opaque;
-	
-	// 从BZip2文件中读取指定长度的数据
-	n = BZ2_bzRead(&bz2err, bz2, buffer, length);
-	
-	// 检查是否成功读取了指定长度的数据
-	if (n != length)
-		return -1;  // 读取失败，返回错误
+	// 从stream的opaque字段获取补丁数据流状态
+	pf = (struct patchfile*)stream->opaque;
+
+	while (length > 0) {
+		// 最后一个流已经读完
+		if (pf->bz2 == NULL)
+			return -1;
+		// 从BZip2文件中读取数据，当前流结束时可能不足length字节
+		n = BZ2_bzRead(&bz2err, pf->bz2, buffer, length);
+		if (bz2err != BZ_OK && bz2err != BZ_STREAM_END)
+			return -1;  // 读取失败，返回错误
+		pf->consumed += n;
+		buffer = (uint8_t*)buffer + n;
+		length -= n;
+		if (bz2err == BZ_STREAM_END && nextstream(pf))
+			return -1;
+	}
 
 	return 0;  // 读取成功
 }
 
+/**
+ * 功能：直接从补丁文件中读取数据（zstd引擎的补丁数据不经过BZip2）
+ * 参数：同bz2_read，opaque指向补丁文件
+ * 返回：
+ *   - 0: 成功读取指定长度的数据
+ *   - -1: 读取失败
+ */
+static int file_read(const struct bspatch_stream* stream, void* buffer, int length)
+{
+	return (fread(buffer, 1, length, (FILE*)stream->opaque) == (size_t)length) ? 0 : -1;
+}
+
+/**
+ * 功能：应用zstd引擎生成的补丁（参数同bszstd_patch）
+ */
+static int zstd_patch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
+		struct bspatch_stream* stream)
+{
+#if defined(HAVE_ZSTD)
+	return bszstd_patch(old, oldsize, new, newsize, stream);
+#else
+	(void)old; (void)oldsize; (void)new; (void)newsize; (void)stream;
+	return -1;  // 不会到达：没有zstd支持时读取文件头后就已经退出
+#endif
+}
+
+/**
+ * 功能：编码一个日志条目
+ * 参数：
+ *   - buf: 输出缓冲区（JOURNAL_ENTRY_LEN字节）
+ *   - oldpos/newpos/consumed: 检查点的旧文件位置、新文件位置、控制流位置
+ *   - hash: 本段新文件数据的摘要
+ */
+static void journal_encode(uint8_t *buf, int64_t oldpos, int64_t newpos, int64_t consumed,
+		const uint8_t hash[BSHASH_LEN])
+{
+	uint8_t check[BSHASH_LEN];
+
+	bscodec_offtout(oldpos, buf);
+	bscodec_offtout(newpos, buf+8);
+	bscodec_offtout(consumed, buf+16);
+	memcpy(buf+24, hash, BSHASH_LEN);
+	bshash_buffer(buf, 24+BSHASH_LEN, check);
+	memcpy(buf+24+BSHASH_LEN, check, 8);
+}
+
+/**
+ * 功能：检查点回调，把已生成的新文件数据落盘并追加一个日志条目
+ * 参数：同bspatch_options.checkpoint
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 写入失败
+ * 
+ * 注意：先让输出数据落盘，再写日志条目并落盘，
+ *       因此日志中的每个检查点之前的数据都已经可靠地写入了输出文件
+ */
+static int journal_checkpoint(const struct bspatch_options* options, const uint8_t* new,
+		int64_t oldpos, int64_t newpos)
+{
+	struct journal* j = (struct journal*)options->opaque;
+	uint8_t entry[JOURNAL_ENTRY_LEN];
+	uint8_t hash[BSHASH_LEN];
+
+	// 距上一个检查点不足间隔且尚未完成时不写检查点
+	if (newpos - j->written < CHECKPOINT_INTERVAL && newpos < j->newsize)
+		return 0;
+
+	if (pwrite(j->fd, new + j->written, newpos - j->written, j->written) != newpos - j->written ||
+		fdatasync(j->fd))
+		return -1;
+
+	bshash_buffer(new + j->written, newpos - j->written, hash);
+	journal_encode(entry, oldpos, newpos, j->pf->consumed, hash);
+	if (write(j->jfd, entry, sizeof(entry)) != sizeof(entry) || fdatasync(j->jfd))
+		return -1;
+
+	j->written = newpos;
+	return 0;
+}
+
+/**
+ * 功能：把文件的身份（设备号、inode、大小、修改时间）加入补丁标识
+ * 参数：
+ *   - ident: 补丁标识的哈希状态
+ *   - st: 文件状态
+ * 
+ * 说明：文件被替换或改写后这些值通常会变化，此时日志不再属于当前的输入，需要重新开始
+ */
+static void identfile(struct bshash* ident, const struct stat* st)
+{
+	uint8_t buf[40];
+
+	bscodec_offtout((int64_t)st->st_dev, buf);
+	bscodec_offtout((int64_t)st->st_ino, buf+8);
+	bscodec_offtout((int64_t)st->st_size, buf+16);
+	bscodec_offtout((int64_t)st->st_mtime, buf+24);
+#if defined(__linux__)
+	bscodec_offtout((int64_t)st->st_mtim.tv_nsec, buf+32);
+#else
+	bscodec_offtout(0, buf+32);
+#endif
+	bshash_update(ident, buf, sizeof(buf));
+}
+
+/**
+ * 功能：读取断点续传日志，找到最后一个可用的检查点
+ * 参数：
+ *   - j: 断点续传状态（fd、jfd已打开）
+ *   - ident: 当前补丁的标识
+ *   - options: 输出参数，恢复时的oldpos/newpos
+ *   - consumed: 输出参数，恢复时的控制流位置
+ * 
+ * 说明：日志与当前补丁不符时重新开始。最后一个检查点对应的数据段会从输出文件中读回
+ *       并与日志中的摘要比较，不一致时依次退回到前一个检查点，因此恢复时只需读取
+ *       最近的一段输出，而不必重新读取整个文件。日志会被截断到选中的检查点之后
+ */
+static void journal_open(struct journal* j, const uint8_t ident[BSHASH_LEN],
+		struct bspatch_options* options, int64_t* consumed)
+{
+	uint8_t header[JOURNAL_HEADER_LEN];
+	uint8_t entry[JOURNAL_ENTRY_LEN];
+	uint8_t hash[BSHASH_LEN];
+	int64_t *pos = NULL;       // 各有效条目的oldpos、newpos、consumed及其在日志中的序号
+	uint8_t *hashes = NULL;    // 各有效条目的摘要
+	uint8_t *seg;              // 从输出文件读回的数据段
+	int64_t n, i, start;
+
+	options->oldpos = 0;
+	options->newpos = 0;
+	*consumed = 0;
+
+	/* 读取并校验日志文件头 */
+	if (pread(j->jfd, header, sizeof(header), 0) == sizeof(header) &&
+		memcmp(header, JOURNAL_MAGIC, 16) == 0 &&
+		memcmp(header+16, ident, BSHASH_LEN) == 0) {
+		/* 依次读取条目，遇到第一个校验失败（写了一半）的条目为止 */
+		for (n = 0; ; n++) {
+			if (pread(j->jfd, entry, sizeof(entry), JOURNAL_HEADER_LEN + n*JOURNAL_ENTRY_LEN) != sizeof(entry))
+				break;
+			bshash_buffer(entry, 24+BSHASH_LEN, hash);
+			if (memcmp(hash, entry+24+BSHASH_LEN, 8) != 0)
+				break;
+			if (((pos = realloc(pos, (n+1)*3*sizeof(int64_t))) == NULL) ||
+				((hashes = realloc(hashes, (n+1)*BSHASH_LEN)) == NULL))
+				err(1, NULL);
+			pos[3*n] = bscodec_offtin(entry);
+			pos[3*n+1] = bscodec_offtin(entry+8);
+			pos[3*n+2] = bscodec_offtin(entry+16);
+			memcpy(hashes + n*BSHASH_LEN, entry+24, BSHASH_LEN);
+		}
+
+		/* 从最后一个检查点开始，校验其对应的数据段 */
+		for (i = n - 1; i >= 0; i--) {
+			start = (i > 0) ? pos[3*(i-1)+1] : 0;
+			if (pos[3*i+1] < start || pos[3*i+1] > j->newsize)
+				continue;
+			if ((seg = malloc(pos[3*i+1] - start + 1)) == NULL)
+				err(1, NULL);
+			if (pread(j->fd, seg, pos[3*i+1] - start, start) == pos[3*i+1] - start) {
+				bshash_buffer(seg, pos[3*i+1] - start, hash);
+				if (memcmp(hash, hashes + i*BSHASH_LEN, BSHASH_LEN) == 0) {
+					free(seg);
+					break;
+				}
+			}
+			free(seg);
+		}
+
+		if (i >= 0) {
+			options->oldpos = pos[3*i];
+			options->newpos = pos[3*i+1];
+			*consumed = pos[3*i+2];
+		}
+		free(pos);
+		free(hashes);
+
+		/* 丢弃选中的检查点之后的条目 */
+		if (ftruncate(j->jfd, JOURNAL_HEADER_LEN + (i+1)*JOURNAL_ENTRY_LEN) ||
+			lseek(j->jfd, 0, SEEK_END) == -1)
+			err(1, "journal");
+	} else {
+		/* 新建日志 */
+		memcpy(header, JOURNAL_MAGIC, 16);
+		memcpy(header+16, ident, BSHASH_LEN);
+		if (ftruncate(j->jfd, 0) ||
+			pwrite(j->jfd, header, sizeof(header), 0) != sizeof(header) ||
+			fdatasync(j->jfd) ||
+			lseek(j->jfd, 0, SEEK_END) == -1)
+			err(1, "journal");
+	}
+
+	j->written = options->newpos;
+}
+
+/**
+ * 功能：复制回调，记录0号旧文件的diff部分
+ * 参数：同bspatch_options.copied
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 内存不足
+ */
+static int update_copied(const struct bspatch_options* options, int64_t newpos, int64_t oldpos,
+		int64_t length, int ref)
+{
+	struct update* u = (struct update*)options->opaque;
+	struct segment* grown;
+
+	// 其他旧文件不是输出文件的来源，那里的数据只能直接写入
+	if (ref != 0)
+		return 0;
+	if (u->nsegs == u->cap) {
+		u->cap = u->cap ? 2 * u->cap : 1024;
+		if ((grown = realloc(u->segs, u->cap * sizeof(*grown))) == NULL)
+			return -1;
+		u->segs = grown;
+	}
+	u->segs[u->nsegs].newpos = newpos;
+	u->segs[u->nsegs].oldpos = oldpos;
+	u->segs[u->nsegs].length = length;
+	u->nsegs++;
+	return 0;
+}
+
+/**
+ * 功能：把内存中的数据完整写入文件的指定位置
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+static int writeat(int fd, const uint8_t* buf, int64_t length, int64_t offset)
+{
+	ssize_t n;
+
+	for (; length > 0; length -= n, buf += n, offset += n)
+		if ((n = pwrite(fd, buf, length, offset)) <= 0) {
+			if (n < 0 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return -1;
+		}
+	return 0;
+}
+
+/**
+ * 功能：在文件系统内部把一个文件的一段复制到另一个文件
+ * 参数：
+ *   - in/src: 源文件及位置
+ *   - out/dst: 目标文件及位置
+ *   - length: 字节数
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 系统或文件系统不支持（此时目标范围可能只写了一部分，由调用者重新写入）
+ *
+ * 两边都按块对齐时先尝试FICLONERANGE，只共享数据块而不写入数据；
+ * 否则用copy_file_range，支持的文件系统同样会共享数据块，至少省去用户态的复制
+ */
+static int copyrange(int in, int64_t src, int out, int64_t dst, int64_t length)
+{
+#if defined(__linux__)
+# if defined(FICLONERANGE)
+	struct file_clone_range r;
+
+	if (src % UPDATE_BLOCK == 0 && dst % UPDATE_BLOCK == 0 && length % UPDATE_BLOCK == 0) {
+		r.src_fd = in;
+		r.src_offset = src;
+		r.src_length = length;
+		r.dest_offset = dst;
+		if (ioctl(out, FICLONERANGE, &r) == 0)
+			return 0;
+	}
+# endif
+# if defined(SYS_copy_file_range)
+	loff_t inoff = src, outoff = dst;
+	ssize_t n;
+
+	for (; length > 0; length -= n)
+		if ((n = syscall(SYS_copy_file_range, in, &inoff, out, &outoff, (size_t)length, 0)) <= 0)
+			return -1;
+	return 0;
+# endif
+#endif
+	return -1;
+}
+
+/**
+ * 功能：打开更新模式的输出文件
+ * 参数：
+ *   - u: 更新模式状态（oldfd已打开）
+ *   - path: 输出文件路径
+ *   - mode: 新建输出文件时的权限
+ *   - old/oldsize: 旧文件内容
+ *
+ * 说明：输出文件已经存在时应当是旧文件的副本（例如cp --reflink生成的，或者就是旧文件本身），
+ *       大小必须与旧文件相同；不是旧文件本身时内容不可信，update_finish逐块读回比较。
+ *       不存在时用FICLONE整体克隆旧文件，不支持时退回copy_file_range，最后退回直接写入
+ */
+static void update_open(struct update* u, const char* path, mode_t mode, const uint8_t* old, int64_t oldsize)
+{
+	struct stat osb, nsb;
+
+	if ((u->fd = open(path, O_RDWR)) >= 0) {
+		if (fstat(u->fd, &nsb) || fstat(u->oldfd, &osb))
+			err(1, "%s", path);
+		if (nsb.st_size != oldsize)
+			errx(1, "%s is not a copy of oldfile\n", path);
+		// 输出文件就是旧文件时，旧文件的内容会被改写，不能再从中克隆
+		u->clone = (nsb.st_dev != osb.st_dev || nsb.st_ino != osb.st_ino);
+		u->verify = u->clone;
+		return;
+	}
+	if (errno != ENOENT || (u->fd = open(path, O_CREAT|O_EXCL|O_RDWR, mode)) < 0)
+		err(1, "%s", path);
+	u->verify = 0;
+#if defined(__linux__) && defined(FICLONE)
+	if (ioctl(u->fd, FICLONE, u->oldfd) == 0) {
+		u->clone = 1;
+		return;
+	}
+#endif
+	if (copyrange(u->oldfd, 0, u->fd, 0, oldsize) && writeat(u->fd, old, oldsize, 0))
+		err(1, "%s", path);
+	u->clone = 1;
+}
+
+/**
+ * 功能：读回文件的一段，与内存中的数据比较
+ * 参数：
+ *   - fd: 文件
+ *   - data/length: 期望的内容及长度
+ *   - offset: 文件中的位置
+ * 返回：
+ *   - 1: 相同
+ *   - 0: 不同（包括文件比期望的短）
+ */
+static int sameat(int fd, const uint8_t* data, int64_t length, int64_t offset)
+{
+	uint8_t buf[16 * UPDATE_BLOCK];
+	ssize_t n;
+
+	for (; length > 0; length -= n, data += n, offset += n) {
+		if ((n = pread(fd, buf, length > (int64_t)sizeof(buf) ? sizeof(buf) : (size_t)length, offset)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			err(1, "read");
+		}
+		if (n == 0 || memcmp(buf, data, n) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * 功能：写出一段类型相同的连续块
+ * 参数：
+ *   - u: 更新模式状态
+ *   - new: 新文件内容
+ *   - kind: 0表示与副本相同，1表示从旧文件src处克隆，2表示直接写入
+ *   - pos/src/length: 新文件位置、旧文件位置、长度
+ */
+static void update_flush(struct update* u, const uint8_t* new, int kind, int64_t pos, int64_t src,
+		int64_t length)
+{
+	if (length == 0 || kind == 0)
+		return;
+	// 克隆后读回确认，保证输出文件的每个块不是从new写入就是与new比较过
+	if (kind == 1 && copyrange(u->oldfd, src, u->fd, pos, length) == 0 &&
+		(!u->verify || sameat(u->fd, new + pos, length, pos)))
+		return;
+	if (writeat(u->fd, new + pos, length, pos))
+		err(1, "write");
+}
+
+/**
+ * 功能：按块比较新文件与输出文件中的旧数据，只写入改变的块
+ * 参数：
+ *   - u: 更新模式状态
+ *   - old/oldsize: 旧文件内容（也就是输出文件原来的内容）
+ *   - new/newsize: 新文件内容
+ *
+ * 说明：每个块依次判断
+ *   1. 与旧文件同一位置的数据相同：副本中已经是新内容，跳过（事先存在的副本读回比较确认）；
+ *   2. 整块位于某条记录的diff部分，且与该记录对应的旧文件数据相同（diff全为0，只是位置移动了）：
+ *      从旧文件克隆或复制；
+ *   3. 其余直接写入。
+ *   相邻的同类块合并为一次系统调用。写入量因此只与改变的数据量有关，而与文件大小无关。
+ *   事先存在的副本中跳过和克隆的块都读回与新文件比较，不同时直接写入，所以输出文件的内容
+ *   一定等于new，对new检查的摘要也就是对输出文件的检查
+ */
+static void update_finish(struct update* u, const uint8_t* old, int64_t oldsize, const uint8_t* new,
+		int64_t newsize)
+{
+	int64_t pos, len, src = 0, s = 0;
+	int64_t runpos = 0, runsrc = 0;   // 当前连续段的起始位置及其旧文件位置
+	int kind, run = 0;                // 当前块、当前连续段的类型（同update_flush）
+	struct segment* g;
+
+	if (ftruncate(u->fd, newsize))
+		err(1, "ftruncate");
+	for (pos = 0; pos < newsize; pos += len) {
+		len = (newsize - pos < UPDATE_BLOCK) ? newsize - pos : UPDATE_BLOCK;
+		if (pos + len <= oldsize && memcmp(new + pos, old + pos, len) == 0 &&
+			(!u->verify || sameat(u->fd, new + pos, len, pos))) {
+			kind = 0;
+		} else {
+			kind = 2;
+			// 找到第一条结束位置在本块之后的记录
+			while (s < u->nsegs && u->segs[s].newpos + u->segs[s].length <= pos)
+				s++;
+			g = (s < u->nsegs) ? &u->segs[s] : NULL;
+			if (u->clone && g != NULL && g->newpos <= pos && pos + len <= g->newpos + g->length) {
+				src = g->oldpos + (pos - g->newpos);
+				if (src >= 0 && src + len <= oldsize && memcmp(new + pos, old + src, len) == 0)
+					kind = 1;
+			}
+		}
+		// 类型改变，或者克隆的旧文件位置不连续时，写出之前的连续段
+		if (kind != run || (kind == 1 && src != runsrc + (pos - runpos))) {
+			update_flush(u, new, run, runpos, runsrc, pos - runpos);
+			run = kind;
+			runpos = pos;
+			runsrc = src;
+		}
+	}
+	update_flush(u, new, run, runpos, runsrc, newsize - runpos);
+
+	if (fsync(u->fd) || close(u->fd) == -1)
+		err(1, "fsync");
+	free(u->segs);
+}
+
+/**
+ * 功能：并行计算摘要的线程函数
+ * 参数：
+ *   - arg: 本线程的任务（struct hashjob）
+ */
+static void* hash_thread(void* arg)
+{
+	struct hashjob* job = (struct hashjob*)arg;
+	int64_t i;
+
+	for (i = job->id; i < job->nsubtrees; i += job->threads)
+		bshash_subtree(job->data + i * HASH_SUBTREE, (uint64_t)i * (HASH_SUBTREE / BSHASH_CHUNK_LEN),
+				HASH_SUBTREE / BSHASH_CHUNK_LEN, job->cvs[i]);
+	return NULL;
+}
+
+/**
+ * 功能：用多个线程计算一段数据的摘要（结果与bshash_buffer相同）
+ * 参数：
+ *   - data/size: 数据及其长度
+ *   - out: 输出的摘要
+ *
+ * 说明：数据按1MB划分为完整子树，分给各CPU并行计算，最后不足1MB（至少1字节）的部分
+ *       和子树的合并在当前线程完成。线程创建失败时由当前线程补做该线程的任务
+ */
+static void parallelhash(const uint8_t* data, int64_t size, uint8_t out[BSHASH_LEN])
+{
+	struct hashjob jobs[HASH_MAX_THREADS];
+	pthread_t tids[HASH_MAX_THREADS];
+	int started[HASH_MAX_THREADS];
+	struct bshash h;
+	int64_t n, i;
+	long cpus;
+	int threads, t;
+
+	n = (size > 0) ? (size - 1) / HASH_SUBTREE : 0;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = (cpus < 1) ? 1 : (cpus > HASH_MAX_THREADS) ? HASH_MAX_THREADS : (int)cpus;
+	if (threads > n)
+		threads = (n > 0) ? (int)n : 1;
+
+	if ((jobs[0].cvs = malloc((n + 1) * sizeof(*jobs[0].cvs))) == NULL)
+		err(1, NULL);
+	for (t = 0; t < threads; t++) {
+		jobs[t].data = data;
+		jobs[t].nsubtrees = n;
+		jobs[t].cvs = jobs[0].cvs;
+		jobs[t].id = t;
+		jobs[t].threads = threads;
+		started[t] = (t > 0) && pthread_create(&tids[t], NULL, hash_thread, &jobs[t]) == 0;
+	}
+	hash_thread(&jobs[0]);
+	for (t = 1; t < threads; t++) {
+		if (started[t])
+			pthread_join(tids[t], NULL);
+		else
+			hash_thread(&jobs[t]);
+	}
+
+	bshash_init(&h);
+	for (i = 0; i < n; i++)
+		bshash_append(&h, jobs[0].cvs[i], HASH_SUBTREE / BSHASH_CHUNK_LEN);
+	bshash_update(&h, data + n * HASH_SUBTREE, size - n * HASH_SUBTREE);
+	bshash_final(&h, out);
+	free(jobs[0].cvs);
+}
+
+/**
+ * 功能：检查点回调，把new[hashed, newpos)计入新文件摘要，再调用被包装的检查点回调
+ * 参数：同bspatch_options.checkpoint
+ * 返回：被包装的回调的返回值（没有时为0）
+ */
+static int digest_checkpoint(const struct bspatch_options* options, const uint8_t* new,
+		int64_t oldpos, int64_t newpos)
+{
+	struct digest* d = (struct digest*)options->opaque;
+	struct bspatch_options inner;
+
+	bshash_update(&d->h, new + d->hashed, newpos - d->hashed);
+	d->hashed = newpos;
+	if (d->checkpoint == NULL)
+		return 0;
+	inner = *options;
+	inner.opaque = d->opaque;
+	return d->checkpoint(&inner, new, oldpos, newpos);
+}
+
+/**
+ * 功能：复制回调，只是以原来的opaque调用被包装的复制回调
+ * 参数：同bspatch_options.copied
+ */
+static int digest_copied(const struct bspatch_options* options, int64_t newpos, int64_t oldpos,
+		int64_t length, int ref)
+{
+	struct digest* d = (struct digest*)options->opaque;
+	struct bspatch_options inner;
+
+	inner = *options;
+	inner.opaque = d->opaque;
+	return d->copied(&inner, newpos, oldpos, length, ref);
+}
+
 /**
  * 功能：程序主入口，执行文件补丁操作
  * 参数：
@@ -203,10 +942,18 @@ static int bz2_read(const struct bspatch_stream* stream, void* buffer, int lengt
  *   - 0: 成功
  *   其他值: 失败（由err函数直接退出）
  * 
+ * 选项：
+ *   -j: 断点续传模式。新文件数据边生成边写入输出文件，并定期在"新文件路径.journal"中
+ *       记录检查点；中断后以相同参数重新运行即可从最后一个检查点继续
+ *   -u: 更新模式。新文件路径是旧文件的副本（不存在时克隆旧文件生成，也可以就是旧文件），
+ *       只写入内容改变的块，位置移动但内容不变的块从旧文件克隆。新文件路径就是旧文件时
+ *       原地改写不是原子的，也不能与-j一起使用，中断后旧文件已经部分改写，无法恢复
+ *   -m oldfile: 多基准补丁的其他旧文件，顺序与生成补丁时相同（可以重复）
+ * 
  * 程序流程：
  * 1. 检查命令行参数是否正确
  * 2. 读取补丁文件头（24字节）
- * 3. 验证补丁文件魔数（ENDSLEY/BSDIFF43）
+ * 3. 验证补丁文件魔数（ENDSLEY/BSDIFF43、ENDSLEY/BSDIFF44或ENDSLEY/BSDZSTD1）
  * 4. 读取新文件大小
  * 5. 读取旧文件内容到内存
  * 6. 分配新文件缓冲区
@@ -223,12 +970,51 @@ int main(int argc,char * argv[])
 	uint8_t header[24];                // 补丁文件头（24字节）
 	uint8_t *old, *new;                // 旧文件和新文件的内存缓冲区
 	int64_t oldsize, newsize;          // 旧文件和新文件的大小
-	BZFILE* bz2;                       // BZip2文件句柄
+	struct patchfile pf;               // 补丁数据流状态
 	struct bspatch_stream stream;      // 补丁数据流结构
+	struct bspatch_options options;    // 补丁可选参数（格式由文件头决定）
 	struct stat sb;                    // 文件状态结构（用于保存文件权限）
+	struct stat jsb;                   // 补丁文件状态
+	int journaled = 0;                 // 是否启用断点续传
+	struct journal j;                  // 断点续传状态
+	int updating = 0;                  // 是否启用更新模式
+	struct update u;                   // 更新模式状态
+	struct bshash ident;               // 补丁标识（用于确认日志属于当前补丁）
+	uint8_t identhash[BSHASH_LEN];
+	uint8_t skip[65536];               // 恢复时跳过已处理的控制流
+	char* jpath = NULL;                // 日志文件路径
+	int64_t consumed, n;
+	int ch;
+	const char** refpaths;             // 多基准：-m指定的其他旧文件路径
+	int nextra = 0;                    // 多基准：-m指定的旧文件个数
+	int64_t nrefs = 0;                 // 多基准：补丁文件头中的旧文件个数（0表示普通补丁）
+	uint8_t** refs = NULL;             // 多基准：全部旧文件（0号为oldfile）
+	int64_t* refsizes = NULL;          // 多基准：全部旧文件的大小
+	int64_t flags;                     // BSDIFF44文件头标志位
+	int zstd = 0;                      // 是否为zstd引擎生成的补丁
+	int filter = BSFILTER_NONE;        // 补丁文件头指定的预处理过滤器
+	uint8_t digests[2*BSHASH_LEN];     // 补丁文件头中旧文件和新文件的摘要
+	uint8_t hash[BSHASH_LEN];
+	struct digest d;                   // 新文件摘要的增量计算状态
+
+	if ((refpaths = malloc(argc * sizeof(char*))) == NULL)
+		err(1, NULL);
+
+	// 解析命令行选项
+	while((ch=getopt(argc,argv,"jum:"))!=-1) {
+		switch(ch) {
+		case 'j': journaled=1; break;
+		case 'u': updating=1; break;
+		case 'm': refpaths[nextra++]=optarg; break;
+		default: errx(1,USAGE,argv[0]);
+		}
+	}
+	argc-=optind-1;
+	argv+=optind-1;
 
 	// 检查命令行参数数量（需要4个：程序名、旧文件、新文件、补丁文件）
-	if(argc!=4) errx(1,"usage: %s oldfile newfile patchfile\n",argv[0]);
+	if(argc!=4) errx(1,USAGE,argv[0]);
+	if(journaled && updating) errx(1,"-j and -u cannot be combined\n");
 
 	/* 打开补丁文件 */
 	// 以只读模式打开补丁文件
@@ -246,17 +1032,74 @@ int main(int argc,char * argv[])
 	}
 
 	/* 验证补丁文件魔数 */
-	// 检查前16字节是否为 "ENDSLEY/BSDIFF43"
-	if (memcmp(header, "ENDSLEY/BSDIFF43", 16) != 0)
+	// 检查前16字节是否为 "ENDSLEY/BSDIFF43"、"ENDSLEY/BSDIFF44" 或 "ENDSLEY/BSDZSTD1"（zstd引擎）
+	memset(&options, 0, sizeof(options));
+	if (memcmp(header, "ENDSLEY/BSDIFF43", 16) == 0)
+		options.format = BSDIFF_FORMAT_43;
+	else if (memcmp(header, "ENDSLEY/BSDIFF44", 16) == 0)
+		options.format = BSDIFF_FORMAT_44;
+	else if (memcmp(header, BSZSTD_MAGIC, 16) == 0)
+		zstd = 1;
+	else
 		errx(1, "Corrupt patch\n");
+#if !defined(HAVE_ZSTD)
+	if (zstd)
+		errx(1, "zstd support was not compiled in\n");
+#endif
+	if (zstd && journaled)
+		errx(1, "-j is not supported for zstd patches\n");
 
 	/* 从文件头读取新文件大小 */
 	// header+16 指向文件头中的新文件大小字段（后8字节）
-	newsize=offtin(header+16);
+	newsize=bscodec_offtin(header+16);
 	// 验证新文件大小是否有效（必须为非负数）
 	if(newsize<0)
 		errx(1,"Corrupt patch\n");
 
+	bshash_init(&ident);
+	bshash_update(&ident, header, 24);
+
+	/* BSDIFF44：读取8字节的头部标志位 */
+	if (options.format == BSDIFF_FORMAT_44) {
+		if (fread(header, 1, 8, f) != 8)
+			errx(1, "Corrupt patch\n");
+		// 出现未知标志说明补丁由更新的版本生成
+		flags = bscodec_offtin(header);
+		if (flags & ~(int64_t)(BSDIFF44_HEADER_MULTIREF | BSDIFF44_HEADER_FILTER_X86 |
+				BSDIFF44_HEADER_FILTER_ARM64 | BSDIFF44_HEADER_DIGESTS))
+			errx(1, "Unsupported patch flags\n");
+		if (flags & BSDIFF44_HEADER_FILTER_X86)
+			filter = BSFILTER_X86;
+		if (flags & BSDIFF44_HEADER_FILTER_ARM64)
+			filter = (filter == BSFILTER_NONE) ? BSFILTER_ARM64 : -1;
+		if (filter < 0)
+			errx(1, "Corrupt patch\n");
+		bshash_update(&ident, header, 8);
+
+		// 多基准补丁：标志位之后是8字节的旧文件个数
+		if (flags & BSDIFF44_HEADER_MULTIREF) {
+			if (fread(header, 1, 8, f) != 8)
+				errx(1, "Corrupt patch\n");
+			nrefs = bscodec_offtin(header);
+			bshash_update(&ident, header, 8);
+		}
+
+		// 摘要：最后是旧文件（多基准补丁为0号旧文件）和新文件的摘要
+		if (flags & BSDIFF44_HEADER_DIGESTS) {
+			if (fread(digests, 1, sizeof(digests), f) != sizeof(digests))
+				errx(1, "Corrupt patch\n");
+			bshash_update(&ident, digests, sizeof(digests));
+		}
+	} else
+		flags = 0;
+	if (nrefs != (nextra ? nextra + 1 : 0))
+		errx(1, "patch needs %lld old files, %d given\n", (long long)(nrefs ? nrefs : 1), nextra + 1);
+	if (nrefs && journaled)
+		errx(1, "-j is not supported for multi-base patches\n");
+	// 断点续传时数据边生成边写入，而逆变换需要整个新文件
+	if (filter != BSFILTER_NONE && journaled)
+		errx(1, "-j is not supported for filtered patches\n");
+
 	/* 关闭补丁文件，重新打开旧文件并读取到内存 */
 	// 这一系列操作：打开旧文件 -> 获取大小 -> 分配内存 -> 定位到开头 -> 读取内容 -> 获取状态 -> 关闭文件
 	if(((fd=open(argv[1],O_RDONLY,0))<0) ||                    // 以只读模式打开旧文件
@@ -264,33 +1107,174 @@ int main(int argc,char * argv[])
 		((old=malloc(oldsize+1))==NULL) ||                     // 分配内存（多加1字节以防溢出）
 		(lseek(fd,0,SEEK_SET)!=0) ||                           // 定位到文件开头
 		(read(fd,old,oldsize)!=oldsize) ||                     // 读取整个旧文件到内存
-		(fstat(fd, &sb)) ||                                     // 获取文件状态（包括权限信息）
-		(close(fd)==-1)) err(1,"%s",argv[1]);                 // 关闭旧文件
+		(fstat(fd, &sb))) err(1,"%s",argv[1]);                 // 获取文件状态（包括权限信息）
+	// 更新模式：旧文件保持打开，作为克隆的来源
+	if (updating) {
+		u.oldfd = fd;
+		u.segs = NULL;
+		u.nsegs = u.cap = 0;
+	} else if (close(fd)==-1) err(1,"%s",argv[1]);            // 关闭旧文件
+
+	/* 摘要：在生成任何输出之前并行检查旧文件，基准不对时立即失败 */
+	if (flags & BSDIFF44_HEADER_DIGESTS) {
+		parallelhash(old, oldsize, hash);
+		if (memcmp(hash, digests, BSHASH_LEN) != 0)
+			errx(1, "%s: old file does not match the patch\n", argv[1]);
+	}
 		
 	// 为新文件分配内存
 	if((new=malloc(newsize+1))==NULL) err(1,NULL);
 
-	/* 重新打开BZip2压缩的补丁数据 */
-	// 注意：f指针已经在开头，现在从第24字节位置读取压缩数据
-	if (NULL == (bz2 = BZ2_bzReadOpen(&bz2err, f, 0, 0, NULL, 0)))
-		errx(1, "BZ2_bzReadOpen, bz2err=%d", bz2err);
+	/* 多基准：读入其他旧文件，0号旧文件为oldfile，各旧文件都从开头开始 */
+	if (nrefs) {
+		if (((refs = malloc(nrefs * sizeof(uint8_t*))) == NULL) ||
+			((refsizes = malloc(nrefs * sizeof(int64_t))) == NULL) ||
+			((options.refpos = calloc(nrefs, sizeof(int64_t))) == NULL))
+			err(1, NULL);
+		refs[0] = old;
+		refsizes[0] = oldsize;
+		for (n = 1; n < nrefs; n++)
+			if(((fd=open(refpaths[n-1],O_RDONLY,0))<0) ||
+				((refsizes[n]=lseek(fd,0,SEEK_END))==-1) ||
+				((refs[n]=malloc(refsizes[n]+1))==NULL) ||
+				(lseek(fd,0,SEEK_SET)!=0) ||
+				(read(fd,refs[n],refsizes[n])!=refsizes[n]) ||
+				(close(fd)==-1)) err(1,"%s",refpaths[n-1]);
+		options.nrefs = (int)nrefs;
+		options.refs = (const uint8_t* const*)refs;
+		options.refsizes = refsizes;
+	}
 
-	/* 设置补丁数据流结构 */
-	// 设置读取函数为bz2_read
-	stream.read = bz2_read;
-	// 设置opaque指针为BZip2文件句柄
-	stream.opaque = bz2;
-	
-	/* 应用补丁，生成新文件 */
-	if (bspatch(old, oldsize, new, newsize, &stream))
-		errx(1, "bspatch");
+	/* 预处理过滤器：旧文件做与生成补丁时相同的变换 */
+	if (filter != BSFILTER_NONE) {
+		bsfilter_encode(old, oldsize, filter);
+		for (n = 1; n < nrefs; n++)
+			bsfilter_encode(refs[n], refsizes[n], filter);
+	}
+
+	/* 断点续传：打开输出文件和日志，找到恢复点 */
+	consumed = 0;
+	if (journaled) {
+		// 补丁标识：文件头、新旧文件大小和补丁文件的身份。文件头带有摘要时旧文件已经按内容
+		// 检查过，否则再加上旧文件的身份，换成另一个同样大小的旧文件时也会重新开始
+		if (fstat(fileno(f), &jsb))
+			err(1, "fstat(%s)", argv[3]);
+		bscodec_offtout(oldsize, header);
+		bshash_update(&ident, header, 8);
+		identfile(&ident, &jsb);
+		if (!(flags & BSDIFF44_HEADER_DIGESTS))
+			identfile(&ident, &sb);
+		bshash_final(&ident, identhash);
 
-	/* 清理BZip2资源 */
-	// 关闭BZip2读取器
-	BZ2_bzReadClose(&bz2err, bz2);
+		if ((jpath = malloc(strlen(argv[2]) + sizeof(".journal"))) == NULL)
+			err(1, NULL);
+		sprintf(jpath, "%s.journal", argv[2]);
+		// 输出文件不截断，已经写入的部分在恢复时继续使用
+		if (((j.fd = open(argv[2], O_CREAT|O_RDWR, sb.st_mode)) < 0) ||
+			((j.jfd = open(jpath, O_CREAT|O_RDWR, 0644)) < 0))
+			err(1, "%s", argv[2]);
+		j.newsize = newsize;
+		j.pf = &pf;
+		journal_open(&j, identhash, &options, &consumed);
+		options.opaque = &j;
+		options.checkpoint = journal_checkpoint;
+	}
+
+	/* 更新模式：打开（或克隆生成）输出文件，并记录每条记录的diff部分 */
+	if (updating) {
+		update_open(&u, argv[2], sb.st_mode, old, oldsize);
+		options.opaque = &u;
+		options.copied = update_copied;
+	}
+
+	/* 摘要：包装回调，在检查点处增量计算新文件摘要。带过滤器的补丁生成的是变换后的数据，
+	   只能在逆变换之后一次计算 */
+	bshash_init(&d.h);
+	d.hashed = 0;
+	if ((flags & BSDIFF44_HEADER_DIGESTS) && filter == BSFILTER_NONE) {
+		// 断点续传恢复时检查点之前的数据不会重新生成，从输出文件读回
+		if (journaled && pread(j.fd, new, options.newpos, 0) != options.newpos)
+			err(1, "%s", argv[2]);
+		d.opaque = options.opaque;
+		d.checkpoint = options.checkpoint;
+		d.copied = options.copied;
+		options.opaque = &d;
+		options.checkpoint = digest_checkpoint;
+		if (d.copied)
+			options.copied = digest_copied;
+	}
+
+	if (zstd) {
+		/* zstd引擎：文件头之后直接是zstd帧，不经过BZip2 */
+		stream.read = file_read;
+		stream.opaque = f;
+		if (zstd_patch(old, oldsize, new, newsize, &stream))
+			errx(1, "bszstd_patch");
+	} else {
+		/* 重新打开BZip2压缩的补丁数据 */
+		// 注意：f指针已经位于文件头之后，现在从这里读取压缩数据
+		if (NULL == (pf.bz2 = BZ2_bzReadOpen(&bz2err, f, 0, 0, NULL, 0)))
+			errx(1, "BZ2_bzReadOpen, bz2err=%d", bz2err);
+		pf.f = f;
+		pf.consumed = 0;
+
+		/* 设置补丁数据流结构 */
+		// 设置读取函数为bz2_read
+		stream.read = bz2_read;
+		// 设置opaque指针为补丁数据流状态
+		stream.opaque = &pf;
+
+		/* 断点续传：跳过检查点之前的控制流 */
+		// BZip2的解压状态无法保存，只能重新解压并丢弃，但不再重建和写入检查点之前的数据
+		while (pf.consumed < consumed) {
+			n = consumed - pf.consumed;
+			if (n > (int64_t)sizeof(skip))
+				n = sizeof(skip);
+			if (bz2_read(&stream, skip, (int)n))
+				errx(1, "Corrupt patch\n");
+		}
+
+		/* 应用补丁，生成新文件 */
+		if (bspatch_ex(old, oldsize, new, newsize, &stream, &options))
+			errx(1, "bspatch");
+
+		/* 清理BZip2资源 */
+		// 关闭BZip2读取器
+		BZ2_bzReadClose(&bz2err, pf.bz2);
+	}
 	// 关闭补丁文件
 	fclose(f);
 
+	/* 预处理过滤器：逆变换得到真正的新文件；更新模式还需要恢复旧文件，用于和输出文件比较 */
+	if (filter != BSFILTER_NONE) {
+		bsfilter_decode(new, newsize, filter);
+		if (updating)
+			bsfilter_decode(old, oldsize, filter);
+	}
+
+	/* 摘要：计入最后一个检查点之后的数据（zstd补丁没有检查点，即整个新文件），写出之前比较 */
+	if (flags & BSDIFF44_HEADER_DIGESTS) {
+		bshash_update(&d.h, new + d.hashed, newsize - d.hashed);
+		bshash_final(&d.h, hash);
+		if (memcmp(hash, digests + BSHASH_LEN, BSHASH_LEN) != 0)
+			errx(1, "%s: patched output does not match the patch digest\n", argv[2]);
+	}
+
+	if (journaled) {
+		/* 断点续传：写入剩余数据，截断到新文件大小后删除日志 */
+		if ((pwrite(j.fd, new + j.written, newsize - j.written, j.written) != newsize - j.written) ||
+			ftruncate(j.fd, newsize) ||
+			fsync(j.fd) ||
+			(close(j.fd) == -1) ||
+			(close(j.jfd) == -1) ||
+			unlink(jpath))
+			err(1, "%s", argv[2]);
+		free(jpath);
+	} else if (updating) {
+		/* 更新模式：只写入改变的块 */
+		update_finish(&u, old, oldsize, new, newsize);
+		close(u.oldfd);
+	} else
 	/* 将新文件写入磁盘 */
 	// 打开新文件（创建、清空、只写），使用旧文件的权限
 	if(((fd=open(argv[2],O_CREAT|O_TRUNC|O_WRONLY,sb.st_mode))<0) ||  // 创建新文件
@@ -303,6 +1287,12 @@ int main(int argc,char * argv[])
 	free(new);
 	// 释放旧文件缓冲区
 	free(old);
+	for (n = 1; n < nrefs; n++)
+		free(refs[n]);
+	free(refs);
+	free(refsizes);
+	free(options.refpos);
+	free(refpaths);
 
 	return 0;  // 成功完成所有操作
 }
@@ -40,6 +40,50 @@ struct bspatch_stream
 	int (*read)(const struct bspatch_stream* stream, void* buffer, int length);  // 数据读取函数指针
 };
 
+/**
+ * 功能：bspatch_ex的可选参数
+ * 传入NULL或全部清零时与bspatch行为一致
+ */
+struct bspatch_options
+{
+	int format;      // 控制数据编码格式（BSDIFF_FORMAT_*），必须与生成补丁时一致
+
+	// 断点续传：从检查点恢复时，oldpos/newpos取检查点回调报告的值，
+	// stream需要定位到该检查点时的位置；new[0, newpos)视为已经生成，不会被改写
+	int64_t oldpos;  // 恢复时旧文件的当前位置
+	int64_t newpos;  // 恢复时新文件的当前位置
+
+	void* opaque;    // 不透明指针，供回调函数使用
+
+	// 检查点回调（可以为NULL）：new[0, newpos)已全部生成，且stream恰好位于下一条控制记录
+	// （BSDIFF44为下一个控制块）的起始处，此时的oldpos/newpos可以用于之后恢复。
+	// 返回非0时bspatch中止并返回-1
+	int (*checkpoint)(const struct bspatch_options* options, const uint8_t* new, int64_t oldpos, int64_t newpos);
+
+	// 多基准补丁（bsdiff_multi生成，格式必须为BSDIFF_FORMAT_44）：nrefs个旧文件按生成补丁时的
+	// 顺序给出，此时old/oldsize参数及oldpos不使用。refpos是各旧文件的当前位置（nrefs项），
+	// 开始时作为初始值（从头开始时全为0），应用过程中随之更新，检查点回调时可以保存下来用于恢复
+	int nrefs;                      // 旧文件个数（0表示普通补丁）
+	const uint8_t* const* refs;     // 各旧文件数据
+	const int64_t* refsizes;        // 各旧文件大小
+	int64_t* refpos;                // 各旧文件的当前位置
+
+	// 复制回调（可以为NULL）：每条控制记录的diff数据加到旧文件数据上之后调用，此时
+	// new[newpos, newpos+length)由ref号旧文件（普通补丁为0）从oldpos开始的数据加上diff得到，
+	// 超出旧文件范围的部分直接取diff数据。返回非0时bspatch中止并返回-1
+	int (*copied)(const struct bspatch_options* options, int64_t newpos, int64_t oldpos, int64_t length, int ref);
+};
+
+// 补丁格式（与bsdiff.h中的定义相同）
+# define BSDIFF_FORMAT_43 0
+# define BSDIFF_FORMAT_44 1
+
+// BSDIFF44补丁文件头的标志位（与bsdiff.h中的定义相同）
+# define BSDIFF44_HEADER_MULTIREF 0x1
+# define BSDIFF44_HEADER_FILTER_X86 0x2
+# define BSDIFF44_HEADER_FILTER_ARM64 0x4
+# define BSDIFF44_HEADER_DIGESTS 0x8
+
 /**
  * 功能：应用补丁，从旧文件生成新文件
  * 参数：
@@ -54,5 +98,17 @@ struct bspatch_stream
  */
 int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize, struct bspatch_stream* stream);
 
+/**
+ * 功能：带可选参数的bspatch
+ * 参数：
+ *   - old/oldsize/new/newsize/stream: 同bspatch
+ *   - options: 可选参数（可以为NULL）
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+int bspatch_ex(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
+		struct bspatch_stream* stream, const struct bspatch_options* options);
+
 #endif
 
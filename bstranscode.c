@@ -0,0 +1,614 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * bstranscode：补丁转码
+ *
+ * 把已有的BSDIFF43/BSDIFF44补丁解码为控制记录、diff数据和extra数据，重新编码为另一种
+ * 格式，并用另一种压缩级别写出，不需要旧文件和新文件，也不需要重新排序和搜索。
+ * 数据按顺序流过，内存只与压缩块大小和线程数有关。
+ *
+ * -j大于1时，解压后的数据按CHUNK_SIZE切块，各块在工作线程中分别压缩成独立的BZip2流，
+ * 再按顺序首尾相接写出。这样的补丁需要能读取多个BZip2流的bspatch（本仓库的bspatch可以），
+ * 默认-j 1时只有一个流，与bsdiff生成的补丁结构完全相同。
+ */
+
+#include <bzlib.h>
+#include <err.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bsdiff.h"
+#include "bspatch.h"
+#include "bscodec.h"
+
+// 命令行用法
+#define USAGE "usage: %s [-f 43|44] [-l level] [-j threads] oldpatch newpatch\n"
+
+// 输出BSDIFF44时一个控制块最多暂存的diff和extra数据（超出时提前结束这一块）
+#define BLOCK_DATA_LIMIT (8 << 20)
+// 复制diff和extra数据时使用的缓冲区大小
+#define COPY_SIZE 65536
+// 多线程压缩：每个BZip2流的输入大小（与级别9的块大小相同）
+#define CHUNK_SIZE (900 * 1000)
+// 多线程压缩：每个线程对应的块数（正在压缩的和等待写出的）
+#define SLOTS_PER_THREAD 2
+
+/**
+ * 功能：输入补丁的解压数据流（可以由多个首尾相接的BZip2流组成）
+ */
+struct input
+{
+	FILE* f;          // 补丁文件（位于文件头之后）
+	BZFILE* bz2;      // 当前BZip2流（NULL表示已经读完）
+};
+
+/**
+ * 功能：多线程压缩的一块
+ */
+struct slot
+{
+	char* in;              // 解压数据
+	unsigned int inlen;
+	char* out;             // 压缩后的BZip2流
+	unsigned int outlen;
+	int state;             // SLOT_EMPTY/SLOT_FILLED/SLOT_DONE
+	int result;            // BZ2_bzBuffToBuffCompress的返回值
+};
+
+#define SLOT_EMPTY 0
+#define SLOT_FILLED 1
+#define SLOT_DONE 2
+
+/**
+ * 功能：输出补丁的压缩数据流
+ */
+struct output
+{
+	FILE* f;               // 补丁文件（位于文件头之后）
+	int level;             // BZip2压缩级别（1-9）
+	int threads;           // 压缩线程数
+	BZFILE* bz2;           // 单线程：唯一的BZip2流
+
+	// 多线程：块按序号依次填充、压缩、写出，序号对nslots取模得到所在的slot
+	struct slot* slots;
+	int nslots;
+	int64_t filled;        // 已经填满的块数（正在填充的块的序号）
+	int64_t taken;         // 已经被工作线程取走的块数
+	int64_t written;       // 已经写出的块数
+	int stop;              // 没有更多的块，工作线程退出
+	pthread_mutex_t lock;
+	pthread_cond_t work;   // 有新的块可以压缩，或要求退出
+	pthread_cond_t done;   // 有块压缩完成
+	pthread_t* workers;
+};
+
+/**
+ * 功能：从输入补丁中读取恰好length字节的解压数据，一个BZip2流结束后接着读下一个
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 数据损坏或不够
+ */
+static int input_read(struct input* in, void* buffer, int64_t length)
+{
+	char unused[BZ_MAX_UNUSED];
+	void* tail;
+	int n, ntail, bz2err;
+
+	while (length > 0) {
+		if (in->bz2 == NULL)
+			return -1;
+		n = BZ2_bzRead(&bz2err, in->bz2, buffer, length > INT_MAX ? INT_MAX : (int)length);
+		if (bz2err != BZ_OK && bz2err != BZ_STREAM_END)
+			return -1;
+		buffer = (uint8_t*)buffer + n;
+		length -= n;
+		if (bz2err == BZ_OK)
+			continue;
+
+		// 当前流结束，用它多读入的字节打开下一个流
+		BZ2_bzReadGetUnused(&bz2err, in->bz2, &tail, &ntail);
+		if (bz2err != BZ_OK)
+			return -1;
+		memcpy(unused, tail, ntail);
+		BZ2_bzReadClose(&bz2err, in->bz2);
+		in->bz2 = NULL;
+		if (ntail == 0 && (ntail = fread(unused, 1, sizeof(unused), in->f)) == 0)
+			continue;
+		if ((in->bz2 = BZ2_bzReadOpen(&bz2err, in->f, 0, 0, unused, ntail)) == NULL)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * 功能：压缩工作线程：按序号取走填满的块压缩，直到没有更多的块
+ */
+static void* compress_thread(void* arg)
+{
+	struct output* out = arg;
+	struct slot* s;
+
+	pthread_mutex_lock(&out->lock);
+	for (;;) {
+		while (!out->stop && out->taken == out->filled)
+			pthread_cond_wait(&out->work, &out->lock);
+		if (out->taken == out->filled)
+			break;
+		s = &out->slots[out->taken++ % out->nslots];
+		pthread_mutex_unlock(&out->lock);
+
+		s->outlen = s->inlen + s->inlen / 100 + 600;
+		s->result = BZ2_bzBuffToBuffCompress(s->out, &s->outlen, s->in, s->inlen, out->level, 0, 0);
+
+		pthread_mutex_lock(&out->lock);
+		s->state = SLOT_DONE;
+		pthread_cond_broadcast(&out->done);
+	}
+	pthread_mutex_unlock(&out->lock);
+
+	return NULL;
+}
+
+/**
+ * 功能：等待最早的未写出的块压缩完成并写出
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 压缩或写入失败
+ */
+static int output_drain(struct output* out)
+{
+	struct slot* s = &out->slots[out->written % out->nslots];
+
+	pthread_mutex_lock(&out->lock);
+	while (s->state != SLOT_DONE)
+		pthread_cond_wait(&out->done, &out->lock);
+	pthread_mutex_unlock(&out->lock);
+
+	if (s->result != BZ_OK || fwrite(s->out, 1, s->outlen, out->f) != s->outlen)
+		return -1;
+	s->inlen = 0;
+	s->state = SLOT_EMPTY;
+	out->written++;
+	return 0;
+}
+
+/**
+ * 功能：把正在填充的块交给工作线程
+ */
+static void output_submit(struct output* out)
+{
+	struct slot* s = &out->slots[out->filled % out->nslots];
+
+	pthread_mutex_lock(&out->lock);
+	s->state = SLOT_FILLED;
+	out->filled++;
+	pthread_cond_signal(&out->work);
+	pthread_mutex_unlock(&out->lock);
+}
+
+/**
+ * 功能：打开输出补丁的压缩数据流
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+static int output_open(struct output* out, FILE* f, int level, int threads)
+{
+	int bz2err, i;
+
+	memset(out, 0, sizeof(*out));
+	out->f = f;
+	out->level = level;
+	out->threads = threads;
+	if (threads == 1)
+		return ((out->bz2 = BZ2_bzWriteOpen(&bz2err, f, level, 0, 0)) == NULL) ? -1 : 0;
+
+	out->nslots = threads * SLOTS_PER_THREAD;
+	if ((out->slots = calloc(out->nslots, sizeof(struct slot))) == NULL ||
+		(out->workers = calloc(threads, sizeof(pthread_t))) == NULL)
+		return -1;
+	for (i = 0; i < out->nslots; i++)
+		if ((out->slots[i].in = malloc(CHUNK_SIZE)) == NULL ||
+			(out->slots[i].out = malloc(CHUNK_SIZE + CHUNK_SIZE / 100 + 600)) == NULL)
+			return -1;
+	pthread_mutex_init(&out->lock, NULL);
+	pthread_cond_init(&out->work, NULL);
+	pthread_cond_init(&out->done, NULL);
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&out->workers[i], NULL, compress_thread, out))
+			return -1;
+	return 0;
+}
+
+/**
+ * 功能：向输出补丁写入解压数据
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+static int output_write(struct output* out, const void* buffer, int64_t length)
+{
+	struct slot* s;
+	int64_t n;
+	int bz2err;
+
+	if (out->threads == 1) {
+		for (; length > 0; length -= n, buffer = (const uint8_t*)buffer + n) {
+			n = length > INT_MAX ? INT_MAX : length;
+			BZ2_bzWrite(&bz2err, out->bz2, (void*)buffer, (int)n);
+			if (bz2err != BZ_OK)
+				return -1;
+		}
+		return 0;
+	}
+
+	while (length > 0) {
+		// 要填充的slot还被序号小nslots的块占用时，先把它写出
+		while (out->filled - out->written >= out->nslots)
+			if (output_drain(out))
+				return -1;
+		s = &out->slots[out->filled % out->nslots];
+		n = CHUNK_SIZE - s->inlen;
+		if (n > length)
+			n = length;
+		memcpy(s->in + s->inlen, buffer, n);
+		s->inlen += n;
+		buffer = (const uint8_t*)buffer + n;
+		length -= n;
+		if (s->inlen == CHUNK_SIZE)
+			output_submit(out);
+	}
+	return 0;
+}
+
+/**
+ * 功能：结束输出补丁的压缩数据流，写出所有剩余的块
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+static int output_close(struct output* out)
+{
+	int bz2err, i, result = 0;
+
+	if (out->threads == 1) {
+		BZ2_bzWriteClose(&bz2err, out->bz2, 0, NULL, NULL);
+		return (bz2err == BZ_OK) ? 0 : -1;
+	}
+
+	// 最后一块不满也要压缩；一个字节都没有写入时至少输出一个空流
+	if (out->slots[out->filled % out->nslots].inlen > 0 || out->filled == 0)
+		output_submit(out);
+	while (out->written < out->filled)
+		if (output_drain(out))
+			result = -1;
+
+	pthread_mutex_lock(&out->lock);
+	out->stop = 1;
+	pthread_cond_broadcast(&out->work);
+	pthread_mutex_unlock(&out->lock);
+	for (i = 0; i < out->threads; i++)
+		pthread_join(out->workers[i], NULL);
+
+	for (i = 0; i < out->nslots; i++) {
+		free(out->slots[i].in);
+		free(out->slots[i].out);
+	}
+	free(out->slots);
+	free(out->workers);
+	return result;
+}
+
+/**
+ * 功能：从输入复制length字节的diff或extra数据到输出（或暂存区）
+ * 参数：
+ *   - in/out: 输入、输出数据流
+ *   - length: 字节数
+ *   - stash: 非NULL时追加到这里而不是写出（容量由调用者保证）
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+static int copydata(struct input* in, struct output* out, int64_t length, uint8_t* stash)
+{
+	uint8_t buf[COPY_SIZE];
+	int64_t n;
+
+	if (stash != NULL)
+		return input_read(in, stash, length);
+	for (; length > 0; length -= n) {
+		n = length > COPY_SIZE ? COPY_SIZE : length;
+		if (input_read(in, buf, n) || output_write(out, buf, n))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * 功能：BSDIFF44输出时正在组装的控制块
+ */
+struct block
+{
+	int64_t ctrl[BSDIFF44_BLOCK_RECORDS][4];  // 控制记录
+	int n;                                    // 记录数
+	uint8_t* data;                            // 各记录的diff数据和extra数据（最多BLOCK_DATA_LIMIT字节）
+	int64_t len;                              // data中的字节数
+};
+
+/**
+ * 功能：写出控制块的块头和控制数据，以及已暂存的各记录数据
+ * 参数：
+ *   - out: 输出数据流
+ *   - b: 控制块（写出后清空）
+ *   - fields: 每条记录的控制值个数
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ */
+static int flushblock(struct output* out, struct block* b, int fields)
+{
+	uint8_t buf[4 + BSDIFF44_BLOCK_BYTES(4)];
+	int64_t v;
+	int i, j, len;
+
+	if (b->n == 0)
+		return 0;
+	for (i = 0, len = 4; i < b->n; i++)
+		for (j = 0; j < fields; j++) {
+			v = b->ctrl[i][j];
+			// 最后一个控制值是有符号偏移，使用zigzag编码
+			len += bscodec_varintout((j < fields - 1) ? (uint64_t)v : ((uint64_t)v << 1) ^ (uint64_t)(v >> 63), buf + len);
+		}
+	buf[0] = b->n & 0xFF; buf[1] = b->n >> 8;
+	buf[2] = (len - 4) & 0xFF; buf[3] = (len - 4) >> 8;
+	if (output_write(out, buf, len) || output_write(out, b->data, b->len))
+		return -1;
+	b->n = 0;
+	b->len = 0;
+	return 0;
+}
+
+/**
+ * 功能：转码全部控制记录及其数据
+ * 参数：
+ *   - in/out: 输入、输出数据流
+ *   - informat/outformat: 输入、输出格式
+ *   - fields: 每条记录的控制值个数（普通补丁为3，多基准补丁为4）
+ *   - newsize: 新文件大小（所有记录的diff和extra长度之和）
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 补丁损坏或写入失败
+ */
+static int transcode(struct input* in, struct output* out, int informat, int outformat,
+		int fields, int64_t newsize)
+{
+	uint8_t buf[4 + BSDIFF44_BLOCK_BYTES(4)];
+	int64_t inblock[BSDIFF44_BLOCK_RECORDS][4];  // 输入的当前控制块
+	int nin = 0, iin = 0;                         // 输入控制块的记录数、下一条要使用的记录
+	int64_t ctrl[4];
+	int64_t newpos = 0, size;
+	struct block* b = NULL;
+	int i, len, result = -1;
+
+	if (outformat == BSDIFF_FORMAT_44 &&
+		((b = calloc(1, sizeof(*b))) == NULL || (b->data = malloc(BLOCK_DATA_LIMIT)) == NULL))
+		goto out;
+
+	while (newpos < newsize) {
+		/* 读取一条控制记录 */
+		if (informat == BSDIFF_FORMAT_44) {
+			if (iin == nin) {
+				// 读取块头和整块控制数据
+				if (input_read(in, buf, 4))
+					goto out;
+				nin = buf[0] | (buf[1] << 8);
+				len = buf[2] | (buf[3] << 8);
+				if (nin < 1 || nin > BSDIFF44_BLOCK_RECORDS || len > BSDIFF44_BLOCK_BYTES(fields) ||
+					input_read(in, buf, len) || bscodec_decodeblock(buf, len, inblock, nin, fields))
+					goto out;
+				iin = 0;
+			}
+			memcpy(ctrl, inblock[iin++], sizeof(ctrl));
+		} else {
+			if (input_read(in, buf, 24))
+				goto out;
+			for (i = 0; i < 3; i++)
+				ctrl[i] = bscodec_offtin(buf + 8 * i);
+		}
+
+		// 与bspatch相同的检查，保证输出的补丁同样可以被应用
+		if (ctrl[0] < 0 || ctrl[0] > INT_MAX || ctrl[1] < 0 || ctrl[1] > INT_MAX ||
+			ctrl[0] + ctrl[1] > newsize - newpos)
+			goto out;
+		newpos += ctrl[0] + ctrl[1];
+		size = ctrl[0] + ctrl[1];
+
+		/* 写出控制记录和数据 */
+		if (outformat == BSDIFF_FORMAT_43) {
+			for (i = 0; i < 3; i++)
+				bscodec_offtout(ctrl[i], buf + 8 * i);
+			if (output_write(out, buf, 24) || copydata(in, out, size, NULL))
+				goto out;
+			continue;
+		}
+		// BSDIFF44：记录凑满一块，或暂存的数据放不下这条记录时，先写出当前块
+		if ((b->n == BSDIFF44_BLOCK_RECORDS || b->len + size > BLOCK_DATA_LIMIT) &&
+			flushblock(out, b, fields))
+			goto out;
+		memcpy(b->ctrl[b->n++], ctrl, sizeof(ctrl));
+		if (size > BLOCK_DATA_LIMIT) {
+			// 单条记录的数据超过上限：这一块只有这一条记录，控制数据之后直接复制数据
+			if (flushblock(out, b, fields) || copydata(in, out, size, NULL))
+				goto out;
+		} else {
+			if (copydata(in, out, size, b->data + b->len))
+				goto out;
+			b->len += size;
+		}
+	}
+	if (b != NULL && flushblock(out, b, fields))
+		goto out;
+	result = 0;
+
+out:
+	if (b != NULL)
+		free(b->data);
+	free(b);
+	return result;
+}
+
+/**
+ * 功能：读取输入补丁的文件头
+ * 参数：
+ *   - f: 补丁文件（读取后位于文件头之后）
+ *   - newsize: 输出新文件大小
+ *   - flags: 输出BSDIFF44文件头的标志位（BSDIFF43为0）
+ *   - nrefs: 输出多基准补丁的旧文件个数（普通补丁为0）
+ *   - digests: 输出旧文件和新文件的摘要（带BSDIFF44_HEADER_DIGESTS时）
+ * 返回：
+ *   - 输入补丁的格式，文件头无效时直接退出
+ */
+static int readheader(FILE* f, int64_t* newsize, int64_t* flags, int64_t* nrefs, uint8_t digests[64])
+{
+	uint8_t header[24], buf[8];
+	int format;
+
+	*flags = 0;
+	*nrefs = 0;
+	if (fread(header, 1, 24, f) != 24)
+		errx(1, "Corrupt patch\n");
+	if (memcmp(header, "ENDSLEY/BSDZSTD1", 16) == 0)
+		errx(1, "zstd engine patches have no control records and cannot be transcoded\n");
+	if (memcmp(header, "ENDSLEY/BSDIFF43", 16) == 0)
+		format = BSDIFF_FORMAT_43;
+	else if (memcmp(header, "ENDSLEY/BSDIFF44", 16) == 0)
+		format = BSDIFF_FORMAT_44;
+	else
+		errx(1, "Corrupt patch\n");
+	if ((*newsize = bscodec_offtin(header + 16)) < 0)
+		errx(1, "Corrupt patch\n");
+	if (format == BSDIFF_FORMAT_44) {
+		if (fread(buf, 1, 8, f) != 8)
+			errx(1, "Corrupt patch\n");
+		*flags = bscodec_offtin(buf);
+		if (*flags & ~(int64_t)(BSDIFF44_HEADER_MULTIREF | BSDIFF44_HEADER_FILTER_X86 |
+				BSDIFF44_HEADER_FILTER_ARM64 | BSDIFF44_HEADER_DIGESTS))
+			errx(1, "Unsupported patch flags\n");
+		if ((*flags & BSDIFF44_HEADER_MULTIREF) && (fread(buf, 1, 8, f) != 8 || (*nrefs = bscodec_offtin(buf)) < 1))
+			errx(1, "Corrupt patch\n");
+		if ((*flags & BSDIFF44_HEADER_DIGESTS) && fread(digests, 1, 64, f) != 64)
+			errx(1, "Corrupt patch\n");
+	}
+	return format;
+}
+
+int main(int argc, char* argv[])
+{
+	FILE *f, *pf;
+	uint8_t buf[8], digests[64];
+	int64_t newsize, flags, nrefs;
+	int informat, outformat = -1;
+	int level = 9, threads = 1;
+	int bz2err, ch;
+	struct input in;
+	struct output out;
+
+	// 解析命令行选项
+	//   -f 43|44: 输出格式（默认与输入相同）
+	//   -l level: BZip2压缩级别（1-9，默认9）
+	//   -j threads: 压缩线程数（默认1；大于1时输出多个BZip2流）
+	while ((ch = getopt(argc, argv, "f:l:j:")) != -1) {
+		switch (ch) {
+		case 'f':
+			if (strcmp(optarg, "43") == 0) outformat = BSDIFF_FORMAT_43;
+			else if (strcmp(optarg, "44") == 0) outformat = BSDIFF_FORMAT_44;
+			else errx(1, "unknown patch format: %s\n", optarg);
+			break;
+		case 'l':
+			level = atoi(optarg);
+			if (level < 1 || level > 9) errx(1, "bzip2 level must be 1-9: %s\n", optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > 256) errx(1, "threads must be 1-256: %s\n", optarg);
+			break;
+		default: errx(1, USAGE, argv[0]);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc != 3) errx(1, USAGE, argv[0]);
+
+	/* 读取输入补丁的文件头 */
+	if ((f = fopen(argv[1], "r")) == NULL)
+		err(1, "fopen(%s)", argv[1]);
+	informat = readheader(f, &newsize, &flags, &nrefs, digests);
+	if (outformat < 0)
+		outformat = informat;
+	if (flags && outformat != BSDIFF_FORMAT_44)
+		errx(1, "multi-base, filtered or digest-carrying patches can only be written as format 44\n");
+
+	/* 写出输出补丁的文件头（标志位原样保留） */
+	if ((pf = fopen(argv[2], "w")) == NULL)
+		err(1, "%s", argv[2]);
+	bscodec_offtout(newsize, buf);
+	if (fwrite(outformat == BSDIFF_FORMAT_44 ? "ENDSLEY/BSDIFF44" : "ENDSLEY/BSDIFF43", 16, 1, pf) != 1 ||
+		fwrite(buf, 8, 1, pf) != 1)
+		err(1, "Failed to write header");
+	bscodec_offtout(flags, buf);
+	if (outformat == BSDIFF_FORMAT_44 && fwrite(buf, 8, 1, pf) != 1)
+		err(1, "Failed to write header");
+	bscodec_offtout(nrefs, buf);
+	if (nrefs && fwrite(buf, 8, 1, pf) != 1)
+		err(1, "Failed to write header");
+	if ((flags & BSDIFF44_HEADER_DIGESTS) && fwrite(digests, 64, 1, pf) != 1)
+		err(1, "Failed to write header");
+
+	/* 转码 */
+	in.f = f;
+	if ((in.bz2 = BZ2_bzReadOpen(&bz2err, f, 0, 0, NULL, 0)) == NULL)
+		errx(1, "BZ2_bzReadOpen, bz2err=%d", bz2err);
+	if (output_open(&out, pf, level, threads))
+		err(1, "output_open");
+	if (transcode(&in, &out, informat, outformat, nrefs ? 4 : 3, newsize))
+		errx(1, "Corrupt patch or write error\n");
+	if (output_close(&out))
+		errx(1, "Failed to write %s", argv[2]);
+	BZ2_bzReadClose(&bz2err, in.bz2);
+	fclose(f);
+	if (fclose(pf))
+		err(1, "fclose");
+
+	return 0;
+}
@@ -0,0 +1,140 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * zstd差分引擎
+ *
+ * 把旧文件作为zstd的前缀字典（只用于下一个帧，不做任何预处理），压缩新文件时开启
+ * 长距离匹配，并把窗口设为足以覆盖旧文件和新文件，新文件中与旧文件相同的部分就成为
+ * 对前缀的远距离引用。不需要后缀排序，速度接近普通的zstd压缩。
+ */
+
+#include "bszstd.h"
+
+#include <stdint.h>
+#include <zstd.h>
+
+// 解码时每次最多从补丁数据流读取的字节数
+#define READ_CHUNK 65536
+
+/**
+ * 功能：求覆盖size字节所需的窗口大小的对数，限制在zstd允许的范围内
+ */
+static int windowlog(int64_t size)
+{
+	int log=ZSTD_WINDOWLOG_MIN;
+
+	while((log<ZSTD_WINDOWLOG_MAX)&&(((int64_t)1<<log)<size)) log++;
+	return log;
+}
+
+int bszstd_diff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+		struct bsdiff_stream* stream, int level)
+{
+	ZSTD_CCtx* cctx;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t remaining;
+	int result=-1;
+
+	if((cctx=ZSTD_createCCtx())==NULL) return -1;
+	out.size=ZSTD_CStreamOutSize();
+	if((out.dst=stream->malloc(out.size))==NULL) {
+		ZSTD_freeCCtx(cctx);
+		return -1;
+	};
+
+	// 前缀在压缩参数确定之后引用；帧中记录新文件大小和校验和
+	if(!ZSTD_isError(ZSTD_CCtx_setParameter(cctx,ZSTD_c_compressionLevel,level)) &&
+		!ZSTD_isError(ZSTD_CCtx_setParameter(cctx,ZSTD_c_windowLog,windowlog(oldsize+newsize))) &&
+		!ZSTD_isError(ZSTD_CCtx_setParameter(cctx,ZSTD_c_enableLongDistanceMatching,1)) &&
+		!ZSTD_isError(ZSTD_CCtx_setParameter(cctx,ZSTD_c_checksumFlag,1)) &&
+		!ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(cctx,(unsigned long long)newsize)) &&
+		!ZSTD_isError(ZSTD_CCtx_refPrefix(cctx,old,(size_t)oldsize))) {
+		in.src=new;
+		in.size=(size_t)newsize;
+		in.pos=0;
+		// 一次交给压缩器全部输入，逐块取出输出，直到帧结束
+		do {
+			out.pos=0;
+			remaining=ZSTD_compressStream2(cctx,&out,&in,ZSTD_e_end);
+			if(ZSTD_isError(remaining)||
+				((out.pos>0)&&stream->write(stream,out.dst,(int)out.pos)))
+				break;
+		} while(remaining!=0);
+		if(remaining==0) result=0;
+	};
+
+	stream->free(out.dst);
+	ZSTD_freeCCtx(cctx);
+	return result;
+}
+
+int bszstd_patch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
+		struct bspatch_stream* stream)
+{
+	ZSTD_DCtx* dctx;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	uint8_t buf[READ_CHUNK];  // 补丁数据
+	size_t hint;              // 解码器建议的下一次输入大小，0表示帧已结束
+	int result=-1;
+
+	if((dctx=ZSTD_createDCtx())==NULL) return -1;
+
+	// 接受覆盖旧文件和新文件的大窗口；新文件直接解码到输出缓冲区
+	out.dst=new;
+	out.size=(size_t)newsize;
+	out.pos=0;
+	in.src=buf;
+	in.size=0;
+	in.pos=0;
+	if(!ZSTD_isError(ZSTD_DCtx_setParameter(dctx,ZSTD_d_windowLogMax,ZSTD_WINDOWLOG_MAX)) &&
+		!ZSTD_isError(ZSTD_DCtx_refPrefix(dctx,old,(size_t)oldsize))) {
+		for(;;) {
+			hint=ZSTD_decompressStream(dctx,&out,&in);
+			if(ZSTD_isError(hint)) break;
+			if(hint==0) {
+				// 帧结束：新文件必须恰好写满
+				if(out.pos==out.size) result=0;
+				break;
+			};
+			if(in.pos<in.size) {
+				// 输入没有用完说明输出已满，帧比新文件大
+				if(out.pos==out.size) break;
+				continue;
+			};
+			// 按建议的大小读取，不会读到帧之后
+			in.size=(hint<sizeof(buf)) ? hint : sizeof(buf);
+			in.pos=0;
+			if(stream->read(stream,buf,(int)in.size)) break;
+		};
+	};
+
+	ZSTD_freeDCtx(dctx);
+	return result;
+}
@@ -0,0 +1,75 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSZSTD_H
+# define BSZSTD_H
+
+# include <stdint.h>
+
+# include "bsdiff.h"
+# include "bspatch.h"
+
+// zstd引擎补丁文件的魔数（与ENDSLEY/BSDIFF43并列）。文件头为魔数和8字节的新文件大小，
+// 随后直接是一个zstd帧（不再经过bzip2压缩）
+# define BSZSTD_MAGIC "ENDSLEY/BSDZSTD1"
+
+// 推荐的压缩级别：在测试集上比后缀排序快20~50倍，级别19接近后缀排序引擎的补丁大小但慢得多
+# define BSZSTD_LEVEL_DEFAULT 9
+
+/**
+ * 功能：用zstd生成补丁：旧文件作为前缀字典，开启长距离匹配，窗口覆盖旧文件和新文件
+ * 参数：
+ *   - old/oldsize: 旧文件数据及大小
+ *   - new/newsize: 新文件数据及大小
+ *   - stream: 输出流（使用malloc/free/write）
+ *   - level: zstd压缩级别（1~22）
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败
+ *
+ * 比后缀排序快一到两个数量级，补丁略大；旧文件和新文件合计超过2GB时，
+ * 新文件的后半部分无法引用旧文件的开头
+ */
+int bszstd_diff(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+		struct bsdiff_stream* stream, int level);
+
+/**
+ * 功能：应用bszstd_diff生成的补丁
+ * 参数：
+ *   - old/oldsize: 旧文件数据及大小
+ *   - new/newsize: 新文件数据缓冲区（输出）及大小
+ *   - stream: 补丁数据流，只读取到zstd帧的末尾为止
+ * 返回：
+ *   - 0: 成功
+ *   - -1: 失败（读取错误、数据损坏或校验失败）
+ *
+ * zstd解码器内部还会分配一个约为新文件大小的缓冲区
+ */
+int bszstd_patch(const uint8_t* old, int64_t oldsize, uint8_t* new, int64_t newsize,
+		struct bspatch_stream* stream);
+
+#endif
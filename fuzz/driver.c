@@ -0,0 +1,183 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 模糊测试目标的独立驱动程序，不需要libFuzzer：
+ *   - 给出文件时依次用每个文件的内容调用目标（用于复现问题或回归检查）；
+ *   - 否则生成-n个伪随机输入。输入由随机片段和对前文的带少量改动的复制拼接而成，
+ *     前后两半相似、内部有大量重复，正好覆盖后缀排序的长公共前缀和差分的对齐路径
+ * 目标调用abort()或崩溃时，当前输入写入fuzz-crash.bin，可以再作为文件参数复现
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fuzz.h"
+
+#define USAGE "usage: %s [-n runs] [-s seed] [-m maxlen] [file...]\n"
+#define CRASH_FILE "fuzz-crash.bin"
+
+static const uint8_t* current;  // 正在测试的输入（供信号处理函数保存）
+static size_t currentsize;
+
+/**
+ * 功能：目标中止或崩溃时保存当前输入，然后按默认方式结束进程
+ * 参数：
+ *   - sig: 信号
+ *
+ * 注意：只使用异步信号安全的函数
+ */
+static void savecrash(int sig)
+{
+	ssize_t n;
+	int fd;
+
+	if (current != NULL && (fd = open(CRASH_FILE, O_CREAT|O_TRUNC|O_WRONLY, 0644)) >= 0) {
+		n = write(fd, current, currentsize);  // 保存失败也无法在这里报告
+		(void)n;
+		close(fd);
+	}
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/**
+ * 功能：xorshift64伪随机数
+ */
+static uint64_t nextrand(uint64_t* s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/**
+ * 功能：生成一个测试输入
+ * 参数：
+ *   - s: 随机数状态
+ *   - buf: 输出缓冲区（至少maxlen字节）
+ *   - maxlen: 最大长度
+ * 返回：输入长度
+ */
+static size_t generate(uint64_t* s, uint8_t* buf, size_t maxlen)
+{
+	size_t len, n, i, src;
+	int alphabet;
+
+	len = nextrand(s) % (maxlen + 1);
+	// 字母表越小，重复越多，后缀排序需要的轮数越多
+	alphabet = (int[]){ 2, 4, 16, 256 }[nextrand(s) % 4];
+	for (n = 0; n < len; ) {
+		if (n > 16 && nextrand(s) % 3 != 0) {
+			/* 复制前文的一段，并改动其中少量字节 */
+			src = nextrand(s) % n;
+			for (i = 0; i < 1 + nextrand(s) % 512 && n < len; i++, n++)
+				buf[n] = buf[src + i % (n - src)];
+			for (i = nextrand(s) % 3; i > 0; i--)
+				buf[n - 1 - nextrand(s) % (n - src < 64 ? n - src : 64)] = (uint8_t)nextrand(s);
+		} else {
+			/* 随机片段 */
+			for (i = 0; i < 1 + nextrand(s) % 64 && n < len; i++, n++)
+				buf[n] = (uint8_t)(nextrand(s) % alphabet);
+		}
+	}
+	return len;
+}
+
+/**
+ * 功能：读入整个文件
+ */
+static uint8_t* readfile(const char* path, size_t* size)
+{
+	FILE* f;
+	uint8_t* buf;
+	long n;
+
+	if ((f = fopen(path, "rb")) == NULL || fseek(f, 0, SEEK_END) || (n = ftell(f)) < 0 ||
+		fseek(f, 0, SEEK_SET) || (buf = malloc(n + 1)) == NULL ||
+		fread(buf, 1, n, f) != (size_t)n)
+		err(1, "%s", path);
+	fclose(f);
+	*size = n;
+	return buf;
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t seed = 1, s;
+	long runs = 1000, r;
+	size_t maxlen = 65536, size;
+	uint8_t* buf;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "n:s:m:")) != -1) {
+		switch (ch) {
+		case 'n': runs = atol(optarg); break;
+		case 's': seed = strtoull(optarg, NULL, 10); break;
+		case 'm': maxlen = strtoul(optarg, NULL, 10); break;
+		default: errx(1, USAGE, argv[0]);
+		}
+	}
+	signal(SIGABRT, savecrash);
+	signal(SIGSEGV, savecrash);
+	signal(SIGBUS, savecrash);
+
+	/* 复现：依次测试给出的文件 */
+	if (optind < argc) {
+		for (i = optind; i < argc; i++) {
+			buf = readfile(argv[i], &size);
+			current = buf;
+			currentsize = size;
+			LLVMFuzzerTestOneInput(buf, size);
+			free(buf);
+		}
+		printf("%d inputs ok\n", argc - optind);
+		return 0;
+	}
+
+	/* 生成随机输入；每个输入的种子由seed和序号决定，出问题时可以单独重跑 */
+	if ((buf = malloc(maxlen + 1)) == NULL)
+		err(1, NULL);
+	for (r = 0; r < runs; r++) {
+		s = (seed * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)(r + 1);
+		if (s == 0)
+			s = 1;
+		size = generate(&s, buf, maxlen);
+		current = buf;
+		currentsize = size;
+		LLVMFuzzerTestOneInput(buf, size);
+	}
+	free(buf);
+	printf("%ld runs ok (seed %llu)\n", runs, (unsigned long long)seed);
+	return 0;
+}
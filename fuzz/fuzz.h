@@ -0,0 +1,61 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSDIFF_FUZZ_H
+# define BSDIFF_FUZZ_H
+
+# include <stddef.h>
+# include <stdint.h>
+
+/**
+ * 功能：模糊测试目标的入口（libFuzzer约定的接口）
+ * 参数：
+ *   - data/size: 一个测试输入
+ * 返回：
+ *   - 0（发现问题时打印原因并调用abort()）
+ *
+ * 每个fuzz_*.c实现一个目标。链接libFuzzer（configure --enable-libfuzzer）时由libFuzzer
+ * 生成输入；否则与driver.c链接，由其中的main生成输入或读取文件
+ */
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+/**
+ * 功能：参考实现的后缀排序（原版bsdiff的qsufsort，见refsort.c）
+ * 参数：
+ *   - I: 后缀数组（输出，oldsize+1项）
+ *   - V: 逆后缀数组（输出，oldsize+1项）
+ *   - old/oldsize: 数据及其大小
+ */
+void refsort(int64_t *I, int64_t *V, const uint8_t *old, int64_t oldsize);
+
+/**
+ * 功能：报告问题并中止（driver.c会把当前输入保存下来）
+ */
+# define FUZZ_CHECK(cond, what) \
+	do { if (!(cond)) { fprintf(stderr, "fuzz: %s (%s:%d)\n", (what), __FILE__, __LINE__); abort(); } } while (0)
+
+#endif
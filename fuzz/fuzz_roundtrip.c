@@ -0,0 +1,255 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 模糊测试目标：差分后应用补丁必须精确还原新文件
+ * 输入的第1个字节选择标志位（BSDIFF_FLAG_PREPASS/SEARCHTABLE/CONTINUE）和时间预算的大小，
+ * 第2、3个字节决定旧文件所占的比例（第3个字节还决定多基准时旧文件的切分位置），其余部分
+ * 切分为旧文件和新文件。补丁都写入内存，再由bspatch_ex从内存读回，每个输入依次检查：
+ *   - bsdiff_ex：BSDIFF43和BSDIFF44两种格式；
+ *   - bsdiff_index_diff：不使用相同区域预处理时补丁与bsdiff_ex完全相同；
+ *   - bsdiff_streaming：Makefile.am用-D把窗口和向后看的长度改得很小，使强制截断的路径也被执行；
+ *   - bsdiff_multi：旧文件切成两个基准；
+ *   - 时间预算：预算只有输入大小对应的几十微秒，依次触发各种降级策略；
+ *   - bsfilter_encode/bsfilter_decode：x86和arm64过滤器编码后必须能解码回原样
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../bsdiff.h"
+#include "../bspatch.h"
+#include "../bsfilter.h"
+#include "fuzz.h"
+
+/**
+ * 功能：内存中的补丁数据
+ */
+struct membuf
+{
+	uint8_t* data;
+	size_t size, cap;    // 已写入的长度、容量
+	size_t pos;          // 读取位置
+};
+
+/**
+ * 功能：内存中的新文件（bsdiff_streaming的输入）
+ */
+struct memin
+{
+	const uint8_t* data;
+	int64_t size, pos;   // 长度、读取位置
+};
+
+static void* fuzz_malloc(size_t size) { return malloc(size); }
+static void fuzz_free(void* ptr) { free(ptr); }
+
+/**
+ * 功能：把补丁数据追加到内存中
+ */
+static int mem_write(struct bsdiff_stream* stream, const void* buffer, int size)
+{
+	struct membuf* m = (struct membuf*)stream->opaque;
+	uint8_t* grown;
+
+	if (m->size + size > m->cap) {
+		m->cap = 2 * (m->size + size) + 4096;
+		if ((grown = realloc(m->data, m->cap)) == NULL)
+			return -1;
+		m->data = grown;
+	}
+	memcpy(m->data + m->size, buffer, size);
+	m->size += size;
+	return 0;
+}
+
+/**
+ * 功能：从内存中读取补丁数据，超出写入的长度时失败
+ */
+static int mem_read(const struct bspatch_stream* stream, void* buffer, int length)
+{
+	struct membuf* m = (struct membuf*)stream->opaque;
+
+	if (length < 0 || m->size - m->pos < (size_t)length)
+		return -1;
+	memcpy(buffer, m->data + m->pos, length);
+	m->pos += length;
+	return 0;
+}
+
+/**
+ * 功能：从内存中按顺序读取新文件，超出新文件末尾时失败
+ */
+static int mem_input(const struct bsdiff_input* input, void* buffer, int length)
+{
+	struct memin* in = (struct memin*)input->opaque;
+
+	if (length < 0 || in->size - in->pos < length)
+		return -1;
+	memcpy(buffer, in->data + in->pos, length);
+	in->pos += length;
+	return 0;
+}
+
+/**
+ * 功能：应用内存中的补丁，结果必须与新文件相同，且恰好读完整个补丁
+ * 参数：
+ *   - old/oldsize/new/newsize: 新旧文件
+ *   - m: 补丁数据（从头读取）
+ *   - poptions: bspatch_ex的可选参数
+ *   - result: 输出缓冲区（newsize+1字节）
+ *   - what: 出错时报告的差分函数名
+ */
+static void checkpatch(const uint8_t* old, int64_t oldsize, const uint8_t* new, int64_t newsize,
+		struct membuf* m, const struct bspatch_options* poptions, uint8_t* result, const char* what)
+{
+	struct bspatch_stream in;
+
+	in.opaque = m;
+	in.read = mem_read;
+	m->pos = 0;
+	memset(result, 0, newsize + 1);
+	if (bspatch_ex(old, oldsize, result, newsize, &in, poptions) != 0 ||
+		memcmp(result, new, newsize) != 0 || m->pos != m->size) {
+		fprintf(stderr, "fuzz: patch from %s does not reproduce new\n", what);
+		abort();
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	static const int formats[2] = { BSDIFF_FORMAT_43, BSDIFF_FORMAT_44 };
+	static const int filters[2] = { BSFILTER_X86, BSFILTER_ARM64 };
+	struct bsdiff_stream out;
+	struct bsdiff_options options;
+	struct bspatch_options poptions;
+	struct bsdiff_index* index;
+	struct bsdiff_input input;
+	struct memin min;
+	struct membuf m;
+	const uint8_t *old, *new;
+	const uint8_t* refs[2];
+	int64_t refsizes[2], refpos[2];
+	int64_t oldsize, newsize;
+	uint8_t *result, *expect;
+	size_t expectsize;
+	int f, degraded;
+
+	if (size < 3)
+		return 0;
+	oldsize = (int64_t)((size - 3) * (((size_t)data[1] << 8) | data[2]) / 65536);
+	old = data + 3;
+	new = old + oldsize;
+	newsize = (int64_t)(size - 3) - oldsize;
+	if ((result = malloc(newsize + 1)) == NULL)
+		abort();
+
+	memset(&m, 0, sizeof(m));
+	out.opaque = &m;
+	out.malloc = fuzz_malloc;
+	out.free = fuzz_free;
+	out.write = mem_write;
+
+	for (f = 0; f < 2; f++) {
+		memset(&options, 0, sizeof(options));
+		options.flags = (data[0] & (BSDIFF_FLAG_PREPASS | BSDIFF_FLAG_SEARCHTABLE | BSDIFF_FLAG_CONTINUE)) |
+			BSDIFF_FLAG_CHECKSORT;
+		options.format = formats[f];
+		m.size = 0;
+		FUZZ_CHECK(bsdiff_ex(old, oldsize, new, newsize, &out, &options) == 0, "bsdiff_ex failed");
+
+		memset(&poptions, 0, sizeof(poptions));
+		poptions.format = formats[f];
+		checkpatch(old, oldsize, new, newsize, &m, &poptions, result, "bsdiff_ex");
+	}
+
+	/* 以下都使用BSDIFF44，options和poptions沿用上面最后一次的设置 */
+	if ((expect = malloc(m.size + 1)) == NULL)
+		abort();
+	memcpy(expect, m.data, m.size);
+	expectsize = m.size;
+
+	/* 预先构建的索引 */
+	FUZZ_CHECK((index = bsdiff_index_build(old, oldsize, &out, &options)) != NULL, "bsdiff_index_build failed");
+	m.size = 0;
+	FUZZ_CHECK(bsdiff_index_diff(index, new, newsize, &out, &options) == 0, "bsdiff_index_diff failed");
+	bsdiff_index_free(index, &out);
+	checkpatch(old, oldsize, new, newsize, &m, &poptions, result, "bsdiff_index_diff");
+	if (!(options.flags & BSDIFF_FLAG_PREPASS))
+		FUZZ_CHECK(m.size == expectsize && memcmp(m.data, expect, expectsize) == 0,
+			"bsdiff_index_diff differs from bsdiff_ex");
+
+	/* 流式输入 */
+	min.data = new;
+	min.size = newsize;
+	min.pos = 0;
+	input.opaque = &min;
+	input.read = mem_input;
+	m.size = 0;
+	FUZZ_CHECK(bsdiff_streaming(old, oldsize, &input, newsize, &out, &options) == 0, "bsdiff_streaming failed");
+	FUZZ_CHECK(min.pos == newsize, "bsdiff_streaming did not read the whole input");
+	checkpatch(old, oldsize, new, newsize, &m, &poptions, result, "bsdiff_streaming");
+
+	/* 多基准：旧文件切成两段 */
+	refs[0] = old;
+	refsizes[0] = oldsize * data[2] / 256;
+	refs[1] = old + refsizes[0];
+	refsizes[1] = oldsize - refsizes[0];
+	m.size = 0;
+	FUZZ_CHECK(bsdiff_multi(refs, refsizes, 2, new, newsize, &out, &options) == 0, "bsdiff_multi failed");
+	poptions.nrefs = 2;
+	poptions.refs = refs;
+	poptions.refsizes = refsizes;
+	poptions.refpos = refpos;
+	refpos[0] = refpos[1] = 0;
+	checkpatch(NULL, 0, new, newsize, &m, &poptions, result, "bsdiff_multi");
+	poptions.nrefs = 0;
+
+	/* 时间预算：约为输出每字节0.1~0.8微秒，结果与耗时有关，只检查补丁有效 */
+	options.budget = 1e-7 * (double)(size + 1) * (1 + ((data[0] >> 4) & 7));
+	options.degraded = &degraded;
+	degraded = 0;
+	m.size = 0;
+	FUZZ_CHECK(bsdiff_ex(old, oldsize, new, newsize, &out, &options) == 0, "bsdiff_ex with a budget failed");
+	FUZZ_CHECK((degraded & ~(BSDIFF_DEGRADE_SEARCH | BSDIFF_DEGRADE_STRIDE | BSDIFF_DEGRADE_EXTRA |
+			BSDIFF_DEGRADE_SORT)) == 0, "unknown degradation reported");
+	checkpatch(old, oldsize, new, newsize, &m, &poptions, result, "bsdiff_ex with a budget");
+
+	/* 预处理过滤器：编码后解码必须还原 */
+	for (f = 0; f < 2; f++) {
+		memcpy(result, new, newsize);
+		bsfilter_encode(result, newsize, filters[f]);
+		bsfilter_decode(result, newsize, filters[f]);
+		FUZZ_CHECK(memcmp(result, new, newsize) == 0, "bsfilter_decode did not restore the input");
+	}
+
+	free(expect);
+	free(m.data);
+	free(result);
+	return 0;
+}
@@ -0,0 +1,128 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 模糊测试目标：后缀排序和搜索内核
+ *   - bsdiff.c中的qsufsort（或替换它的排序引擎）必须与参考实现refsort输出完全相同的
+ *     后缀数组，checksort必须接受它，并拒绝交换了相邻两项的结果；
+ *   - searchtable与search必须返回相同的位置和长度；
+ *   - searchnear必须返回与search相同的位置和长度；
+ *   - search和searchnear返回的长度必须等于该位置实际的匹配长度，且matchlen与逐字节比较一致
+ * 直接包含bsdiff.c以便调用其中的静态函数
+ */
+
+#include "../bsdiff.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fuzz.h"
+
+// 输入超过这个长度时只取前面部分（参考实现的排序是O(n log n)，但常数较大）
+#define FUZZ_SORT_MAX (256 * 1024)
+// 每个输入最多检查的搜索次数
+#define FUZZ_SEARCHES 64
+
+static void* fuzz_malloc(size_t size) { return malloc(size); }
+static void fuzz_free(void* ptr) { free(ptr); }
+
+/**
+ * 功能：逐字节计算匹配长度（matchlen的参考实现）
+ */
+static int64_t refmatch(const uint8_t* a, int64_t an, const uint8_t* b, int64_t bn)
+{
+	int64_t i;
+
+	for (i = 0; i < an && i < bn && a[i] == b[i]; i++);
+	return i;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	struct bsdiff_stream stream;
+	struct bsdiff_index idx;
+	int64_t *RI, *RV, *I, *V;
+	int64_t oldsize, i, k, q, newsize, pos, tpos, len, tlen, tmp;
+	const uint8_t *old, *new;
+	uint8_t* query;
+
+	oldsize = (size > FUZZ_SORT_MAX) ? FUZZ_SORT_MAX : (int64_t)size;
+	old = data;
+	stream.malloc = fuzz_malloc;
+	stream.free = fuzz_free;
+
+	/* 排序：与参考实现逐项比较 */
+	FUZZ_CHECK(buildindex(&idx, old, oldsize, BSDIFF_FLAG_CONTINUE | BSDIFF_FLAG_SEARCHTABLE,
+			NULL, NULL, &stream) == 0, "buildindex failed");
+	I = idx.I;
+	V = idx.V;
+	if ((RI = malloc((oldsize + 1) * sizeof(int64_t))) == NULL ||
+		(RV = malloc((oldsize + 1) * sizeof(int64_t))) == NULL)
+		abort();
+	refsort(RI, RV, old, oldsize);
+	FUZZ_CHECK(memcmp(I, RI, (oldsize + 1) * sizeof(int64_t)) == 0, "suffix array differs from reference qsufsort");
+	FUZZ_CHECK(memcmp(V, RV, (oldsize + 1) * sizeof(int64_t)) == 0, "inverse suffix array differs from reference qsufsort");
+	FUZZ_CHECK(checksort(I, V, old, oldsize) == 0, "checksort rejected the suffix array");
+
+	/* 校验：交换相邻两项（同时更新逆数组，使其仍是排列）后必须被拒绝 */
+	if (oldsize >= 2) {
+		k = 1 + (int64_t)(data[0] % (oldsize - 1));
+		tmp = RI[k]; RI[k] = RI[k + 1]; RI[k + 1] = tmp;
+		RV[RI[k]] = k;
+		RV[RI[k + 1]] = k + 1;
+		FUZZ_CHECK(checksort(RI, RV, old, oldsize) != 0, "checksort accepted a misordered suffix array");
+	}
+
+	/* 搜索：以输入中的若干位置（改动一个字节）作为new */
+	if ((query = malloc(size + 1)) == NULL)
+		abort();
+	for (q = 0; q < FUZZ_SEARCHES && q < (int64_t)size; q++) {
+		i = (int64_t)((uint64_t)q * size / FUZZ_SEARCHES);
+		newsize = (int64_t)size - i;
+		memcpy(query, data + i, newsize);
+		query[(data[i] * 7) % newsize] ^= (uint8_t)(q + 1);
+		new = query;
+
+		len = search(I, old, oldsize, new, newsize, 0, oldsize, &pos);
+		FUZZ_CHECK(len == refmatch(old + pos, oldsize - pos, new, newsize), "search length is not the match length");
+		FUZZ_CHECK(matchlen(old + pos, oldsize - pos, new, newsize) == len, "matchlen disagrees with byte compare");
+
+		tlen = searchtable(idx.T, idx.levels, I, old, oldsize, new, newsize, &tpos);
+		FUZZ_CHECK(tlen == len && tpos == pos, "searchtable differs from search");
+
+		// 就近搜索在比较结果不单调时退回search，结果必须完全相同
+		tlen = searchnear(I, old, oldsize, new, newsize, V[(i + 1 < oldsize) ? i + 1 : oldsize], &tpos);
+		FUZZ_CHECK(tlen == refmatch(old + tpos, oldsize - tpos, new, newsize), "searchnear length is not the match length");
+		FUZZ_CHECK(tlen == len && tpos == pos, "searchnear differs from search");
+	}
+
+	free(query);
+	free(RI);
+	free(RV);
+	freeindex(&idx, &stream);
+	return 0;
+}